@@ -0,0 +1,568 @@
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+#include "async_io.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#define AIO_CHUNK (1 << 20)  // larger files are transferred as several operations in flight at once
+#define AIO_THREADS 4
+
+struct AioOp {
+    IoRequest *req;
+    uint8_t *data;
+    size_t size;
+    uint64_t offset;
+    AioOp *next;
+#ifndef _WIN32
+    struct iovec iov;
+#endif
+};
+
+struct AsyncIO {
+    bool uring;
+    jxr_allocator buffers;
+    uint32_t depth;
+    uint32_t inFlight;
+
+    uint64_t requests;
+    uint64_t operations;
+    uint64_t submitCalls;
+    uint64_t bytes;
+    uint32_t maxDepth;
+    double depthSum;
+    double waitSeconds;
+
+#ifdef __linux__
+    int ringFd;
+    uint32_t sqEntries;
+    uint32_t toSubmit;
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    struct io_uring_sqe *sqes;
+    uint32_t *sqHead;
+    uint32_t *sqTail;
+    uint32_t *sqMask;
+    uint32_t *sqArray;
+    uint32_t *cqHead;
+    uint32_t *cqTail;
+    uint32_t *cqMask;
+    struct io_uring_cqe *cqes;
+#endif
+
+    std::mutex mutex;
+    std::condition_variable work;
+    std::condition_variable completed;
+    AioOp *queueHead;
+    AioOp *queueTail;
+    bool stopping;
+    std::vector<std::thread> threads;
+};
+
+#ifdef _WIN32
+static wchar_t *wide_path(const char *path) {
+    int len = MultiByteToWideChar(CP_UTF8, 0, path, -1, nullptr, 0);
+    auto wpath = (wchar_t *) malloc(len * sizeof(wchar_t));
+    if (wpath) {
+        MultiByteToWideChar(CP_UTF8, 0, path, -1, wpath, len);
+    }
+    return wpath;
+}
+
+static intptr_t file_open(const char *path, bool write, int *error) {
+    wchar_t *wpath = wide_path(path);
+    HANDLE h = wpath ? CreateFileW(wpath, write ? GENERIC_WRITE : GENERIC_READ, write ? 0 : FILE_SHARE_READ, nullptr,
+                                   write ? CREATE_ALWAYS : OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr)
+                     : INVALID_HANDLE_VALUE;
+    free(wpath);
+    if (h == INVALID_HANDLE_VALUE) {
+        *error = EIO;
+        return -1;
+    }
+    return (intptr_t) h;
+}
+
+static int file_size(intptr_t fd, size_t *size) {
+    LARGE_INTEGER s;
+    if (!GetFileSizeEx((HANDLE) fd, &s)) {
+        return EIO;
+    }
+    *size = (size_t) s.QuadPart;
+    return 0;
+}
+
+static void file_close(intptr_t fd) {
+    CloseHandle((HANDLE) fd);
+}
+
+// Positioned blocking transfer of a whole operation
+static int file_transfer(intptr_t fd, AioOp *op, bool write) {
+    size_t done = 0;
+    while (done < op->size) {
+        OVERLAPPED ov = {};
+        uint64_t offset = op->offset + done;
+        ov.Offset = (DWORD) offset;
+        ov.OffsetHigh = (DWORD) (offset >> 32);
+        DWORD n = 0;
+        DWORD len = (DWORD) (op->size - done);
+        BOOL ok = write ? WriteFile((HANDLE) fd, op->data + done, len, &n, &ov)
+                        : ReadFile((HANDLE) fd, op->data + done, len, &n, &ov);
+        if (!ok || n == 0) {
+            return EIO;
+        }
+        done += n;
+    }
+    return 0;
+}
+#else
+static intptr_t file_open(const char *path, bool write, int *error) {
+    int fd = write ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        *error = errno;
+    }
+    return fd;
+}
+
+static int file_size(intptr_t fd, size_t *size) {
+    struct stat st;
+    if (fstat((int) fd, &st)) {
+        return errno;
+    }
+    *size = (size_t) st.st_size;
+    return 0;
+}
+
+static void file_close(intptr_t fd) {
+    close((int) fd);
+}
+
+static int file_transfer(intptr_t fd, AioOp *op, bool write) {
+    size_t done = 0;
+    while (done < op->size) {
+        ssize_t n = write ? pwrite((int) fd, op->data + done, op->size - done, (off_t) (op->offset + done))
+                          : pread((int) fd, op->data + done, op->size - done, (off_t) (op->offset + done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n < 0 ? errno : EIO;
+        }
+        done += (size_t) n;
+    }
+    return 0;
+}
+#endif
+
+// Called once per finished operation, with the mutex held for the thread backend
+static void complete_op(AsyncIO *aio, AioOp *op, int error) {
+    IoRequest *req = op->req;
+    aio->inFlight--;
+
+    if (error && !req->error) {
+        req->error = error;
+    }
+
+    if (--req->pending == 0) {
+        file_close(req->fd);
+        free(req->ops);
+        req->ops = nullptr;
+        req->done = true;
+    }
+}
+
+static void io_thread(AsyncIO *aio) {
+    std::unique_lock<std::mutex> lock(aio->mutex);
+    while (true) {
+        aio->work.wait(lock, [aio] { return aio->stopping || aio->queueHead != nullptr; });
+        if (aio->queueHead == nullptr) {
+            return;
+        }
+
+        AioOp *op = aio->queueHead;
+        aio->queueHead = op->next;
+        if (aio->queueHead == nullptr) {
+            aio->queueTail = nullptr;
+        }
+
+        lock.unlock();
+        int error = file_transfer(op->req->fd, op, op->req->write);
+        lock.lock();
+
+        complete_op(aio, op, error);
+        aio->completed.notify_all();
+    }
+}
+
+#ifdef __linux__
+static int uring_setup(AsyncIO *aio, uint32_t entries) {
+    struct io_uring_params p = {};
+    int fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) {
+        return 1;
+    }
+
+    aio->ringFd = fd;
+    aio->sqEntries = p.sq_entries;
+    aio->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    aio->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        aio->sqRingSize = aio->cqRingSize = aio->sqRingSize > aio->cqRingSize ? aio->sqRingSize : aio->cqRingSize;
+    }
+
+    aio->sqRing = mmap(nullptr, aio->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                       IORING_OFF_SQ_RING);
+    aio->cqRing = single ? aio->sqRing : mmap(nullptr, aio->cqRingSize, PROT_READ | PROT_WRITE,
+                                              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    aio->sqes = (struct io_uring_sqe *) mmap(nullptr, p.sq_entries * sizeof(struct io_uring_sqe),
+                                             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    if (aio->sqRing == MAP_FAILED || aio->cqRing == MAP_FAILED || aio->sqes == MAP_FAILED) {
+        close(fd);
+        return 1;
+    }
+
+    auto sq = (uint8_t *) aio->sqRing;
+    auto cq = (uint8_t *) aio->cqRing;
+    aio->sqHead = (uint32_t *) (sq + p.sq_off.head);
+    aio->sqTail = (uint32_t *) (sq + p.sq_off.tail);
+    aio->sqMask = (uint32_t *) (sq + p.sq_off.ring_mask);
+    aio->sqArray = (uint32_t *) (sq + p.sq_off.array);
+    aio->cqHead = (uint32_t *) (cq + p.cq_off.head);
+    aio->cqTail = (uint32_t *) (cq + p.cq_off.tail);
+    aio->cqMask = (uint32_t *) (cq + p.cq_off.ring_mask);
+    aio->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    // Never have more in flight than the submission queue holds, so completions cannot overflow
+    if (aio->depth > p.sq_entries) {
+        aio->depth = p.sq_entries;
+    }
+
+    return 0;
+}
+
+// Entries the kernel did not take stay in the submission queue for the next call
+static int uring_enter(AsyncIO *aio, uint32_t minComplete) {
+    uint32_t submit = aio->toSubmit;
+    aio->submitCalls++;
+
+    while (true) {
+        int ret = (int) syscall(__NR_io_uring_enter, aio->ringFd, submit, minComplete,
+                                minComplete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if (ret >= 0) {
+            aio->toSubmit -= (uint32_t) ret < submit ? (uint32_t) ret : submit;
+            return 0;
+        }
+        if (errno != EINTR) {
+            return 1;
+        }
+    }
+}
+
+static void uring_queue(AsyncIO *aio, AioOp *op) {
+    uint32_t tail = *aio->sqTail;
+    uint32_t index = tail & *aio->sqMask;
+
+    struct io_uring_sqe *sqe = &aio->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    op->iov.iov_base = op->data;
+    op->iov.iov_len = op->size;
+    sqe->opcode = op->req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = (int) op->req->fd;
+    sqe->addr = (uint64_t) (uintptr_t) &op->iov;
+    sqe->len = 1;
+    sqe->off = op->offset;
+    sqe->user_data = (uint64_t) (uintptr_t) op;
+
+    aio->sqArray[index] = index;
+    __atomic_store_n(aio->sqTail, tail + 1, __ATOMIC_RELEASE);
+    aio->toSubmit++;
+}
+
+// Handles all available completions, resubmitting the rest of short transfers
+static void uring_reap(AsyncIO *aio) {
+    uint32_t head = *aio->cqHead;
+    uint32_t tail = __atomic_load_n(aio->cqTail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &aio->cqes[head & *aio->cqMask];
+        auto op = (AioOp *) (uintptr_t) cqe->user_data;
+        int res = cqe->res;
+
+        if (res > 0 && (size_t) res < op->size) {
+            op->data += res;
+            op->offset += (uint64_t) res;
+            op->size -= (size_t) res;
+            uring_queue(aio, op);
+            continue;
+        }
+
+        complete_op(aio, op, res < 0 ? -res : (res == 0 && op->size ? EIO : 0));
+    }
+
+    __atomic_store_n(aio->cqHead, head, __ATOMIC_RELEASE);
+}
+
+// Waits for at least one completion. Failures are retried, since the kernel may still be using the
+// buffers of the operations in flight and giving up on them would let the caller free those
+static void uring_wait(AsyncIO *aio) {
+    while (uring_enter(aio, 1)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    uring_reap(aio);
+}
+#endif
+
+AsyncIO *aio_create(uint32_t queueDepth, bool allowUring, const jxr_allocator *buffers) {
+    auto aio = new(std::nothrow) AsyncIO();
+    if (aio == nullptr) {
+        return nullptr;
+    }
+
+    if (buffers) {
+        aio->buffers = *buffers;
+    }
+
+    aio->depth = queueDepth ? queueDepth : 32;
+
+#ifdef __linux__
+    if (allowUring && !uring_setup(aio, aio->depth)) {
+        aio->uring = true;
+        return aio;
+    }
+#else
+    (void) allowUring;
+#endif
+
+    try {
+        for (int i = 0; i < AIO_THREADS; i++) {
+            aio->threads.emplace_back(io_thread, aio);
+        }
+    } catch (...) {
+        aio_destroy(aio);
+        return nullptr;
+    }
+
+    return aio;
+}
+
+void aio_destroy(AsyncIO *aio) {
+#ifdef __linux__
+    if (aio->uring) {
+        munmap(aio->sqes, aio->sqEntries * sizeof(struct io_uring_sqe));
+        if (aio->cqRing != aio->sqRing) {
+            munmap(aio->cqRing, aio->cqRingSize);
+        }
+        munmap(aio->sqRing, aio->sqRingSize);
+        close(aio->ringFd);
+    }
+#endif
+
+    {
+        std::lock_guard<std::mutex> guard(aio->mutex);
+        aio->stopping = true;
+    }
+    aio->work.notify_all();
+
+    for (auto &thread: aio->threads) {
+        thread.join();
+    }
+
+    delete aio;
+}
+
+static int submit(AsyncIO *aio, IoRequest *req) {
+    uint32_t count = (uint32_t) ((req->size + AIO_CHUNK - 1) / AIO_CHUNK);
+    if (count == 0) {
+        file_close(req->fd);
+        req->done = true;
+        return 0;
+    }
+
+    req->ops = (AioOp *) calloc(count, sizeof(AioOp));
+    if (req->ops == nullptr) {
+        file_close(req->fd);
+        return ENOMEM;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        AioOp *op = &req->ops[i];
+        op->req = req;
+        op->offset = (uint64_t) i * AIO_CHUNK;
+        op->data = req->data + op->offset;
+        op->size = i == count - 1 ? req->size - op->offset : AIO_CHUNK;
+    }
+
+    aio->requests++;
+    aio->bytes += req->size;
+    req->pending = count;
+
+#ifdef __linux__
+    if (aio->uring) {
+        for (uint32_t i = 0; i < count; i++) {
+            // Make room by waiting for the oldest operations when the queue is full
+            while (aio->inFlight >= aio->depth) {
+                uring_wait(aio);
+            }
+
+            uring_queue(aio, &req->ops[i]);
+            aio->inFlight++;
+            aio->operations++;
+            aio->depthSum += aio->inFlight;
+            if (aio->inFlight > aio->maxDepth) {
+                aio->maxDepth = aio->inFlight;
+            }
+        }
+
+        // The whole file goes to the kernel in one system call. If that fails, the operations are
+        // already queued and go out with the next wait, so the request is still in progress
+        uring_enter(aio, 0);
+        return 0;
+    }
+#endif
+
+    std::lock_guard<std::mutex> guard(aio->mutex);
+    for (uint32_t i = 0; i < count; i++) {
+        AioOp *op = &req->ops[i];
+        if (aio->queueTail) {
+            aio->queueTail->next = op;
+        } else {
+            aio->queueHead = op;
+        }
+        aio->queueTail = op;
+
+        aio->inFlight++;
+        aio->operations++;
+        aio->depthSum += aio->inFlight;
+        if (aio->inFlight > aio->maxDepth) {
+            aio->maxDepth = aio->inFlight;
+        }
+    }
+    aio->submitCalls++;
+    aio->work.notify_all();
+
+    return 0;
+}
+
+int aio_read_file(AsyncIO *aio, const char *path, IoRequest *req) {
+    memset(req, 0, sizeof(IoRequest));
+
+    int error = 0;
+    req->fd = file_open(path, false, &error);
+    if (req->fd == -1) {
+        return error;
+    }
+
+    error = file_size(req->fd, &req->size);
+    if (!error && req->size == 0) {
+        error = EINVAL;
+    }
+    if (!error) {
+        req->data = (uint8_t *) (aio->buffers.alloc ? aio->buffers.alloc(aio->buffers.user, req->size)
+                                                    : malloc(req->size));
+        if (req->data == nullptr) {
+            error = ENOMEM;
+        }
+    }
+    if (error) {
+        file_close(req->fd);
+        return error;
+    }
+
+    error = submit(aio, req);
+    if (error) {
+        aio_free_data(aio, req->data);
+        req->data = nullptr;
+    }
+    return error;
+}
+
+void aio_free_data(AsyncIO *aio, void *data) {
+    if (aio->buffers.alloc) {
+        aio->buffers.free(aio->buffers.user, data);
+        return;
+    }
+    free(data);
+}
+
+int aio_write_file(AsyncIO *aio, const char *path, uint8_t *data, size_t size, IoRequest *req) {
+    memset(req, 0, sizeof(IoRequest));
+    req->write = true;
+    req->data = data;
+    req->size = size;
+
+    int error = 0;
+    req->fd = file_open(path, true, &error);
+    if (req->fd == -1) {
+        return error;
+    }
+
+    return submit(aio, req);
+}
+
+bool aio_poll(AsyncIO *aio, IoRequest *req) {
+#ifdef __linux__
+    if (aio->uring) {
+        uring_reap(aio);
+        return req->done;
+    }
+#endif
+
+    std::lock_guard<std::mutex> guard(aio->mutex);
+    return req->done;
+}
+
+int aio_wait(AsyncIO *aio, IoRequest *req) {
+    auto start = std::chrono::steady_clock::now();
+
+#ifdef __linux__
+    if (aio->uring) {
+        uring_reap(aio);
+        while (!req->done) {
+            uring_wait(aio);
+        }
+    } else
+#endif
+    {
+        std::unique_lock<std::mutex> lock(aio->mutex);
+        aio->completed.wait(lock, [req] { return req->done; });
+    }
+
+    aio->waitSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    return req->error;
+}
+
+void aio_stats(AsyncIO *aio, AioStats *stats) {
+    std::lock_guard<std::mutex> guard(aio->mutex);
+    stats->backend = aio->uring ? "io_uring" : "threads";
+    stats->requests = aio->requests;
+    stats->operations = aio->operations;
+    stats->submitCalls = aio->submitCalls;
+    stats->bytes = aio->bytes;
+    stats->maxDepth = aio->maxDepth;
+    stats->averageDepth = aio->operations ? aio->depthSum / (double) aio->operations : 0;
+    stats->waitSeconds = aio->waitSeconds;
+}
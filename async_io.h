@@ -0,0 +1,57 @@
+// Asynchronous whole-file reads and writes for batch conversion. Uses io_uring on Linux and falls
+// back to a few blocking I/O threads elsewhere, or when io_uring is unavailable.
+#ifndef JXR_ASYNC_IO_H
+#define JXR_ASYNC_IO_H
+
+#include <cstddef>
+#include <cstdint>
+#include "jxr_to_png.h"
+
+typedef struct AsyncIO AsyncIO;
+typedef struct AioOp AioOp;
+
+// One file transfer, split into chunk operations that are in flight at the same time
+typedef struct IoRequest {
+    uint8_t *data;  // reads allocate it, the caller frees it with aio_free_data
+    size_t size;
+    int error;  // errno value, 0 on success
+    bool done;
+    bool write;
+    intptr_t fd;
+    uint32_t pending;
+    AioOp *ops;
+} IoRequest;
+
+typedef struct AioStats {
+    const char *backend;
+    uint64_t requests;
+    uint64_t operations;
+    uint64_t submitCalls;
+    uint64_t bytes;
+    uint32_t maxDepth;
+    double averageDepth;  // operations in flight, sampled whenever one is submitted
+    double waitSeconds;  // time callers spent blocked in aio_wait
+} AioStats;
+
+// Reads allocate their data from buffers, or with malloc when it is null
+AsyncIO *aio_create(uint32_t queueDepth, bool allowUring, const jxr_allocator *buffers);
+
+void aio_destroy(AsyncIO *aio);
+
+// Starts reading the whole file, the request must stay valid until it is done
+int aio_read_file(AsyncIO *aio, const char *path, IoRequest *req);
+
+void aio_free_data(AsyncIO *aio, void *data);
+
+// Starts writing data to the file, data must stay valid until the request is done
+int aio_write_file(AsyncIO *aio, const char *path, uint8_t *data, size_t size, IoRequest *req);
+
+// Processes finished operations without blocking and tells whether the request is done
+bool aio_poll(AsyncIO *aio, IoRequest *req);
+
+// Blocks until the request is done, returns its error
+int aio_wait(AsyncIO *aio, IoRequest *req);
+
+void aio_stats(AsyncIO *aio, AioStats *stats);
+
+#endif
@@ -0,0 +1,158 @@
+// Picks filter and compression settings per image by trial-compressing a few row bands
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include "internal.h"
+
+#define AUTO_BANDS 4
+#define AUTO_BAND_ROWS 32
+
+typedef struct Candidate {
+    const char *name;
+    jxr_filter_policy policy;
+    jxr_png_filter type;
+    jxr_deflate deflate;
+    jxr_strategy strategy;
+    int level;
+} Candidate;
+
+// Level 9 is left out, on flat content it can take longer to sample than to encode the image
+static const Candidate candidates[] = {
+        {"adaptive filters, zlib 6 filtered", JXR_FILTER_EXHAUSTIVE, JXR_PNG_FILTER_NONE, JXR_DEFLATE_ZLIB,
+         JXR_STRATEGY_FILTERED, 6},
+        {"adaptive filters, zlib 6 default", JXR_FILTER_EXHAUSTIVE, JXR_PNG_FILTER_NONE, JXR_DEFLATE_ZLIB,
+         JXR_STRATEGY_DEFAULT, 6},
+        {"fast adaptive filters, zlib 1", JXR_FILTER_FAST, JXR_PNG_FILTER_NONE, JXR_DEFLATE_ZLIB,
+         JXR_STRATEGY_FILTERED, 1},
+        {"paeth, zlib 6 filtered", JXR_FILTER_FIXED, JXR_PNG_FILTER_PAETH, JXR_DEFLATE_ZLIB,
+         JXR_STRATEGY_FILTERED, 6},
+        {"up, zlib rle", JXR_FILTER_FIXED, JXR_PNG_FILTER_UP, JXR_DEFLATE_ZLIB, JXR_STRATEGY_RLE, 6},
+        {"sub, zlib rle", JXR_FILTER_FIXED, JXR_PNG_FILTER_SUB, JXR_DEFLATE_ZLIB, JXR_STRATEGY_RLE, 6},
+        {"up, screen", JXR_FILTER_FIXED, JXR_PNG_FILTER_UP, JXR_DEFLATE_SCREEN, JXR_STRATEGY_LIBPNG, 0},
+        {"sub, screen", JXR_FILTER_FIXED, JXR_PNG_FILTER_SUB, JXR_DEFLATE_SCREEN, JXR_STRATEGY_LIBPNG, 0},
+};
+
+#define NUM_CANDIDATES (sizeof(candidates) / sizeof(candidates[0]))
+
+static void apply(const Candidate *c, jxr_options *options) {
+    options->filter_policy = c->policy;
+    options->filter_type = c->type;
+    options->deflate = c->deflate;
+    options->strategy = c->strategy;
+    options->level = c->level;
+}
+
+typedef struct SampleTask {
+    const jxr_options *options;
+    const uint8_t *data;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bands;
+    uint32_t bandRows;
+    size_t bytes[NUM_CANDIDATES * AUTO_BANDS];  // 0 if the sample failed
+    double seconds[NUM_CANDIDATES * AUTO_BANDS];
+} SampleTask;
+
+// One candidate on one band: filtering and compression are both timed
+static void SampleFunc(void *arg, uint32_t index) {
+    auto t = (SampleTask *) arg;
+    TraceSpan span("auto sample", index);
+    const Candidate *c = &candidates[index / t->bands];
+    uint32_t band = index % t->bands;
+
+    jxr_options options = *t->options;
+    apply(c, &options);
+
+    // Evenly spread bands, each filtered against the real row above it
+    uint32_t start = (uint32_t) ((uint64_t) (t->height - t->bandRows) * (2 * band + 1) / (2 * t->bands));
+    uint32_t stop = start + t->bandRows;
+
+    size_t length = (size_t) t->width * 6;
+    size_t size = filtered_size(t->width, t->bandRows);
+
+    t->bytes[index] = 0;
+    t->seconds[index] = 0;
+
+    auto memory = (uint8_t *) jxr_calloc(&options, 1, 3 * length + size, JXR_MEMORY_ENCODER);
+    if (memory == nullptr) {
+        return;
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+
+    filter_band(t->data, t->width, start, stop, c->policy, c->type, memory, memory + length, memory + 3 * length);
+    size_t bytes = compressed_size(&options, memory + 3 * length, size, length + 1);
+
+    t->seconds[index] = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    t->bytes[index] = bytes;
+
+    jxr_free(&options, memory);
+}
+
+size_t auto_compress_memory(const jxr_options *options, uint32_t width) {
+    size_t length = (size_t) width * 6;
+    size_t size = filtered_size(width, AUTO_BAND_ROWS);
+    size_t largest = 0;
+    for (size_t i = 0; i < NUM_CANDIDATES; i++) {
+        jxr_options sample = *options;
+        apply(&candidates[i], &sample);
+        size_t bytes = 3 * length + size + compressed_size_memory(&sample, size);
+        largest = bytes > largest ? bytes : largest;
+    }
+    return largest * NUM_CANDIDATES * AUTO_BANDS;
+}
+
+int choose_compression(const jxr_options *options, const uint8_t *data, uint32_t width, uint32_t height,
+                       jxr_options *chosen, char *report, size_t reportSize) {
+    SampleTask task;
+    task.options = options;
+    task.data = data;
+    task.width = width;
+    task.height = height;
+    task.bandRows = height < AUTO_BAND_ROWS ? height : AUTO_BAND_ROWS;
+    task.bands = height / task.bandRows < AUTO_BANDS ? height / task.bandRows : AUTO_BANDS;
+
+    if (run_parallel(options, (uint32_t) NUM_CANDIDATES * task.bands, SampleFunc, &task)) {
+        return 1;
+    }
+
+    size_t bytes[NUM_CANDIDATES] = {};
+    double seconds[NUM_CANDIDATES] = {};
+    size_t smallest = SIZE_MAX;
+
+    for (size_t i = 0; i < NUM_CANDIDATES; i++) {
+        for (uint32_t b = 0; b < task.bands; b++) {
+            size_t n = task.bytes[i * task.bands + b];
+            bytes[i] = n && bytes[i] != SIZE_MAX ? bytes[i] + n : SIZE_MAX;
+            seconds[i] += task.seconds[i * task.bands + b];
+        }
+        if (bytes[i] < smallest) {
+            smallest = bytes[i];
+        }
+    }
+
+    if (smallest == SIZE_MAX) {
+        return 1;
+    }
+
+    size_t limit = smallest + smallest * options->auto_tolerance / 100;
+    size_t pick = 0;
+    double fastest = 0;
+    bool found = false;
+
+    for (size_t i = 0; i < NUM_CANDIDATES; i++) {
+        if (bytes[i] <= limit && (!found || seconds[i] < fastest)) {
+            pick = i;
+            fastest = seconds[i];
+            found = true;
+        }
+    }
+
+    *chosen = *options;
+    apply(&candidates[pick], chosen);
+
+    snprintf(report, reportSize, "%s (%zu of %zu sampled rows: %zu bytes in %.1f ms, smallest %zu)",
+             candidates[pick].name, (size_t) task.bands * task.bandRows, (size_t) height, bytes[pick],
+             fastest * 1000, smallest);
+    return 0;
+}
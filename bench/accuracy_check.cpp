@@ -0,0 +1,318 @@
+// Compares every variant of the conversion kernel against a double precision reference of the
+// BT.2100 matrix, PQ curve and quantization. Inputs are every finite half float in each channel,
+// and random floats spread over the whole scRGB range. Reports the largest code error, the number
+// of mismatching samples and the MaxCLL/MaxFALL differences, and fails when a variant is outside
+// the tolerance, or with --exact when it differs at all.
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "convert_kernels.h"
+
+#define DEFAULT_RANDOM_PIXELS (1 << 20)
+#define DEFAULT_MAX_ERROR 1  // codes
+#define DEFAULT_MAX_NITS 1   // MaxCLL and MaxFALL
+#define IMAGE_WIDTH 256
+
+static const long double reference_matrix[3][3] = {
+        {2939026994.L / 585553224375.L,  9255011753.L / 3513319346250.L, 173911579.L / 501902763750.L},
+        {76515593.L / 138420033750.L,    6109575001.L / 830520202500.L,  75493061.L / 830520202500.L},
+        {12225392.L / 93230009375.L,     1772384008.L / 2517210253125.L, 18035212433.L / 2517210253125.L},
+};
+
+typedef struct Reference {
+    uint16_t *codes;  // TARGET_BITS codes, 3 per pixel
+    uint16_t maxCLL;
+    uint16_t maxFALL;
+} Reference;
+
+typedef struct Variant {
+    const char *name;
+    jxr_pixel_format format;
+    int filter;  // -1 for raw samples without filter bytes
+    bool allThreads;
+} Variant;
+
+static const Variant variants[] = {
+        {"float", JXR_PIXEL_FORMAT_RGBA_FLOAT, -1, false},
+        {"float, none", JXR_PIXEL_FORMAT_RGBA_FLOAT, JXR_PNG_FILTER_NONE, false},
+        {"float, sub", JXR_PIXEL_FORMAT_RGBA_FLOAT, JXR_PNG_FILTER_SUB, false},
+        {"float, up", JXR_PIXEL_FORMAT_RGBA_FLOAT, JXR_PNG_FILTER_UP, false},
+        {"float, average", JXR_PIXEL_FORMAT_RGBA_FLOAT, JXR_PNG_FILTER_AVERAGE, false},
+        {"float, all threads", JXR_PIXEL_FORMAT_RGBA_FLOAT, -1, true},
+        {"half", JXR_PIXEL_FORMAT_RGBA_HALF, -1, false},
+        {"half, up", JXR_PIXEL_FORMAT_RGBA_HALF, JXR_PNG_FILTER_UP, false},
+        {"half, all threads", JXR_PIXEL_FORMAT_RGBA_HALF, -1, true},
+};
+
+typedef struct Result {
+    uint32_t maxError;
+    uint64_t mismatches;
+    int32_t maxCLLDelta;
+    int32_t maxFALLDelta;
+} Result;
+
+static double pq_reference(double y) {
+    const double m1 = 1305.0 / 8192.0;
+    const double m2 = 2523.0 / 32.0;
+    const double c1 = 107.0 / 128.0;
+    const double c2 = 2413.0 / 128.0;
+    const double c3 = 2392.0 / 128.0;
+    double p = pow(y, m1);
+    return pow((c1 + c2 * p) / (1 + c3 * p), m2);
+}
+
+// Same statistics as convert_frame, but on unrounded linear values
+static int reference_convert(const float *rgba, size_t pixels, Reference *ref) {
+    ref->codes = (uint16_t *) malloc(pixels * 3 * sizeof(uint16_t));
+#ifdef MAXCLL_PERCENTILE
+    auto nitCounts = (uint64_t *) calloc(NIT_LEVELS, sizeof(uint64_t));
+#else
+    uint64_t *nitCounts = nullptr;
+#endif
+    if (ref->codes == nullptr) {
+        free(nitCounts);
+        return 1;
+    }
+
+    double maxMaxComp = 0;
+    double sumOfMaxComp = 0;
+    const double maxTarget = (1 << TARGET_BITS) - 1;
+
+    for (size_t i = 0; i < pixels; i++) {
+        const float *in = rgba + 4 * i;
+        double maxComp = 0;
+        for (int c = 0; c < 3; c++) {
+            long double v = 0;
+            for (int k = 0; k < 3; k++) {
+                v += reference_matrix[c][k] * in[k];
+            }
+            double linear = v < 0 ? 0 : v > 1 ? 1 : (double) v;
+            maxComp = linear > maxComp ? linear : maxComp;
+            ref->codes[3 * i + c] = (uint16_t) nearbyint(pq_reference(linear) * maxTarget);
+        }
+#ifdef MAXCLL_PERCENTILE
+        nitCounts[(uint32_t) round(maxComp * 10000)]++;
+#endif
+        maxMaxComp = maxComp > maxMaxComp ? maxComp : maxMaxComp;
+        sumOfMaxComp += maxComp;
+    }
+
+    ref->maxCLL = (uint16_t) round(maxMaxComp * 10000);
+#ifdef MAXCLL_PERCENTILE
+    auto countTarget = (uint64_t) round((1 - MAXCLL_PERCENTILE) * (double) pixels);
+    uint64_t count = 0;
+    uint32_t index = ref->maxCLL;
+    while ((count += nitCounts[index]) < countTarget && index) {
+        index--;
+    }
+    ref->maxCLL = (uint16_t) index;
+    free(nitCounts);
+#endif
+    ref->maxFALL = (uint16_t) round(10000 * (sumOfMaxComp / (double) pixels));
+    return 0;
+}
+
+// Reverses the filters the conversion kernel fuses, in place, leaving the raw samples of each row
+static void unfilter(uint8_t *out, uint32_t width, uint32_t height) {
+    size_t rowBytes = (size_t) width * 6;
+    size_t stride = rowBytes + 1;
+    for (uint32_t y = 0; y < height; y++) {
+        uint8_t *row = out + y * stride + 1;
+        const uint8_t *up = y ? row - stride : nullptr;
+        int filter = row[-1];
+        for (size_t x = 0; x < rowBytes; x++) {
+            uint8_t a = x >= 6 ? row[x - 6] : 0;
+            uint8_t b = up ? up[x] : 0;
+            if (filter == JXR_PNG_FILTER_SUB) {
+                row[x] += a;
+            } else if (filter == JXR_PNG_FILTER_UP) {
+                row[x] += b;
+            } else if (filter == JXR_PNG_FILTER_AVERAGE) {
+                row[x] += (uint8_t) ((a + b) / 2);
+            }
+        }
+    }
+}
+
+static int run_variant(const Variant *v, const float *rgba, const HALF *half, uint32_t height,
+                       const Reference *ref, uint8_t *out, Result *r) {
+    jxr_options options;
+    jxr_options_init(&options);
+
+    jxr_image image = {v->format == JXR_PIXEL_FORMAT_RGBA_FLOAT ? (const void *) rgba : half, IMAGE_WIDTH, height, 0,
+                       v->format};
+    uint32_t threads = v->allThreads ? jxr_default_threads() : 1;
+    uint16_t maxCLL, maxFALL;
+    const char *error = nullptr;
+    if (convert_frame(&options, &image, out, v->filter, threads, &maxCLL, &maxFALL, nullptr, &error)) {
+        fprintf(stderr, "%s: %s\n", v->name, error);
+        return 1;
+    }
+
+    size_t stride = (size_t) IMAGE_WIDTH * 6 + (v->filter >= 0);
+    if (v->filter >= 0) {
+        unfilter(out, IMAGE_WIDTH, height);
+    }
+
+    *r = {0, 0, maxCLL - ref->maxCLL, maxFALL - ref->maxFALL};
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *row = out + y * stride + (v->filter >= 0);
+        for (size_t i = 0; i < (size_t) IMAGE_WIDTH * 3; i++) {
+            uint32_t code = (uint32_t) (row[2 * i] << 8 | row[2 * i + 1]) >> (INTERMEDIATE_BITS - TARGET_BITS);
+            uint32_t expected = ref->codes[(size_t) y * IMAGE_WIDTH * 3 + i];
+            uint32_t error = code > expected ? code - expected : expected - code;
+            r->maxError = error > r->maxError ? error : r->maxError;
+            r->mismatches += error != 0;
+        }
+    }
+    return 0;
+}
+
+// Every finite half in each channel, with the other channels taken from a scrambled half, and as gray
+static size_t exhaustive_half(float *rgba) {
+    size_t n = 0;
+    for (int channel = 0; channel < 4; channel++) {
+        for (uint32_t h = 0; h < 65536; h++) {
+            if ((h & 0x7c00) == 0x7c00) {
+                continue;
+            }
+            uint32_t other = (h * 40503u + 0x3c00) & 0x7fff;
+            other = (other & 0x7c00) == 0x7c00 ? other & 0x3fff : other;
+            float value = XMConvertHalfToFloat((HALF) h);
+            float partner = XMConvertHalfToFloat((HALF) other);
+            float *p = rgba + 4 * n++;
+            for (int c = 0; c < 3; c++) {
+                p[c] = channel == 3 || channel == c ? value : partner;
+            }
+            p[3] = 1;
+        }
+    }
+    return n;
+}
+
+// Magnitudes log-uniform from 1e-6 to 200 (16000 nits), one in eight components negative
+static void random_floats(float *rgba, size_t pixels, uint32_t seed) {
+    uint32_t state = seed ? seed : 1;
+    for (size_t i = 0; i < pixels; i++) {
+        for (int c = 0; c < 3; c++) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            double u = (double) (state >> 8) / (1 << 24);
+            auto v = (float) pow(10.0, -6 + 8.3 * u);
+            rgba[4 * i + c] = (state & 7) == 0 ? -v : v;
+        }
+        rgba[4 * i + 3] = 1;
+    }
+}
+
+static int check(const char *name, float *rgba, size_t pixels, bool exact, uint32_t maxError, int32_t maxNits) {
+    // Pad to whole rows with black
+    uint32_t height = (uint32_t) ((pixels + IMAGE_WIDTH - 1) / IMAGE_WIDTH);
+    for (size_t i = pixels; i < (size_t) height * IMAGE_WIDTH; i++) {
+        memset(rgba + 4 * i, 0, 4 * sizeof(float));
+    }
+    pixels = (size_t) height * IMAGE_WIDTH;
+
+    // Half inputs are compared to the reference of the rounded values they hold
+    auto half = (HALF *) malloc(pixels * 4 * sizeof(HALF));
+    auto rounded = (float *) malloc(pixels * 4 * sizeof(float));
+    auto out = (uint8_t *) malloc(pixels * 6 + height);
+    Reference ref = {};
+    Reference halfRef = {};
+    int failed = half == nullptr || rounded == nullptr || out == nullptr;
+    if (!failed) {
+        XMConvertFloatToHalfStream(half, sizeof(HALF), rgba, sizeof(float), pixels * 4);
+        XMConvertHalfToFloatStream(rounded, sizeof(float), half, sizeof(HALF), pixels * 4);
+        failed = reference_convert(rgba, pixels, &ref) || reference_convert(rounded, pixels, &halfRef);
+    }
+    if (failed) {
+        fprintf(stderr, "Failed to allocate buffers\n");
+        free(ref.codes);
+        free(halfRef.codes);
+        free(rounded);
+        free(half);
+        free(out);
+        return 1;
+    }
+
+    printf("%s: %zu pixels, reference MaxCLL %u, MaxFALL %u\n  %-20s %10s %12s %10s %10s  %s\n", name, pixels,
+           ref.maxCLL, ref.maxFALL, "kernel", "max error", "mismatches", "MaxCLL", "MaxFALL", "verdict");
+
+    for (const Variant &v: variants) {
+        bool isHalf = v.format == JXR_PIXEL_FORMAT_RGBA_HALF;
+        Result r;
+        if (run_variant(&v, rgba, half, height, isHalf ? &halfRef : &ref, out, &r)) {
+            failed++;
+            continue;
+        }
+
+        bool identical = r.maxError == 0 && r.maxCLLDelta == 0 && r.maxFALLDelta == 0;
+        bool within = r.maxError <= maxError && abs(r.maxCLLDelta) <= maxNits && abs(r.maxFALLDelta) <= maxNits;
+        bool pass = exact ? identical : within;
+        failed += !pass;
+
+        printf("  %-20s %10u %12llu %+10d %+10d  %s\n", v.name, r.maxError, (unsigned long long) r.mismatches,
+               r.maxCLLDelta, r.maxFALLDelta, identical ? "exact" : within ? "within tolerance" : "FAIL");
+    }
+
+    free(ref.codes);
+    free(halfRef.codes);
+    free(rounded);
+    free(half);
+    free(out);
+    return failed;
+}
+
+static void usage() {
+    fprintf(stderr, "accuracy_check [--exact] [--max-error CODES] [--max-nits NITS] [--random PIXELS] [--seed N]\n");
+}
+
+int main(int argc, char *argv[]) {
+    bool exact = false;
+    uint32_t maxError = DEFAULT_MAX_ERROR;
+    int32_t maxNits = DEFAULT_MAX_NITS;
+    size_t randomPixels = DEFAULT_RANDOM_PIXELS;
+    uint32_t seed = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--exact")) {
+            exact = true;
+        } else if (!strcmp(argv[i], "--max-error") && i + 1 < argc) {
+            maxError = (uint32_t) strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--max-nits") && i + 1 < argc) {
+            maxNits = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--random") && i + 1 < argc) {
+            randomPixels = strtoull(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+            seed = (uint32_t) strtoul(argv[++i], nullptr, 10);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    size_t halfPixels = 4 * 65536;
+    size_t capacity = (randomPixels > halfPixels ? randomPixels : halfPixels) + IMAGE_WIDTH;
+    auto rgba = (float *) malloc(capacity * 4 * sizeof(float));
+    if (rgba == nullptr) {
+        fprintf(stderr, "Failed to allocate inputs\n");
+        return 1;
+    }
+
+    int failed = check("every finite half", rgba, exhaustive_half(rgba), exact, maxError, maxNits);
+
+    if (randomPixels) {
+        random_floats(rgba, randomPixels, seed);
+        putchar('\n');
+        failed += check("random floats", rgba, randomPixels, exact, maxError, maxNits);
+    }
+
+    free(rgba);
+
+    if (failed) {
+        printf("\n%d kernel runs %s\n", failed, exact ? "not bit exact" : "outside tolerance");
+    }
+    return failed != 0;
+}
@@ -0,0 +1,411 @@
+// Encodes every image of a directory with a grid of compression settings (filters, deflate
+// backend, zlib level, strategy, window and memory level), several settings at a time, and times
+// encoding and decoding each output. Prints, per content class, the settings on the Pareto front of
+// size against encode and decode time, the candidates for output presets.
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include "png_decode.h"
+
+#define DEFAULT_RUNS 2
+#define MAX_AXIS 16
+
+typedef struct FilterChoice {
+    const char *name;
+    jxr_filter_policy policy;
+    jxr_png_filter type;
+} FilterChoice;
+
+static const FilterChoice filter_choices[] = {
+        {"exhaustive", JXR_FILTER_EXHAUSTIVE, JXR_PNG_FILTER_NONE},
+        {"fast", JXR_FILTER_FAST, JXR_PNG_FILTER_NONE},
+        {"entropy", JXR_FILTER_ENTROPY, JXR_PNG_FILTER_NONE},
+        {"decode-fast", JXR_FILTER_DECODE_FAST, JXR_PNG_FILTER_NONE},
+        {"none", JXR_FILTER_FIXED, JXR_PNG_FILTER_NONE},
+        {"sub", JXR_FILTER_FIXED, JXR_PNG_FILTER_SUB},
+        {"up", JXR_FILTER_FIXED, JXR_PNG_FILTER_UP},
+        {"average", JXR_FILTER_FIXED, JXR_PNG_FILTER_AVERAGE},
+        {"paeth", JXR_FILTER_FIXED, JXR_PNG_FILTER_PAETH},
+};
+
+static const char *const deflate_names[] = {"zlib", "screen", "stored"};
+static const char *const strategy_names[] = {"libpng", "default", "filtered", "rle"};
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+// Values of each axis of the grid, as indices into the tables above or plain numbers
+typedef struct Axis {
+    int values[MAX_AXIS];
+    uint32_t count;
+} Axis;
+
+typedef struct Setting {
+    char name[64];
+    jxr_options options;
+} Setting;
+
+// Totals of one setting over the images of a class
+typedef struct Totals {
+    uint64_t bytes;
+    double encode;  // seconds
+    double decode;
+    double megapixels;
+    uint32_t images;
+} Totals;
+
+typedef struct ContentClass {
+    std::string name;
+    std::vector<Totals> totals;  // per setting
+} ContentClass;
+
+typedef struct SweepTask {
+    const jxr_image *image;
+    const Setting *settings;
+    int runs;
+    Totals *results;  // per setting, for this image
+    std::atomic<const char *> error;  // set by any setting that fails, stops the others
+} SweepTask;
+
+// Best of runs for encoding and decoding one setting, on one thread
+static void SweepFunc(void *arg, uint32_t index) {
+    auto t = (SweepTask *) arg;
+    const jxr_image *image = t->image;
+    Totals *r = &t->results[index];
+    *r = {};
+
+    size_t rawSize = ((size_t) image->width * BPP + 1) * image->height;
+    auto raw = (uint8_t *) malloc(rawSize);
+    auto pixels = (uint8_t *) calloc((size_t) image->width * BPP, (size_t) image->height + 1);
+    jxr_buffer png = {nullptr, 0, 0, 1};
+    const jxr_options *options = &t->settings[index].options;
+
+    if (raw == nullptr || pixels == nullptr) {
+        t->error.store("Failed to allocate decode buffers");
+    }
+
+    double encode = DBL_MAX;
+    double decode = DBL_MAX;
+    for (int run = 0; run < t->runs && t->error.load() == nullptr; run++) {
+        auto begin = std::chrono::steady_clock::now();
+        jxr_result result;
+        if (jxr_convert_pixels(image, options, &png, &result) != JXR_OK) {
+            t->error.store(result.error);
+            break;
+        }
+        encode = std::min(encode, seconds_since(begin));
+
+        begin = std::chrono::steady_clock::now();
+        if (decode_png(png.data, png.size, raw, rawSize, pixels, image->width, image->height, nullptr)) {
+            t->error.store("Output failed to decode");
+            break;
+        }
+        decode = std::min(decode, seconds_since(begin));
+    }
+
+    if (t->error.load() == nullptr) {
+        *r = {png.size, encode, decode, (double) image->width * image->height / 1e6, 1};
+    }
+
+    jxr_buffer_free(options, &png);
+    free(pixels);
+    free(raw);
+}
+
+static bool parse_axis(const char *list, const char *const *names, uint32_t nameCount, Axis *axis) {
+    axis->count = 0;
+    for (const char *p = list; *p; p += *p == ',') {
+        size_t length = strcspn(p, ",");
+        if (axis->count == MAX_AXIS) {
+            return false;
+        }
+        int value = -1;
+        if (names == nullptr) {
+            char *end;
+            value = (int) strtol(p, &end, 10);
+            value = end == p + length ? value : -1;
+        } else {
+            for (uint32_t i = 0; i < nameCount; i++) {
+                if (strlen(names[i]) == length && !strncmp(p, names[i], length)) {
+                    value = (int) i;
+                }
+            }
+        }
+        if (value < 0) {
+            return false;
+        }
+        axis->values[axis->count++] = value;
+        p += length;
+    }
+    return axis->count > 0;
+}
+
+static void set_axis(Axis *axis, std::initializer_list<int> values) {
+    axis->count = 0;
+    for (int v: values) {
+        axis->values[axis->count++] = v;
+    }
+}
+
+// Every combination, where the level, strategy, window and memory level only matter to zlib
+static std::vector<Setting> make_grid(const Axis &filters, const Axis &deflates, const Axis &levels,
+                                      const Axis &strategies, const Axis &windows, const Axis &memLevels) {
+    std::vector<Setting> grid;
+    for (uint32_t f = 0; f < filters.count; f++) {
+        const FilterChoice *filter = &filter_choices[filters.values[f]];
+        for (uint32_t d = 0; d < deflates.count; d++) {
+            auto deflate = (jxr_deflate) deflates.values[d];
+            bool zlib = deflate == JXR_DEFLATE_ZLIB;
+            uint32_t combinations = zlib ? levels.count * strategies.count * windows.count * memLevels.count : 1;
+
+            for (uint32_t c = 0; c < combinations; c++) {
+                Setting s;
+                jxr_options_init(&s.options);
+                s.options.threading.num_threads = 1;
+                s.options.filter_policy = filter->policy;
+                s.options.filter_type = filter->type;
+                s.options.deflate = deflate;
+
+                if (!zlib) {
+                    snprintf(s.name, sizeof(s.name), "%s %s", filter->name, deflate_names[deflate]);
+                } else {
+                    uint32_t i = c;
+                    s.options.mem_level = memLevels.values[i % memLevels.count];
+                    i /= memLevels.count;
+                    s.options.window_bits = windows.values[i % windows.count];
+                    i /= windows.count;
+                    s.options.strategy = (jxr_strategy) strategies.values[i % strategies.count];
+                    i /= strategies.count;
+                    s.options.level = levels.values[i];
+                    snprintf(s.name, sizeof(s.name), "%s zlib %d %s w%d m%d", filter->name, s.options.level,
+                             strategy_names[s.options.strategy], s.options.window_bits, s.options.mem_level);
+                }
+                grid.push_back(s);
+            }
+        }
+    }
+    return grid;
+}
+
+// Class of corpus files named like class_001.pfm, otherwise the whole file name
+static std::string class_of(const std::filesystem::path &path) {
+    std::string stem = path.stem().string();
+    size_t underscore = stem.rfind('_');
+    return underscore == std::string::npos || underscore == 0 ? stem : stem.substr(0, underscore);
+}
+
+static bool dominates(const Totals &a, const Totals &b) {
+    bool noWorse = a.bytes <= b.bytes && a.encode <= b.encode && a.decode <= b.decode;
+    bool better = a.bytes < b.bytes || a.encode < b.encode || a.decode < b.decode;
+    return noWorse && better;
+}
+
+static void print_pareto(const ContentClass &c, const std::vector<Setting> &grid) {
+    std::vector<uint32_t> front;
+    uint64_t smallest = UINT64_MAX;
+    for (uint32_t i = 0; i < grid.size(); i++) {
+        if (c.totals[i].images == 0) {
+            continue;
+        }
+        bool dominated = false;
+        for (uint32_t j = 0; j < grid.size() && !dominated; j++) {
+            dominated = c.totals[j].images && dominates(c.totals[j], c.totals[i]);
+        }
+        if (!dominated) {
+            front.push_back(i);
+        }
+        smallest = std::min(smallest, c.totals[i].bytes);
+    }
+    if (front.empty()) {
+        return;
+    }
+    std::sort(front.begin(), front.end(),
+              [&](uint32_t a, uint32_t b) { return c.totals[a].bytes < c.totals[b].bytes; });
+
+    const Totals &first = c.totals[front[0]];
+    printf("\n%s: %u images, %.1f MP, %zu of %zu settings on the Pareto front\n  %-36s %12s %8s %12s %12s\n",
+           c.name.c_str(), first.images, first.megapixels, front.size(), grid.size(), "setting", "bytes", "size",
+           "encode MP/s", "decode MP/s");
+    for (uint32_t i: front) {
+        const Totals &t = c.totals[i];
+        printf("  %-36s %12llu %7.1f%% %12.1f %12.1f\n", grid[i].name, (unsigned long long) t.bytes,
+               (double) t.bytes / (double) smallest * 100, t.megapixels / t.encode, t.megapixels / t.decode);
+    }
+}
+
+static int write_csv(const char *path, const std::vector<ContentClass> &classes, const std::vector<Setting> &grid) {
+    FILE *f = fopen(path, "w");
+    if (f == nullptr) {
+        return 1;
+    }
+    fputs("class,setting,images,megapixels,bytes,encode_s,decode_s\n", f);
+    for (const ContentClass &c: classes) {
+        for (size_t i = 0; i < grid.size(); i++) {
+            const Totals &t = c.totals[i];
+            fprintf(f, "%s,%s,%u,%.3f,%llu,%.6f,%.6f\n", c.name.c_str(), grid[i].name, t.images, t.megapixels,
+                    (unsigned long long) t.bytes, t.encode, t.decode);
+        }
+    }
+    return fclose(f) != 0;
+}
+
+static void usage() {
+    fprintf(stderr, "compression_sweep [-j jobs] [--runs N] [--filters list] [--deflate list] [--levels list]\n"
+                    "                  [--strategies list] [--windows list] [--mem-levels list] [--csv F] input_dir\n"
+                    "Lists are comma separated. Filters: exhaustive, fast, entropy, decode-fast, none, sub, up,\n"
+                    "average, paeth. Deflate: zlib, screen, stored. Strategies: libpng, default, filtered, rle.\n");
+}
+
+int main(int argc, char *argv[]) {
+    Axis filters, deflates, levels, strategies, windows, memLevels;
+    set_axis(&filters, {0, 1, 3, 6, 8});
+    set_axis(&deflates, {JXR_DEFLATE_ZLIB, JXR_DEFLATE_SCREEN, JXR_DEFLATE_STORED});
+    set_axis(&levels, {1, 6, 9});
+    set_axis(&strategies, {JXR_STRATEGY_LIBPNG});
+    set_axis(&windows, {15, 12});
+    set_axis(&memLevels, {8, 9});
+
+    static const char *filterNames[COUNT(filter_choices)];
+    for (size_t i = 0; i < COUNT(filter_choices); i++) {
+        filterNames[i] = filter_choices[i].name;
+    }
+
+    uint32_t jobs = jxr_default_threads();
+    int runs = DEFAULT_RUNS;
+    const char *csv = nullptr;
+
+    int first = 1;
+    for (; first < argc && argv[first][0] == '-'; first++) {
+        bool ok = first + 1 < argc;
+        const char *value = ok ? argv[first + 1] : "";
+        if (!strcmp(argv[first], "-j")) {
+            jobs = (uint32_t) strtoul(value, nullptr, 10);
+            ok = ok && jobs > 0;
+        } else if (!strcmp(argv[first], "--runs")) {
+            runs = atoi(value);
+            ok = ok && runs > 0;
+        } else if (!strcmp(argv[first], "--csv")) {
+            csv = value;
+        } else if (!strcmp(argv[first], "--filters")) {
+            ok = ok && parse_axis(value, filterNames, COUNT(filterNames), &filters);
+        } else if (!strcmp(argv[first], "--deflate")) {
+            ok = ok && parse_axis(value, deflate_names, COUNT(deflate_names), &deflates);
+        } else if (!strcmp(argv[first], "--levels")) {
+            ok = ok && parse_axis(value, nullptr, 0, &levels);
+        } else if (!strcmp(argv[first], "--strategies")) {
+            ok = ok && parse_axis(value, strategy_names, COUNT(strategy_names), &strategies);
+        } else if (!strcmp(argv[first], "--windows")) {
+            ok = ok && parse_axis(value, nullptr, 0, &windows);
+        } else if (!strcmp(argv[first], "--mem-levels")) {
+            ok = ok && parse_axis(value, nullptr, 0, &memLevels);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            usage();
+            return 1;
+        }
+        first++;
+    }
+    if (first + 1 != argc) {
+        usage();
+        return 1;
+    }
+
+    std::vector<std::filesystem::path> inputs;
+    std::error_code ec;
+    for (const auto &entry: std::filesystem::directory_iterator(argv[first], ec)) {
+        if (entry.is_regular_file()) {
+            inputs.push_back(entry.path());
+        }
+    }
+    if (ec || inputs.empty()) {
+        fprintf(stderr, "No inputs in %s\n", argv[first]);
+        return 1;
+    }
+    std::sort(inputs.begin(), inputs.end());
+
+    std::vector<Setting> grid = make_grid(filters, deflates, levels, strategies, windows, memLevels);
+    std::vector<Totals> results(grid.size());
+    std::vector<ContentClass> classes;
+    jxr_thread_pool *pool = jxr_thread_pool_create(jobs);
+    if (pool == nullptr) {
+        fprintf(stderr, "Failed to create thread pool\n");
+        return 1;
+    }
+    printf("%zu inputs, %zu settings, %u at a time\n", inputs.size(), grid.size(), jobs);
+
+    jxr_options decodeOptions;
+    jxr_options_init(&decodeOptions);
+    int failed = 0;
+
+    for (const auto &path: inputs) {
+        std::string name = path.string();
+        size_t size;
+        uint8_t *data = read_file(name.c_str(), &size);
+        jxr_image image = {};
+        jxr_result result;
+        if (data == nullptr || jxr_decode_memory(data, size, &decodeOptions, &image, &result) != JXR_OK) {
+            fprintf(stderr, "%s: skipped, %s\n", name.c_str(), data ? result.error : "failed to read");
+            free(data);
+            continue;
+        }
+        free(data);
+
+        auto begin = std::chrono::steady_clock::now();
+        SweepTask task = {&image, grid.data(), runs, results.data(), nullptr};
+        int sweepFailed = jxr_thread_pool_parallel_for(pool, (uint32_t) grid.size(), SweepFunc, &task);
+        const char *error = task.error.load();
+        if (sweepFailed || error) {
+            fprintf(stderr, "%s: %s\n", name.c_str(), error ? error : "Sweep failed");
+            jxr_image_free(&decodeOptions, &image);
+            failed = 1;
+            break;
+        }
+        jxr_image_free(&decodeOptions, &image);
+
+        std::string className = class_of(path);
+        auto c = std::find_if(classes.begin(), classes.end(),
+                              [&](const ContentClass &k) { return k.name == className; });
+        if (c == classes.end()) {
+            classes.push_back({className, std::vector<Totals>(grid.size())});
+            c = classes.end() - 1;
+        }
+        for (size_t i = 0; i < grid.size(); i++) {
+            Totals &t = c->totals[i];
+            t.bytes += results[i].bytes;
+            t.encode += results[i].encode;
+            t.decode += results[i].decode;
+            t.megapixels += results[i].megapixels;
+            t.images += results[i].images;
+        }
+        printf("%s (%s): %.1f s\n", name.c_str(), className.c_str(), seconds_since(begin));
+    }
+    jxr_thread_pool_destroy(pool);
+
+    if (classes.size() > 1) {
+        ContentClass all = {"all", std::vector<Totals>(grid.size())};
+        for (const ContentClass &c: classes) {
+            for (size_t i = 0; i < grid.size(); i++) {
+                all.totals[i].bytes += c.totals[i].bytes;
+                all.totals[i].encode += c.totals[i].encode;
+                all.totals[i].decode += c.totals[i].decode;
+                all.totals[i].megapixels += c.totals[i].megapixels;
+                all.totals[i].images += c.totals[i].images;
+            }
+        }
+        classes.push_back(all);
+    }
+
+    for (const ContentClass &c: classes) {
+        print_pareto(c, grid);
+    }
+
+    if (csv && write_csv(csv, classes, grid)) {
+        fprintf(stderr, "Failed to write %s\n", csv);
+        return 1;
+    }
+    return failed;
+}
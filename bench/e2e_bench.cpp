@@ -0,0 +1,288 @@
+// Runs the whole pipeline (decode, conversion, statistics, filtering, compression) over a corpus
+// at several thread counts. Reports throughput, scaling and per-image latency percentiles, and
+// compares them with a stored baseline.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "jxr_to_png.h"
+
+#define DEFAULT_RUNS 3
+#define DEFAULT_TOLERANCE 5  // percent
+#define MAX_THREAD_COUNTS 16
+
+typedef struct Input {
+    const char *path;
+    uint8_t *data;
+    size_t size;
+} Input;
+
+// Results of one thread count
+typedef struct Summary {
+    uint32_t threads;
+    double p50;  // seconds per image
+    double p99;
+    double megapixelsPerSecond;
+} Summary;
+
+static uint8_t *read_file(const char *path, size_t *size) {
+    FILE *f = fopen(path, "rb");
+    if (f == nullptr) {
+        return nullptr;
+    }
+    fseek(f, 0, SEEK_END);
+    long length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    auto data = length > 0 ? (uint8_t *) malloc((size_t) length) : nullptr;
+    if (data && fread(data, 1, (size_t) length, f) != (size_t) length) {
+        free(data);
+        data = nullptr;
+    }
+    fclose(f);
+    *size = (size_t) length;
+    return data;
+}
+
+// Nearest rank percentile of sorted values
+static double percentile(const double *sorted, size_t count, double p) {
+    auto rank = (size_t) (p / 100 * (double) count + 0.999999);
+    rank = rank < 1 ? 1 : rank > count ? count : rank;
+    return sorted[rank - 1];
+}
+
+static int parse_threads(const char *list, uint32_t *threads, uint32_t *count) {
+    *count = 0;
+    for (const char *p = list; *p && *count < MAX_THREAD_COUNTS;) {
+        char *end;
+        unsigned long n = strtoul(p, &end, 10);
+        if (end == p || n == 0) {
+            return 1;
+        }
+        threads[(*count)++] = (uint32_t) n;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return *count == 0;
+}
+
+static int run(const Input *inputs, int count, uint32_t threads, int runs, Summary *summary) {
+    jxr_options options;
+    jxr_options_init(&options);
+    options.threading.num_threads = threads;
+
+    size_t samples = (size_t) count * runs;
+    auto seconds = (double *) malloc(samples * sizeof(double));
+    if (seconds == nullptr) {
+        return 1;
+    }
+
+    double pixels = 0;
+    double total = 0;
+    jxr_buffer png = {nullptr, 0, 0, 1};
+
+    for (int r = 0; r < runs; r++) {
+        for (int i = 0; i < count; i++) {
+            jxr_result result;
+            auto begin = std::chrono::steady_clock::now();
+            jxr_status status = jxr_convert_memory(inputs[i].data, inputs[i].size, &options, &png, &result);
+            double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+            if (status != JXR_OK) {
+                fprintf(stderr, "%s: %s\n", inputs[i].path, result.error ? result.error : jxr_status_string(status));
+                jxr_buffer_free(&options, &png);
+                free(seconds);
+                return 1;
+            }
+
+            seconds[(size_t) r * count + i] = s;
+            pixels += (double) result.width * result.height;
+            total += s;
+        }
+    }
+    jxr_buffer_free(&options, &png);
+
+    std::sort(seconds, seconds + samples);
+    summary->threads = threads;
+    summary->p50 = percentile(seconds, samples, 50);
+    summary->p99 = percentile(seconds, samples, 99);
+    summary->megapixelsPerSecond = pixels / total / 1e6;
+
+    free(seconds);
+    return 0;
+}
+
+// Header line, then one line per thread count
+static int save_baseline(const char *path, const Summary *summaries, uint32_t count, int inputs) {
+    FILE *f = fopen(path, "w");
+    if (f == nullptr) {
+        return 1;
+    }
+    fprintf(f, "jxr_to_png e2e baseline 1 inputs %d\n", inputs);
+    for (uint32_t i = 0; i < count; i++) {
+        fprintf(f, "threads %u p50 %.6f p99 %.6f mps %.6f\n", summaries[i].threads, summaries[i].p50,
+                summaries[i].p99, summaries[i].megapixelsPerSecond);
+    }
+    return fclose(f) != 0;
+}
+
+static int load_baseline(const char *path, Summary *summaries, uint32_t *count, int *inputs) {
+    FILE *f = fopen(path, "r");
+    if (f == nullptr) {
+        return 1;
+    }
+
+    int ok = fscanf(f, "jxr_to_png e2e baseline 1 inputs %d", inputs) == 1;
+    *count = 0;
+    Summary s;
+    while (ok && *count < MAX_THREAD_COUNTS &&
+           fscanf(f, " threads %u p50 %lf p99 %lf mps %lf", &s.threads, &s.p50, &s.p99, &s.megapixelsPerSecond) == 4) {
+        summaries[(*count)++] = s;
+    }
+    fclose(f);
+    return !ok;
+}
+
+// Returns the number of regressions beyond tolerance percent
+static int compare(const Summary *current, uint32_t count, const Summary *baseline, uint32_t baselineCount,
+                   double tolerance) {
+    int regressions = 0;
+    printf("\n%8s %16s %16s %16s  %s\n", "threads", "p50 change", "p99 change", "MP/s change", "verdict");
+
+    for (uint32_t i = 0; i < count; i++) {
+        const Summary *b = nullptr;
+        for (uint32_t j = 0; j < baselineCount; j++) {
+            if (baseline[j].threads == current[i].threads) {
+                b = &baseline[j];
+            }
+        }
+        if (b == nullptr) {
+            printf("%8u %16s %16s %16s  no baseline\n", current[i].threads, "-", "-", "-");
+            continue;
+        }
+
+        double p50 = (current[i].p50 / b->p50 - 1) * 100;
+        double p99 = (current[i].p99 / b->p99 - 1) * 100;
+        double mps = (current[i].megapixelsPerSecond / b->megapixelsPerSecond - 1) * 100;
+
+        // p99 of small corpora is a single sample and too noisy to fail on
+        bool regressed = p50 > tolerance || mps < -tolerance;
+        bool improved = p50 < -tolerance && mps > tolerance;
+        regressions += regressed;
+
+        printf("%8u %+15.1f%% %+15.1f%% %+15.1f%%  %s\n", current[i].threads, p50, p99, mps,
+               regressed ? "REGRESSION" : improved ? "improved" : "ok");
+    }
+    return regressions;
+}
+
+static void usage() {
+    fprintf(stderr, "e2e_bench [--threads 1,2,4] [--runs N] [--baseline F] [--save-baseline F] [--tolerance PCT] "
+                    "input.pfm...\n");
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t threads[MAX_THREAD_COUNTS];
+    uint32_t threadCounts = 0;
+    int runs = DEFAULT_RUNS;
+    double tolerance = DEFAULT_TOLERANCE;
+    const char *baselineFile = nullptr;
+    const char *saveFile = nullptr;
+
+    int first = 1;
+    for (; first < argc && argv[first][0] == '-'; first++) {
+        if (!strcmp(argv[first], "--threads") && first + 1 < argc) {
+            if (parse_threads(argv[++first], threads, &threadCounts)) {
+                usage();
+                return 1;
+            }
+        } else if (!strcmp(argv[first], "--runs") && first + 1 < argc) {
+            runs = atoi(argv[++first]);
+            runs = runs > 0 ? runs : 1;
+        } else if (!strcmp(argv[first], "--baseline") && first + 1 < argc) {
+            baselineFile = argv[++first];
+        } else if (!strcmp(argv[first], "--save-baseline") && first + 1 < argc) {
+            saveFile = argv[++first];
+        } else if (!strcmp(argv[first], "--tolerance") && first + 1 < argc) {
+            tolerance = atof(argv[++first]);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    int count = argc - first;
+    if (count < 1) {
+        usage();
+        return 1;
+    }
+
+    // Powers of two up to the default thread count, and the default itself
+    if (threadCounts == 0) {
+        uint32_t maxThreads = jxr_default_threads();
+        for (uint32_t t = 1; t < maxThreads && threadCounts < MAX_THREAD_COUNTS - 1; t *= 2) {
+            threads[threadCounts++] = t;
+        }
+        threads[threadCounts++] = maxThreads;
+    }
+
+    auto inputs = (Input *) calloc(count, sizeof(Input));
+    if (inputs == nullptr) {
+        fprintf(stderr, "Failed to allocate inputs\n");
+        return 1;
+    }
+    for (int i = 0; i < count; i++) {
+        inputs[i].path = argv[first + i];
+        inputs[i].data = read_file(inputs[i].path, &inputs[i].size);
+        if (inputs[i].data == nullptr) {
+            fprintf(stderr, "%s: Failed to read input file\n", inputs[i].path);
+            return 1;
+        }
+    }
+
+    // Untimed pass so page faults and the first allocations do not end up in the first thread count
+    Summary warmup;
+    if (run(inputs, count, threads[0], 1, &warmup)) {
+        return 1;
+    }
+
+    printf("%d images, %d runs, latency per image in ms\n%8s %10s %10s %10s %10s %10s\n", count, runs, "threads",
+           "p50", "p99", "MP/s", "speedup", "efficiency");
+
+    Summary summaries[MAX_THREAD_COUNTS];
+    for (uint32_t t = 0; t < threadCounts; t++) {
+        if (run(inputs, count, threads[t], runs, &summaries[t])) {
+            return 1;
+        }
+        double speedup = summaries[t].megapixelsPerSecond / summaries[0].megapixelsPerSecond * threads[0];
+        printf("%8u %10.1f %10.1f %10.2f %10.2f %9.0f%%\n", threads[t], summaries[t].p50 * 1000,
+               summaries[t].p99 * 1000, summaries[t].megapixelsPerSecond, speedup, speedup / threads[t] * 100);
+    }
+
+    for (int i = 0; i < count; i++) {
+        free(inputs[i].data);
+    }
+    free(inputs);
+
+    int regressions = 0;
+    if (baselineFile) {
+        Summary baseline[MAX_THREAD_COUNTS];
+        uint32_t baselineCount;
+        int baselineInputs;
+        if (load_baseline(baselineFile, baseline, &baselineCount, &baselineInputs)) {
+            fprintf(stderr, "Failed to read baseline %s\n", baselineFile);
+            return 1;
+        }
+        if (baselineInputs != count) {
+            fprintf(stderr, "Baseline was measured on %d images, this corpus has %d\n", baselineInputs, count);
+        }
+        regressions = compare(summaries, threadCounts, baseline, baselineCount, tolerance);
+    }
+
+    if (saveFile && save_baseline(saveFile, summaries, threadCounts, count)) {
+        fprintf(stderr, "Failed to write baseline %s\n", saveFile);
+        return 1;
+    }
+
+    return regressions != 0;
+}
@@ -0,0 +1,315 @@
+// Measures the conversion, statistics and encode kernels one at a time on the synthetic scRGB
+// content calibration uses, at 1080p, 4K and 8K. Throughput is reported in megapixels per second
+// and in input bytes per TSC cycle, the best of several runs.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "convert_kernels.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+#define DEFAULT_RUNS 3
+
+typedef struct FrameSize {
+    const char *name;
+    uint32_t width;
+    uint32_t height;
+} FrameSize;
+
+static const FrameSize frame_sizes[] = {
+        {"1080p", 1920, 1080},
+        {"4k", 3840, 2160},
+        {"8k", 7680, 4320},
+};
+
+#define NUM_SIZES (sizeof(frame_sizes) / sizeof(frame_sizes[0]))
+
+// Every buffer a benchmark may read or write, for one frame size
+typedef struct Frame {
+    uint32_t width;
+    uint32_t height;
+    size_t pixels;
+    float *scrgb;        // RGBA float
+    HALF *half;          // RGBA half
+    XMFLOAT4A *bt2100;   // linear BT.2100, saturated, as load_pixel returns it
+    XMFLOAT4A *pq;       // after the PQ curve
+    uint8_t *packed;     // big endian RGB16
+    uint8_t *filtered;   // PNG rows
+    uint8_t *scratch;    // filter output of the filter benchmarks
+    uint32_t *nitCounts;
+} Frame;
+
+typedef struct Measurement {
+    double seconds;
+    uint64_t cycles;
+    size_t output;  // bytes produced, 0 when not meaningful
+} Measurement;
+
+typedef size_t (*BenchFn)(Frame *frame, const void *arg);
+
+typedef struct Benchmark {
+    const char *name;
+    BenchFn fn;
+    const void *arg;
+    size_t bytesPerPixel;  // input read per pixel, 0 for the filtered rows
+} Benchmark;
+
+static size_t bench_convert(Frame *frame, const void *arg) {
+    auto format = *(const jxr_pixel_format *) arg;
+    jxr_options options;
+    jxr_options_init(&options);
+
+    jxr_image image = {format == JXR_PIXEL_FORMAT_RGBA_FLOAT ? (const void *) frame->scrgb : frame->half,
+                       frame->width, frame->height, 0, format};
+    uint16_t maxCLL, maxFALL;
+    const char *error;
+    if (convert_frame(&options, &image, frame->packed, -1, 1, &maxCLL, &maxFALL, nullptr, &error)) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+    return frame->pixels * 6;
+}
+
+static size_t bench_convert_threads(Frame *frame, const void *) {
+    jxr_options options;
+    jxr_options_init(&options);
+
+    jxr_image image = {frame->half, frame->width, frame->height, 0, JXR_PIXEL_FORMAT_RGBA_HALF};
+    uint16_t maxCLL, maxFALL;
+    const char *error;
+    if (convert_frame(&options, &image, frame->packed, -1, jxr_default_threads(), &maxCLL, &maxFALL, nullptr,
+                      &error)) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+    return frame->pixels * 6;
+}
+
+static size_t bench_pq(Frame *frame, const void *) {
+    for (size_t i = 0; i < frame->pixels; i++) {
+        XMStoreFloat4A(&frame->pq[i], pq_inv_eotf(XMLoadFloat4A(&frame->bt2100[i])));
+    }
+    return frame->pixels * 16;
+}
+
+static size_t bench_histogram(Frame *frame, const void *) {
+    LightLevels levels = {};
+#ifdef MAXCLL_PERCENTILE
+    memset(frame->nitCounts, 0, NIT_LEVELS * sizeof(uint32_t));
+    levels.nitCounts = frame->nitCounts;
+#endif
+    for (size_t i = 0; i < frame->pixels; i++) {
+        add_light_level(&levels, XMLoadFloat4A(&frame->bt2100[i]));
+    }
+    // Keeps the sums alive
+    return levels.maxMaxComp > 0 && levels.sumOfMaxComp > 0 ? NIT_LEVELS * sizeof(uint32_t) : 0;
+}
+
+static size_t bench_pack(Frame *frame, const void *) {
+    for (size_t i = 0; i < frame->pixels; i++) {
+        store_pixel(frame->packed + 6 * i, pack_pixel(XMLoadFloat4A(&frame->pq[i])));
+    }
+    return frame->pixels * 6;
+}
+
+typedef struct FilterArg {
+    jxr_filter_policy policy;
+    jxr_png_filter type;
+} FilterArg;
+
+static size_t bench_filter(Frame *frame, const void *arg) {
+    auto f = (const FilterArg *) arg;
+    jxr_options options;
+    jxr_options_init(&options);
+    options.filter_policy = f->policy;
+    options.filter_type = f->type;
+
+    if (filter_image(&options, frame->packed, frame->width, frame->height, 1, frame->scratch)) {
+        fprintf(stderr, "Failed to filter rows\n");
+        exit(1);
+    }
+    return filtered_size(frame->width, frame->height);
+}
+
+typedef struct DeflateArg {
+    jxr_deflate deflate;
+    int level;
+} DeflateArg;
+
+static size_t bench_deflate(Frame *frame, const void *arg) {
+    auto d = (const DeflateArg *) arg;
+    jxr_options options;
+    jxr_options_init(&options);
+    options.deflate = d->deflate;
+    options.level = d->level;
+
+    size_t size = filtered_size(frame->width, frame->height);
+    size_t rowSize = (size_t) frame->width * 6 + 1;
+
+    if (d->deflate == JXR_DEFLATE_SCREEN) {
+        DeflateParts parts;
+        if (screen_deflate(&options, frame->filtered, size, rowSize, 1, &parts)) {
+            fprintf(stderr, "Screen compression failed\n");
+            exit(1);
+        }
+        size_t bytes = 0;
+        for (uint32_t i = 0; i < parts.count; i++) {
+            bytes += parts.parts[i].size;
+        }
+        jxr_free(&options, parts.memory);
+        return bytes;
+    }
+
+    size_t bytes = compressed_size(&options, frame->filtered, size, rowSize);
+    if (bytes == 0) {
+        fprintf(stderr, "Compression failed\n");
+        exit(1);
+    }
+    return bytes;
+}
+
+static const jxr_pixel_format float_format = JXR_PIXEL_FORMAT_RGBA_FLOAT;
+static const jxr_pixel_format half_format = JXR_PIXEL_FORMAT_RGBA_HALF;
+static const FilterArg filter_exhaustive = {JXR_FILTER_EXHAUSTIVE, JXR_PNG_FILTER_NONE};
+static const FilterArg filter_fast = {JXR_FILTER_FAST, JXR_PNG_FILTER_NONE};
+static const FilterArg filter_up = {JXR_FILTER_FIXED, JXR_PNG_FILTER_UP};
+static const FilterArg filter_paeth = {JXR_FILTER_FIXED, JXR_PNG_FILTER_PAETH};
+static const DeflateArg deflate_1 = {JXR_DEFLATE_ZLIB, 1};
+static const DeflateArg deflate_6 = {JXR_DEFLATE_ZLIB, 6};
+static const DeflateArg deflate_screen = {JXR_DEFLATE_SCREEN, 0};
+
+static const Benchmark benchmarks[] = {
+        {"convert float", bench_convert, &float_format, 16},
+        {"convert half", bench_convert, &half_format, 8},
+        {"convert half, all threads", bench_convert_threads, nullptr, 8},
+        {"pq curve", bench_pq, nullptr, 16},
+        {"histogram", bench_histogram, nullptr, 16},
+        {"byteswap/pack", bench_pack, nullptr, 16},
+        {"filter exhaustive", bench_filter, &filter_exhaustive, 6},
+        {"filter fast", bench_filter, &filter_fast, 6},
+        {"filter up", bench_filter, &filter_up, 6},
+        {"filter paeth", bench_filter, &filter_paeth, 6},
+        {"deflate zlib 1", bench_deflate, &deflate_1, 0},
+        {"deflate zlib 6", bench_deflate, &deflate_6, 0},
+        {"deflate screen", bench_deflate, &deflate_screen, 0},
+};
+
+static Measurement measure(const Benchmark *b, Frame *frame, int runs) {
+    Measurement best = {0, 0, 0};
+    for (int run = 0; run < runs; run++) {
+        auto begin = std::chrono::steady_clock::now();
+        uint64_t cycles = __rdtsc();
+        size_t output = b->fn(frame, b->arg);
+        cycles = __rdtsc() - cycles;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        if (run == 0 || seconds < best.seconds) {
+            best = {seconds, cycles, output};
+        }
+    }
+    return best;
+}
+
+static int prepare_frame(Frame *frame, const FrameSize *size) {
+    memset(frame, 0, sizeof(Frame));
+    frame->width = size->width;
+    frame->height = size->height;
+    frame->pixels = (size_t) size->width * size->height;
+
+    size_t rows = filtered_size(size->width, size->height);
+    frame->scrgb = (float *) malloc(frame->pixels * 16);
+    frame->half = (HALF *) malloc(frame->pixels * 8);
+    frame->bt2100 = (XMFLOAT4A *) _mm_malloc(frame->pixels * sizeof(XMFLOAT4A), 16);
+    frame->pq = (XMFLOAT4A *) _mm_malloc(frame->pixels * sizeof(XMFLOAT4A), 16);
+    frame->packed = (uint8_t *) malloc(frame->pixels * 6 + 8);
+    frame->filtered = (uint8_t *) malloc(rows);
+    frame->scratch = (uint8_t *) malloc(rows);
+    frame->nitCounts = (uint32_t *) calloc(NIT_LEVELS, sizeof(uint32_t));
+
+    if (!frame->scrgb || !frame->half || !frame->bt2100 || !frame->pq || !frame->packed || !frame->filtered ||
+        !frame->scratch || !frame->nitCounts) {
+        return 1;
+    }
+
+    synthetic_image(frame->scrgb, size->width, size->height);
+    XMConvertFloatToHalfStream(frame->half, sizeof(HALF), frame->scrgb, sizeof(float), frame->pixels * 4);
+
+    for (size_t i = 0; i < frame->pixels; i++) {
+        XMStoreFloat4A(&frame->bt2100[i], load_pixel((const uint8_t *) frame->scrgb, (uint32_t) i, 4));
+    }
+
+    // Real PNG rows as the input of the deflate benchmarks
+    bench_pq(frame, nullptr);
+    bench_pack(frame, nullptr);
+    jxr_options options;
+    jxr_options_init(&options);
+    return filter_image(&options, frame->packed, size->width, size->height, 1, frame->filtered);
+}
+
+static void free_frame(Frame *frame) {
+    free(frame->scrgb);
+    free(frame->half);
+    _mm_free(frame->bt2100);
+    _mm_free(frame->pq);
+    free(frame->packed);
+    free(frame->filtered);
+    free(frame->scratch);
+    free(frame->nitCounts);
+}
+
+int main(int argc, char *argv[]) {
+    int runs = DEFAULT_RUNS;
+    bool selected[NUM_SIZES] = {};
+    bool any = false;
+
+    for (int i = 1; i < argc; i++) {
+        bool known = false;
+        for (size_t s = 0; s < NUM_SIZES; s++) {
+            if (!strcmp(argv[i], frame_sizes[s].name)) {
+                selected[s] = known = any = true;
+            }
+        }
+        if (!known && atoi(argv[i]) > 0) {
+            runs = atoi(argv[i]);
+        } else if (!known) {
+            fprintf(stderr, "kernel_bench [runs] [1080p] [4k] [8k]\n");
+            return 1;
+        }
+    }
+
+    printf("best of %d runs, bytes per cycle of input at the TSC rate, %u threads for the threaded run\n", runs,
+           jxr_default_threads());
+
+    for (size_t s = 0; s < NUM_SIZES; s++) {
+        if (any && !selected[s]) {
+            continue;
+        }
+
+        Frame frame;
+        if (prepare_frame(&frame, &frame_sizes[s])) {
+            fprintf(stderr, "Failed to prepare the %s frame\n", frame_sizes[s].name);
+            free_frame(&frame);
+            return 1;
+        }
+
+        printf("\n%s (%ux%u)\n%-26s %10s %10s %10s %12s\n", frame_sizes[s].name, frame.width, frame.height,
+               "kernel", "ms", "MP/s", "B/cycle", "output");
+
+        for (const Benchmark &b: benchmarks) {
+            Measurement m = measure(&b, &frame, runs);
+            size_t input = b.bytesPerPixel ? frame.pixels * b.bytesPerPixel
+                                           : filtered_size(frame.width, frame.height);
+            printf("%-26s %10.1f %10.1f %10.3f %12zu\n", b.name, m.seconds * 1000,
+                   (double) frame.pixels / m.seconds / 1e6, m.cycles ? (double) input / (double) m.cycles : 0,
+                   m.output);
+        }
+
+        free_frame(&frame);
+    }
+    return 0;
+}
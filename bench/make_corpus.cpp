@@ -0,0 +1,288 @@
+// Writes a reproducible corpus of synthetic scRGB frames as PFM files, one set per content class:
+// flat UI mosaics, smooth gradients, dark scenes with highlights far above 1000 nits, noisy
+// game-like content with wide gamut colors, and SDR content that stays within 80 nits.
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+
+#define DEFAULT_WIDTH 3840
+#define DEFAULT_HEIGHT 2160
+#define DEFAULT_COUNT 2
+#define NITS(n) ((float) (n) / 80.0f)  // scRGB 1.0 is 80 nits
+
+typedef struct Rng {
+    uint32_t state;
+} Rng;
+
+static uint32_t next(Rng *rng) {
+    // xorshift32
+    uint32_t x = rng->state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return rng->state = x;
+}
+
+static float uniform(Rng *rng) {
+    return (float) (next(rng) >> 8) / (float) (1 << 24);
+}
+
+static float hash2(int32_t x, int32_t y, uint32_t seed) {
+    uint32_t h = (uint32_t) x * 374761393u + (uint32_t) y * 668265263u + seed * 2246822519u;
+    h = (h ^ (h >> 13)) * 1274126177u;
+    return (float) ((h ^ (h >> 16)) >> 8) / (float) (1 << 24);
+}
+
+// Smooth value noise in [0, 1) with features about scale pixels wide
+static float value_noise(float x, float y, float scale, uint32_t seed) {
+    x /= scale;
+    y /= scale;
+    auto x0 = (int32_t) std::floor(x);
+    auto y0 = (int32_t) std::floor(y);
+    float fx = x - (float) x0;
+    float fy = y - (float) y0;
+    fx = fx * fx * (3 - 2 * fx);
+    fy = fy * fy * (3 - 2 * fy);
+    float top = hash2(x0, y0, seed) + (hash2(x0 + 1, y0, seed) - hash2(x0, y0, seed)) * fx;
+    float bottom = hash2(x0, y0 + 1, seed) + (hash2(x0 + 1, y0 + 1, seed) - hash2(x0, y0 + 1, seed)) * fx;
+    return top + (bottom - top) * fy;
+}
+
+typedef void (*Generator)(float *rgb, uint32_t width, uint32_t height, Rng *rng);
+
+// Windows of flat colors with title bars and lines of glyphs, on a desktop background
+static void generate_ui(float *rgb, uint32_t width, uint32_t height, Rng *rng) {
+    float background[3] = {NITS(20) * uniform(rng), NITS(30) * uniform(rng), NITS(60) * uniform(rng)};
+    for (size_t i = 0; i < (size_t) width * height; i++) {
+        memcpy(rgb + 3 * i, background, sizeof(background));
+    }
+
+    float paperWhite = NITS(200 + 80 * (next(rng) % 3));
+    int windows = 6 + (int) (next(rng) % 10);
+
+    for (int w = 0; w < windows; w++) {
+        uint32_t x0 = next(rng) % width;
+        uint32_t y0 = next(rng) % height;
+        uint32_t x1 = x0 + width / 8 + next(rng) % (width / 2);
+        uint32_t y1 = y0 + height / 8 + next(rng) % (height / 2);
+        x1 = x1 < width ? x1 : width;
+        y1 = y1 < height ? y1 : height;
+
+        bool dark = next(rng) % 2;
+        float panel = dark ? paperWhite * 0.12f : paperWhite;
+        float ink = dark ? paperWhite * 0.9f : paperWhite * 0.05f;
+        float accent[3] = {paperWhite * uniform(rng), paperWhite * uniform(rng), paperWhite * uniform(rng)};
+
+        for (uint32_t y = y0; y < y1; y++) {
+            for (uint32_t x = x0; x < x1; x++) {
+                float *p = rgb + 3 * ((size_t) y * width + x);
+                if (y - y0 < 32) {
+                    memcpy(p, accent, sizeof(accent));
+                    continue;
+                }
+                // Text lines of 16 pixel glyph cells with 24 pixel spacing
+                uint32_t line = (y - y0 - 32) % 24;
+                uint32_t cell = (x - x0) % 9;
+                bool glyph = line >= 4 && line < 16 && cell < 7 &&
+                             hash2((int32_t) ((x - x0) / 9), (int32_t) ((y - y0) / 24 * 16 + line / 3), w) > 0.55f;
+                p[0] = p[1] = p[2] = glyph ? ink : panel;
+            }
+        }
+    }
+}
+
+// Overlapping linear and radial gradients, the worst case for banding
+static void generate_gradient(float *rgb, uint32_t width, uint32_t height, Rng *rng) {
+    float peak = NITS(400 + 600 * uniform(rng));
+    float cx = uniform(rng) * (float) width;
+    float cy = uniform(rng) * (float) height;
+    float tint[3] = {0.5f + 0.5f * uniform(rng), 0.5f + 0.5f * uniform(rng), 0.5f + 0.5f * uniform(rng)};
+
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            float *p = rgb + 3 * ((size_t) y * width + x);
+            float dx = ((float) x - cx) / (float) width;
+            float dy = ((float) y - cy) / (float) height;
+            float radial = std::exp(-4 * (dx * dx + dy * dy));
+            float linear = (float) x / (float) width;
+            float vertical = (float) y / (float) height;
+            p[0] = peak * tint[0] * (0.6f * radial + 0.4f * linear);
+            p[1] = peak * tint[1] * (0.6f * radial + 0.4f * vertical);
+            p[2] = peak * tint[2] * (0.5f * radial + 0.5f * (1 - vertical));
+        }
+    }
+}
+
+// A dim scene with a sun, specular glints and lamps between 1000 and 10000 nits
+static void generate_highlights(float *rgb, uint32_t width, uint32_t height, Rng *rng) {
+    uint32_t seed = next(rng);
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            float *p = rgb + 3 * ((size_t) y * width + x);
+            float base = NITS(5 + 60 * value_noise((float) x, (float) y, 200, seed));
+            p[0] = base;
+            p[1] = base * 0.9f;
+            p[2] = base * 0.8f;
+        }
+    }
+
+    int lights = 20 + (int) (next(rng) % 40);
+    for (int l = 0; l < lights; l++) {
+        float cx = uniform(rng) * (float) width;
+        float cy = uniform(rng) * (float) height;
+        float radius = l == 0 ? (float) height / 12 : 2 + 30 * uniform(rng);
+        float level = l == 0 ? NITS(10000) : NITS(1000 + 5000 * uniform(rng));
+        float warm = uniform(rng);
+
+        auto x0 = (int32_t) (cx - 3 * radius);
+        auto y0 = (int32_t) (cy - 3 * radius);
+        for (int32_t y = y0 < 0 ? 0 : y0; y < (int32_t) height && y <= (int32_t) (cy + 3 * radius); y++) {
+            for (int32_t x = x0 < 0 ? 0 : x0; x < (int32_t) width && x <= (int32_t) (cx + 3 * radius); x++) {
+                float dx = ((float) x - cx) / radius;
+                float dy = ((float) y - cy) / radius;
+                float glow = level * std::exp(-(dx * dx + dy * dy));
+                float *p = rgb + 3 * ((size_t) y * width + x);
+                p[0] += glow;
+                p[1] += glow * (0.8f + 0.2f * (1 - warm));
+                p[2] += glow * (0.5f + 0.5f * (1 - warm));
+            }
+        }
+    }
+}
+
+// Textured surfaces with film grain, saturated colors outside sRGB and a few bright effects
+static void generate_game(float *rgb, uint32_t width, uint32_t height, Rng *rng) {
+    uint32_t seed = next(rng);
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            float *p = rgb + 3 * ((size_t) y * width + x);
+            float detail = value_noise((float) x, (float) y, 6, seed);
+            float shape = value_noise((float) x, (float) y, 120, seed + 1);
+            float hue = value_noise((float) x, (float) y, 400, seed + 2);
+            float grain = 0.08f * (uniform(rng) - 0.5f);
+            float level = NITS(20 + 250 * shape * (0.7f + 0.3f * detail)) * (1 + grain);
+            float effect = shape > 0.93f ? NITS(1500) * (shape - 0.93f) * 14 : 0;
+
+            // Negative scRGB components are colors outside the sRGB gamut
+            p[0] = level * (1.2f * hue - 0.05f) + effect;
+            p[1] = level * (1.0f - 0.6f * hue) + effect;
+            p[2] = level * (0.3f + 0.9f * (1 - hue) * detail) - 0.02f * level + effect * 0.6f;
+        }
+    }
+}
+
+// Photo-like content that never exceeds scRGB 1.0
+static void generate_sdr(float *rgb, uint32_t width, uint32_t height, Rng *rng) {
+    uint32_t seed = next(rng);
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            float *p = rgb + 3 * ((size_t) y * width + x);
+            float shape = value_noise((float) x, (float) y, 80, seed);
+            float detail = value_noise((float) x, (float) y, 4, seed + 1);
+            float sky = (float) y / (float) height;
+            float v = 0.15f + 0.7f * shape + 0.1f * detail;
+            v = v > 1 ? 1 : v;
+            p[0] = v * (0.8f + 0.2f * sky);
+            p[1] = v * 0.9f;
+            p[2] = v * (1.0f - 0.3f * sky);
+        }
+    }
+}
+
+typedef struct ContentClass {
+    const char *name;
+    Generator generate;
+} ContentClass;
+
+static const ContentClass classes[] = {
+        {"ui", generate_ui},
+        {"gradient", generate_gradient},
+        {"highlights", generate_highlights},
+        {"game", generate_game},
+        {"sdr", generate_sdr},
+};
+
+// Little endian PFM, bottom row first
+static int write_pfm(const char *path, const float *rgb, uint32_t width, uint32_t height) {
+    FILE *f = fopen(path, "wb");
+    if (f == nullptr) {
+        return 1;
+    }
+
+    const uint16_t endianTest = 1;
+    bool little = *(const uint8_t *) &endianTest == 1;
+    fprintf(f, "PF\n%u %u\n%s\n", width, height, little ? "-1.0" : "1.0");
+
+    bool failed = false;
+    for (uint32_t y = height; y-- > 0 && !failed;) {
+        failed = fwrite(rgb + (size_t) y * width * 3, sizeof(float) * 3, width, f) != width;
+    }
+    return fclose(f) || failed;
+}
+
+static void usage() {
+    fprintf(stderr, "make_corpus [-s WIDTHxHEIGHT] [-n images per class] [--seed N] output_dir\n");
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t width = DEFAULT_WIDTH;
+    uint32_t height = DEFAULT_HEIGHT;
+    uint32_t count = DEFAULT_COUNT;
+    uint32_t seed = 1;
+
+    int first = 1;
+    for (; first < argc && argv[first][0] == '-'; first++) {
+        if (!strcmp(argv[first], "-s") && first + 1 < argc &&
+            sscanf(argv[first + 1], "%ux%u", &width, &height) == 2 && width >= 16 && height >= 16) {
+            first++;
+        } else if (!strcmp(argv[first], "-n") && first + 1 < argc) {
+            count = (uint32_t) strtoul(argv[++first], nullptr, 10);
+        } else if (!strcmp(argv[first], "--seed") && first + 1 < argc) {
+            seed = (uint32_t) strtoul(argv[++first], nullptr, 10);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (first + 1 != argc) {
+        usage();
+        return 1;
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(argv[first], ec);
+    if (ec) {
+        fprintf(stderr, "Failed to create %s: %s\n", argv[first], ec.message().c_str());
+        return 1;
+    }
+
+    auto rgb = (float *) malloc((size_t) width * height * 3 * sizeof(float));
+    if (rgb == nullptr) {
+        fprintf(stderr, "Failed to allocate frame\n");
+        return 1;
+    }
+
+    for (const ContentClass &c: classes) {
+        for (uint32_t i = 0; i < count; i++) {
+            // Each image depends only on the seed, class and index
+            Rng rng = {(seed * 2654435761u) ^ (uint32_t) ((&c - classes) * 40503 + i * 9973 + 1)};
+            rng.state = rng.state ? rng.state : 1;
+            c.generate(rgb, width, height, &rng);
+
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%s_%03u.pfm", argv[first], c.name, i);
+            if (write_pfm(path, rgb, width, height)) {
+                fprintf(stderr, "Failed to write %s\n", path);
+                free(rgb);
+                return 1;
+            }
+            printf("%s\n", path);
+        }
+    }
+
+    free(rgb);
+    return 0;
+}
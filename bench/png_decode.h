@@ -0,0 +1,155 @@
+// PNG decoding for the benchmarks that time their outputs: zlib's inflate and plain C unfiltering,
+// the way a typical PNG decoder does it, for the 16 bit RGB images this library writes.
+#ifndef JXR_BENCH_PNG_DECODE_H
+#define JXR_BENCH_PNG_DECODE_H
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "jxr_to_png.h"
+
+#ifdef JXR_SYSTEM_ZLIB
+#include <zlib.h>
+#else
+#include "zlib/zlib.h"
+#endif
+
+#define BPP 6
+
+typedef struct DecodeTimes {
+    double crc;
+    double inflate;
+    double unfilter;
+} DecodeTimes;
+
+static inline double seconds_since(std::chrono::steady_clock::time_point begin) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+
+static inline uint32_t get_be32(const uint8_t *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static inline void unfilter_row(int type, uint8_t *row, const uint8_t *prev, size_t length) {
+    switch (type) {
+        case JXR_PNG_FILTER_SUB:
+            for (size_t i = BPP; i < length; i++) {
+                row[i] = (uint8_t) (row[i] + row[i - BPP]);
+            }
+            break;
+        case JXR_PNG_FILTER_UP:
+            for (size_t i = 0; i < length; i++) {
+                row[i] = (uint8_t) (row[i] + prev[i]);
+            }
+            break;
+        case JXR_PNG_FILTER_AVERAGE:
+            for (size_t i = 0; i < length; i++) {
+                int a = i >= BPP ? row[i - BPP] : 0;
+                row[i] = (uint8_t) (row[i] + ((a + prev[i]) >> 1));
+            }
+            break;
+        case JXR_PNG_FILTER_PAETH:
+            for (size_t i = 0; i < length; i++) {
+                int a = i >= BPP ? row[i - BPP] : 0;
+                int b = prev[i];
+                int c = i >= BPP ? prev[i - BPP] : 0;
+                int pa = abs(b - c);
+                int pb = abs(a - c);
+                int pc = abs(a + b - 2 * c);
+                row[i] = (uint8_t) (row[i] + (pa <= pb && pa <= pc ? a : pb <= pc ? b : c));
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Decodes into pixels (6 bytes per pixel), raw holds the inflated rows and pixels needs a zeroed row
+// after the image. times, if not null, receives the time spent in each step. Returns 1 on malformed data.
+static inline int decode_png(const uint8_t *png, size_t size, uint8_t *raw, size_t rawSize, uint8_t *pixels,
+                             uint32_t width, uint32_t height, DecodeTimes *times) {
+    z_stream stream = {};
+    if (inflateInit(&stream) != Z_OK) {
+        return 1;
+    }
+    stream.next_out = raw;
+    stream.avail_out = (uInt) rawSize;
+
+    DecodeTimes spent = {};
+    int ret = Z_OK;
+
+    for (size_t pos = 8; pos + 12 <= size;) {
+        uint32_t length = get_be32(png + pos);
+        const uint8_t *type = png + pos + 4;
+        if (pos + 12 + length > size) {
+            break;
+        }
+
+        if (!memcmp(type, "IDAT", 4)) {
+            auto begin = std::chrono::steady_clock::now();
+            bool valid = crc32(0, type, length + 4) == get_be32(png + pos + 8 + length);
+            spent.crc += seconds_since(begin);
+            if (!valid) {
+                inflateEnd(&stream);
+                return 1;
+            }
+
+            begin = std::chrono::steady_clock::now();
+            stream.next_in = (Bytef *) png + pos + 8;
+            stream.avail_in = length;
+            ret = inflate(&stream, Z_NO_FLUSH);
+            spent.inflate += seconds_since(begin);
+            if (ret != Z_OK && ret != Z_STREAM_END) {
+                break;
+            }
+        }
+
+        pos += 12 + length;
+    }
+
+    inflateEnd(&stream);
+    if (ret != Z_STREAM_END || stream.total_out != rawSize) {
+        return 1;
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+    size_t length = (size_t) width * BPP;
+    const uint8_t *zeroRow = pixels + length * height;
+    for (uint32_t y = 0; y < height; y++) {
+        uint8_t *row = pixels + length * y;
+        const uint8_t *filtered = raw + (length + 1) * y;
+        if (filtered[0] > JXR_PNG_FILTER_PAETH) {
+            return 1;
+        }
+        memcpy(row, filtered + 1, length);
+        unfilter_row(filtered[0], row, y ? row - length : zeroRow, length);
+    }
+    spent.unfilter = seconds_since(begin);
+
+    if (times) {
+        *times = spent;
+    }
+    return 0;
+}
+
+static inline uint8_t *read_file(const char *path, size_t *size) {
+    FILE *f = fopen(path, "rb");
+    if (f == nullptr) {
+        return nullptr;
+    }
+    fseek(f, 0, SEEK_END);
+    long length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    auto data = length > 0 ? (uint8_t *) malloc((size_t) length) : nullptr;
+    if (data && fread(data, 1, (size_t) length, f) != (size_t) length) {
+        free(data);
+        data = nullptr;
+    }
+    fclose(f);
+    *size = (size_t) length;
+    return data;
+}
+
+#endif
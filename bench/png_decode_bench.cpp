@@ -0,0 +1,150 @@
+// Encodes an image with several output settings and measures how fast each PNG decodes, using
+// zlib's inflate and plain C unfiltering the way a typical PNG decoder does. All outputs must
+// decode to the same pixels.
+#include "png_decode.h"
+
+#define DEFAULT_RUNS 5
+
+typedef struct Profile {
+    const char *name;
+    void (*apply)(jxr_options *options);
+} Profile;
+
+static void profile_default(jxr_options *) {
+}
+
+static void profile_paeth(jxr_options *options) {
+    options->filter_policy = JXR_FILTER_FIXED;
+    options->filter_type = JXR_PNG_FILTER_PAETH;
+}
+
+static void profile_up(jxr_options *options) {
+    options->filter_policy = JXR_FILTER_FIXED;
+    options->filter_type = JXR_PNG_FILTER_UP;
+}
+
+static void profile_small_idat(jxr_options *options) {
+    options->idat_size = 8192;
+}
+
+static void profile_screen(jxr_options *options) {
+    options->deflate = JXR_DEFLATE_SCREEN;
+}
+
+static void profile_stored(jxr_options *options) {
+    options->deflate = JXR_DEFLATE_STORED;
+    options->filter_policy = JXR_FILTER_FIXED;
+    options->filter_type = JXR_PNG_FILTER_NONE;
+}
+
+static const Profile profiles[] = {
+        {"default", profile_default},
+        {"paeth", profile_paeth},
+        {"up", profile_up},
+        {"8 KB IDAT", profile_small_idat},
+        {"screen", profile_screen},
+        {"stored", profile_stored},
+        {"fast decode", jxr_options_decode_fast},
+};
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "png_decode_bench input.jxr|input.pfm [runs]\n");
+        return 1;
+    }
+    int runs = argc > 2 ? atoi(argv[2]) : DEFAULT_RUNS;
+    runs = runs > 0 ? runs : 1;
+
+    size_t inputSize;
+    uint8_t *input = read_file(argv[1], &inputSize);
+    if (input == nullptr) {
+        fprintf(stderr, "Failed to read input file\n");
+        return 1;
+    }
+
+    jxr_options options;
+    jxr_options_init(&options);
+
+    jxr_image image;
+    jxr_result result;
+    if (jxr_decode_memory(input, inputSize, &options, &image, &result) != JXR_OK) {
+        fprintf(stderr, "%s\n", result.error ? result.error : "Failed to decode input");
+        return 1;
+    }
+    free(input);
+
+    uint32_t width = image.width;
+    uint32_t height = image.height;
+    size_t pixelSize = (size_t) width * height * BPP;
+    size_t rawSize = (size_t) height * (1 + (size_t) width * BPP);
+
+    auto raw = (uint8_t *) malloc(rawSize);
+    auto pixels = (uint8_t *) calloc(1, pixelSize + width * BPP);
+    auto reference = (uint8_t *) malloc(pixelSize);
+    if (raw == nullptr || pixels == nullptr || reference == nullptr) {
+        fprintf(stderr, "Failed to allocate decode buffers\n");
+        return 1;
+    }
+
+    printf("%ux%u, %d runs, best times in ms, decode speed in MB of pixels per second\n", width, height, runs);
+    printf("%-12s %10s %8s %8s %8s %8s %8s %8s %8s\n", "profile", "bytes", "encode", "crc", "inflate",
+           "unfilter", "decode", "MB/s", "chunks");
+
+    int failures = 0;
+
+    for (size_t p = 0; p < sizeof(profiles) / sizeof(profiles[0]); p++) {
+        jxr_options profileOptions;
+        jxr_options_init(&profileOptions);
+        profiles[p].apply(&profileOptions);
+
+        jxr_buffer png = {nullptr, 0, 0, 1};
+        auto begin = std::chrono::steady_clock::now();
+        jxr_status status = jxr_convert_pixels(&image, &profileOptions, &png, &result);
+        double encode = seconds_since(begin);
+
+        if (status != JXR_OK) {
+            printf("%-12s failed: %s\n", profiles[p].name, result.error ? result.error : jxr_status_string(status));
+            failures++;
+            continue;
+        }
+
+        uint32_t chunks = 0;
+        for (size_t pos = 8; pos + 12 <= png.size; pos += 12 + get_be32(png.data + pos)) {
+            chunks += !memcmp(png.data + pos + 4, "IDAT", 4);
+        }
+
+        DecodeTimes best = {};
+        double bestTotal = 0;
+        bool valid = true;
+
+        for (int run = 0; run < runs && valid; run++) {
+            DecodeTimes times = {};
+            valid = !decode_png(png.data, png.size, raw, rawSize, pixels, width, height, &times);
+            double total = times.crc + times.inflate + times.unfilter;
+            if (run == 0 || total < bestTotal) {
+                best = times;
+                bestTotal = total;
+            }
+        }
+
+        if (valid && p == 0) {
+            memcpy(reference, pixels, pixelSize);
+        }
+        if (!valid || memcmp(reference, pixels, pixelSize)) {
+            printf("%-12s decoded pixels differ from the default output\n", profiles[p].name);
+            failures++;
+        } else {
+            printf("%-12s %10zu %8.1f %8.1f %8.1f %8.1f %8.1f %8.0f %8u\n", profiles[p].name, png.size,
+                   encode * 1000, best.crc * 1000, best.inflate * 1000, best.unfilter * 1000, bestTotal * 1000,
+                   pixelSize / bestTotal / 1e6, chunks);
+        }
+
+        jxr_buffer_free(&profileOptions, &png);
+    }
+
+    jxr_image_free(&options, &image);
+    free(raw);
+    free(pixels);
+    free(reference);
+    return failures != 0;
+}
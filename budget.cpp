@@ -0,0 +1,287 @@
+// Fits an encode into a time budget: the cost of each compression setting is predicted from a
+// calibration of this host, scaled by how a small band of the image behaves, and the strongest
+// setting that is expected to finish in time is used with the fewest threads that get it there
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include "internal.h"
+
+#define CALIBRATION_WIDTH 1024
+#define CALIBRATION_HEIGHT 256
+#define CALIBRATION_RUNS 3  // the fastest of these is kept
+#define SAMPLE_FRACTION 64  // share of the rows sampled per setting
+#define SAMPLE_MIN_ROWS 4
+#define SAMPLE_MAX_ROWS 32
+#define SAMPLE_SHARE 0.05  // of the remaining budget that sampling one more setting may take
+#define BUDGET_HEADROOM 0.85  // share of the remaining budget a prediction may use
+
+typedef struct BudgetSetting {
+    const char *name;
+    jxr_filter_policy policy;
+    jxr_png_filter type;
+    jxr_deflate deflate;
+    int level;
+} BudgetSetting;
+
+// Strongest first
+static const BudgetSetting settings[JXR_BUDGET_SETTINGS] = {
+        {"adaptive filters, zlib 9", JXR_FILTER_EXHAUSTIVE, JXR_PNG_FILTER_NONE, JXR_DEFLATE_ZLIB, 9},
+        {"adaptive filters, zlib 6", JXR_FILTER_EXHAUSTIVE, JXR_PNG_FILTER_NONE, JXR_DEFLATE_ZLIB, 6},
+        {"adaptive filters, zlib 3", JXR_FILTER_EXHAUSTIVE, JXR_PNG_FILTER_NONE, JXR_DEFLATE_ZLIB, 3},
+        {"fast filters, zlib 1", JXR_FILTER_FAST, JXR_PNG_FILTER_NONE, JXR_DEFLATE_ZLIB, 1},
+        {"up, screen", JXR_FILTER_FIXED, JXR_PNG_FILTER_UP, JXR_DEFLATE_SCREEN, 0},
+};
+
+static void apply(const BudgetSetting *s, jxr_options *options) {
+    options->filter_policy = s->policy;
+    options->filter_type = s->type;
+    options->deflate = s->deflate;
+    options->strategy = JXR_STRATEGY_LIBPNG;
+    options->level = s->level;
+    options->auto_compression = 0;
+    options->optimize = 0;
+}
+
+// Per pixel nanoseconds of converting, filtering and compressing plain rows with one thread
+typedef struct StageCosts {
+    double convert;
+    double filter;
+    double deflate;
+} StageCosts;
+
+static jxr_status measure_convert(const jxr_options *options, const jxr_image *image, uint8_t *out,
+                                  uint32_t threads, double *ns) {
+    uint16_t maxCLL, maxFALL;
+    const char *error;
+    double begin = monotonic_seconds();
+    jxr_status status = convert_frame(options, image, out, -1, threads, &maxCLL, &maxFALL, nullptr, &error);
+    if (status != JXR_OK) {
+        return status;
+    }
+    *ns = (monotonic_seconds() - begin) * 1e9 / ((double) image->width * image->height);
+    return JXR_OK;
+}
+
+// On one thread, filtering and compressing only fail to allocate their buffers
+static jxr_status measure_encode(const jxr_options *options, const uint8_t *data, uint32_t width, uint32_t height,
+                                 uint8_t *filtered, StageCosts *costs) {
+    double pixels = (double) width * height;
+    double begin = monotonic_seconds();
+    if (filter_image(options, data, width, height, 1, filtered)) {
+        return JXR_ERROR_OUT_OF_MEMORY;
+    }
+    double filtered_at = monotonic_seconds();
+    if (compressed_size(options, filtered, filtered_size(width, height), (size_t) width * 6 + 1) == 0) {
+        return JXR_ERROR_OUT_OF_MEMORY;
+    }
+    costs->filter = (filtered_at - begin) * 1e9 / pixels;
+    costs->deflate = (monotonic_seconds() - filtered_at) * 1e9 / pixels;
+    return JXR_OK;
+}
+
+// Half desktop (flat panels and text-like detail), half photo (smooth gradients with grain)
+void synthetic_image(float *pixels, uint32_t width, uint32_t height) {
+    uint32_t seed = 1;
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            float *p = pixels + ((size_t) y * width + x) * 4;
+            seed = seed * 1664525 + 1013904223;
+            float grain = (float) (seed >> 8) / (float) (1 << 24) * 0.05f;
+
+            if (x < width / 2) {
+                bool glyph = (x / 3 + y / 5) % 7 == 0 && y % 24 < 12;
+                float panel = (x / 128 + y / 64) % 2 ? 0.2f : 1.0f;
+                p[0] = glyph ? 3.0f : panel;
+                p[1] = glyph ? 3.0f : panel;
+                p[2] = glyph ? 3.0f : panel * 1.2f;
+            } else {
+                p[0] = 0.5f + 0.5f * std::sin(x * 0.011f) + grain;
+                p[1] = 0.5f + 0.5f * std::sin(y * 0.017f) + grain;
+                p[2] = 1.5f * (float) y / height + grain;
+            }
+            p[3] = 1.0f;
+        }
+    }
+}
+
+jxr_status jxr_calibrate(const jxr_options *options, jxr_calibration *calibration) {
+    jxr_options defaults;
+    if (options == nullptr) {
+        jxr_options_init(&defaults);
+        options = &defaults;
+    }
+    if (calibration == nullptr || !allocator_valid(&options->allocator)) {
+        return JXR_ERROR_INVALID_ARGUMENT;
+    }
+
+    size_t pixelCount = (size_t) CALIBRATION_WIDTH * CALIBRATION_HEIGHT;
+    size_t plainSize = pixelCount * 6;
+    auto memory = (uint8_t *) jxr_malloc(options, pixelCount * 16 + plainSize +
+                                                  filtered_size(CALIBRATION_WIDTH, CALIBRATION_HEIGHT), JXR_MEMORY_OTHER);
+    if (memory == nullptr) {
+        return JXR_ERROR_OUT_OF_MEMORY;
+    }
+
+    auto pixels = (float *) memory;
+    uint8_t *plain = memory + pixelCount * 16;
+    uint8_t *filtered = plain + plainSize;
+    synthetic_image(pixels, CALIBRATION_WIDTH, CALIBRATION_HEIGHT);
+
+    jxr_image image = {pixels, CALIBRATION_WIDTH, CALIBRATION_HEIGHT, 0, JXR_PIXEL_FORMAT_RGBA_FLOAT};
+
+    uint32_t threads = resolve_threads(options);
+    calibration->threads = threads;
+    calibration->convert_ns = DBL_MAX;
+    double parallel = DBL_MAX;
+    for (uint32_t s = 0; s < JXR_BUDGET_SETTINGS; s++) {
+        calibration->filter_ns[s] = DBL_MAX;
+        calibration->deflate_ns[s] = DBL_MAX;
+    }
+
+    jxr_status status = JXR_OK;
+    for (int run = 0; run < CALIBRATION_RUNS && status == JXR_OK; run++) {
+        double ns;
+        status = measure_convert(options, &image, plain, threads, &ns);
+        if (status != JXR_OK) {
+            break;
+        }
+        parallel = ns < parallel ? ns : parallel;
+
+        status = measure_convert(options, &image, plain, 1, &ns);
+        if (status != JXR_OK) {
+            break;
+        }
+        calibration->convert_ns = ns < calibration->convert_ns ? ns : calibration->convert_ns;
+
+        for (uint32_t s = 0; s < JXR_BUDGET_SETTINGS && status == JXR_OK; s++) {
+            jxr_options trial = *options;
+            apply(&settings[s], &trial);
+
+            StageCosts costs;
+            status = measure_encode(&trial, plain, CALIBRATION_WIDTH, CALIBRATION_HEIGHT, filtered, &costs);
+            if (status == JXR_OK && costs.filter + costs.deflate < calibration->filter_ns[s] + calibration->deflate_ns[s]) {
+                calibration->filter_ns[s] = costs.filter;
+                calibration->deflate_ns[s] = costs.deflate;
+            }
+        }
+    }
+
+    calibration->parallel_speedup = calibration->convert_ns / parallel;
+
+    jxr_free(options, memory);
+    return status;
+}
+
+static double speedup(const jxr_calibration *calibration, uint32_t threads) {
+    double efficiency = 1;
+    if (calibration->threads > 1) {
+        efficiency = (calibration->parallel_speedup - 1) / (calibration->threads - 1);
+        efficiency = efficiency < 0.1 ? 0.1 : efficiency > 1 ? 1 : efficiency;
+    }
+    return 1 + (threads - 1) * efficiency;
+}
+
+// Seconds to convert and encode with one setting. Conversion and filtering run on all threads,
+// zlib on one, the screen compressor on all.
+static double predict(const jxr_calibration *calibration, uint32_t s, double pixels, uint32_t threads,
+                      const StageCosts *scale) {
+    double parallel = calibration->convert_ns * scale->convert + calibration->filter_ns[s] * scale->filter;
+    double serial = calibration->deflate_ns[s] * scale->deflate;
+    if (settings[s].deflate == JXR_DEFLATE_SCREEN) {
+        parallel += serial;
+        serial = 0;
+    }
+    return pixels * (parallel / speedup(calibration, threads) + serial) * 1e-9;
+}
+
+// The strongest setting predicted to fit, on the fewest threads that make it fit. Settings are
+// tried from the fastest up, each on a band from the middle of the image so the prediction is
+// scaled by how this content behaves with that setting, until one no longer fits or sampling it
+// would take a noticeable part of the budget.
+int choose_for_budget(const jxr_options *options, const jxr_image *image, double remaining, jxr_options *chosen,
+                      char *report, size_t reportSize) {
+    const jxr_calibration *calibration = options->calibration;
+    double begin = monotonic_seconds();
+
+    uint32_t rows = image->height / SAMPLE_FRACTION;
+    rows = rows < SAMPLE_MIN_ROWS ? SAMPLE_MIN_ROWS : rows > SAMPLE_MAX_ROWS ? SAMPLE_MAX_ROWS : rows;
+    rows = rows < image->height ? rows : image->height;
+    size_t stride = image->stride ? image->stride : (size_t) image->width * image->format * 4;
+
+    jxr_image band = *image;
+    band.pixels = (const uint8_t *) image->pixels + (image->height - rows) / 2 * stride;
+    band.height = rows;
+    band.stride = stride;
+
+    size_t plainSize = (size_t) image->width * rows * 6;
+    auto memory = (uint8_t *) jxr_malloc(options, plainSize + filtered_size(image->width, rows), JXR_MEMORY_ENCODER);
+    if (memory == nullptr) {
+        return 1;
+    }
+
+    StageCosts scale = {1, 1, 1};
+    if (measure_convert(options, &band, memory, 1, &scale.convert)) {
+        jxr_free(options, memory);
+        return 1;
+    }
+    scale.convert /= calibration->convert_ns;
+
+    double pixels = (double) image->width * image->height;
+    double samplePixels = (double) image->width * rows;
+    uint32_t maxThreads = resolve_threads(options);
+
+    uint32_t pick = JXR_BUDGET_SETTINGS - 1;
+    uint32_t threads = maxThreads;
+    double predicted = 0;
+    bool fits = false;
+
+    for (int s = JXR_BUDGET_SETTINGS - 1; s >= 0; s--) {
+        double sampleCost = samplePixels * (calibration->filter_ns[s] * scale.filter +
+                                            calibration->deflate_ns[s] * scale.deflate) * 1e-9;
+        double left = remaining - (monotonic_seconds() - begin);
+        if (fits && sampleCost > left * SAMPLE_SHARE) {
+            break;
+        }
+
+        jxr_options trial = *options;
+        apply(&settings[s], &trial);
+
+        StageCosts costs;
+        if (measure_encode(&trial, memory, image->width, rows, memory + plainSize, &costs)) {
+            jxr_free(options, memory);
+            return 1;
+        }
+        scale.filter = costs.filter / calibration->filter_ns[s];
+        scale.deflate = costs.deflate / calibration->deflate_ns[s];
+        left = remaining - (monotonic_seconds() - begin);
+
+        uint32_t t = 1;
+        double seconds = predict(calibration, s, pixels, t, &scale);
+        // Written so that a nan prediction does not fit
+        while (t < maxThreads && !(seconds <= left * BUDGET_HEADROOM)) {
+            seconds = predict(calibration, s, pixels, ++t, &scale);
+        }
+
+        if (!(seconds <= left * BUDGET_HEADROOM)) {
+            if (!fits) {
+                predicted = seconds;
+            }
+            break;
+        }
+        pick = (uint32_t) s;
+        threads = t;
+        predicted = seconds;
+        fits = true;
+    }
+
+    jxr_free(options, memory);
+
+    *chosen = *options;
+    apply(&settings[pick], chosen);
+    chosen->threading.num_threads = threads;
+
+    snprintf(report, reportSize, "%s on %u threads (predicted %.0f ms of %.0f ms left%s)", settings[pick].name,
+             threads, predicted * 1000, (remaining - (monotonic_seconds() - begin)) * 1000,
+             fits ? "" : ", nothing fits");
+    return 0;
+}
@@ -0,0 +1,18 @@
+// Empty SAL annotations so DirectXMath builds outside of MSVC
+#pragma once
+
+#define _In_
+#define _In_opt_
+#define _In_reads_(x)
+#define _In_reads_opt_(x)
+#define _In_reads_bytes_(x)
+#define _Out_
+#define _Out_opt_
+#define _Out_writes_(x)
+#define _Out_writes_all_(x)
+#define _Out_writes_bytes_(x)
+#define _Inout_
+#define _Use_decl_annotations_
+#define _Success_(x)
+#define _Analysis_assume_(x)
+#define _Check_return_
@@ -0,0 +1,237 @@
+#include "convert_kernels.h"
+
+typedef struct ThreadData {
+    const uint8_t *pixels;
+    size_t stride;
+    uint8_t *out;
+    uint8_t *rows;  // raw previous and current row, for filters that look at the row above
+    uint32_t width;
+    uint32_t start;
+    uint32_t stop;
+    double sumOfMaxComp;
+#ifdef MAXCLL_PERCENTILE
+    uint32_t *nitCounts;
+#endif
+    double seconds;
+    bool counting;
+    jxr_counters counters;
+    uint16_t maxNits;
+    uint8_t bytesPerColor;
+    int filter;
+} ThreadData;
+
+// Converts one row without collecting statistics, for the row above a thread's first row
+static void encode_row(const ThreadData *d, uint32_t i, uint8_t *dst) {
+    const uint8_t *row = d->pixels + i * d->stride;
+    for (uint32_t j = 0; j < d->width; j++) {
+        store_pixel(dst + (size_t) 6 * j, encode_pixel(load_pixel(row, j, d->bytesPerColor)));
+    }
+}
+
+static void ThreadFunc(void *arg, uint32_t index) {
+    auto d = &((ThreadData *) arg)[index];
+    TraceSpan span("convert rows", index);
+    CounterGroup counters;
+    if (d->counting) {
+        counters_start(&counters, false);
+    }
+    double begin = monotonic_seconds();
+    const uint8_t *pixels = d->pixels;
+    size_t stride = d->stride;
+    uint8_t bytesPerColor = d->bytesPerColor;
+    uint32_t width = d->width;
+    uint32_t start = d->start;
+    uint32_t stop = d->stop;
+    int filter = d->filter;
+
+    size_t rowBytes = (size_t) width * 6;
+    size_t outStride = rowBytes + (filter >= 0);
+    uint8_t *prevRow = d->rows;
+    uint8_t *curRow = d->rows + rowBytes + 8;
+
+    if (prevRow) {
+        if (start) {
+            encode_row(d, start - 1, prevRow);
+        } else {
+            memset(prevRow, 0, rowBytes);
+        }
+    }
+
+    LightLevels levels = {};
+#ifdef MAXCLL_PERCENTILE
+    levels.nitCounts = d->nitCounts;
+#endif
+
+    for (uint32_t i = start; i < stop; i++) {
+        const uint8_t *row = pixels + i * stride;
+        uint8_t *dst = d->out + i * outStride;
+
+        if (filter >= 0) {
+            *dst++ = (uint8_t) filter;
+        }
+
+        __m128i left = _mm_setzero_si128();
+
+        for (uint32_t j = 0; j < width; j++) {
+            XMVECTOR v = load_pixel(row, j, bytesPerColor);
+            add_light_level(&levels, v);
+
+            __m128i vshort = encode_pixel(v);
+            __m128i filtered = vshort;
+
+            // Apply the PNG filter while the pixel is still in a register
+            if (filter == JXR_PNG_FILTER_SUB) {
+                filtered = _mm_sub_epi8(vshort, left);
+            } else if (filter == JXR_PNG_FILTER_UP || filter == JXR_PNG_FILTER_AVERAGE) {
+                __m128i up = _mm_loadl_epi64((const __m128i *) (prevRow + (size_t) 6 * j));
+                if (filter == JXR_PNG_FILTER_UP) {
+                    filtered = _mm_sub_epi8(vshort, up);
+                } else {
+                    __m128i odd = _mm_and_si128(_mm_xor_si128(left, up), _mm_set1_epi8(1));
+                    filtered = _mm_sub_epi8(vshort, _mm_sub_epi8(_mm_avg_epu8(left, up), odd));
+                }
+                _mm_storel_epi64((__m128i *) (curRow + (size_t) 6 * j), vshort);
+            }
+            left = vshort;
+
+            store_pixel(dst + (size_t) 6 * j, filtered);
+        }
+
+        uint8_t *tmp = prevRow;
+        prevRow = curRow;
+        curRow = tmp;
+    }
+
+    d->maxNits = (uint16_t) roundf(levels.maxMaxComp * 10000);
+    d->sumOfMaxComp = levels.sumOfMaxComp;
+    d->seconds = monotonic_seconds() - begin;
+    if (d->counting) {
+        counters_stop(&counters, &d->counters);
+    }
+}
+
+// Converts the scRGB image to big endian RGB16 PQ samples and computes the HDR metadata. With a
+// filter type, every row is prefixed by it and filtered, ready to be compressed as PNG image data.
+jxr_status convert_frame(const jxr_options *options, const jxr_image *image, uint8_t *out, int filter,
+                         uint32_t numThreads, uint16_t *maxCLL, uint16_t *maxFALL, jxr_timings *timings,
+                         const char **error) {
+    uint32_t width = image->width;
+    uint32_t height = image->height;
+    uint8_t bytesPerColor = (uint8_t) image->format;
+    size_t stride = image->stride ? image->stride : (size_t) width * bytesPerColor * 4;
+
+    uint32_t convThreads = numThreads;
+
+    uint32_t chunkSize = height / convThreads;
+
+    if (chunkSize == 0) {
+        convThreads = height;
+        chunkSize = 1;
+    }
+
+    auto threadData = (ThreadData *) jxr_calloc(options, convThreads, sizeof(ThreadData), JXR_MEMORY_OTHER);
+
+    if (threadData == nullptr) {
+        *error = "Failed to allocate array for thread data";
+        return JXR_ERROR_OUT_OF_MEMORY;
+    }
+
+    jxr_status ret = JXR_OK;
+
+    for (uint32_t i = 0; i < convThreads; i++) {
+        threadData[i].pixels = (const uint8_t *) image->pixels;
+        threadData[i].stride = stride;
+        threadData[i].bytesPerColor = bytesPerColor;
+        threadData[i].out = out;
+        threadData[i].filter = filter;
+        threadData[i].counting = options->counters && timings;
+        threadData[i].width = width;
+        threadData[i].start = i * chunkSize;
+        if (i != convThreads - 1) {
+            threadData[i].stop = (i + 1) * chunkSize;
+        } else {
+            threadData[i].stop = height;
+        }
+
+#ifdef MAXCLL_PERCENTILE
+        threadData[i].nitCounts = (uint32_t *) jxr_calloc(options, NIT_LEVELS, sizeof(uint32_t),
+                                                               JXR_MEMORY_HISTOGRAMS);
+        if (threadData[i].nitCounts == nullptr) {
+            *error = "Failed to allocate thread data";
+            ret = JXR_ERROR_OUT_OF_MEMORY;
+        }
+#endif
+
+        // Padded, the filters load 8 bytes per pixel
+        if (filter == JXR_PNG_FILTER_UP || filter == JXR_PNG_FILTER_AVERAGE) {
+            threadData[i].rows = (uint8_t *) jxr_malloc(options, 2 * ((size_t) width * 6 + 8), JXR_MEMORY_OTHER);
+            if (threadData[i].rows == nullptr) {
+                *error = "Failed to allocate thread data";
+                ret = JXR_ERROR_OUT_OF_MEMORY;
+            }
+        }
+    }
+
+    StageClock clock = stage_start(options);
+
+    if (!ret && run_parallel(options, convThreads, ThreadFunc, threadData)) {
+        *error = "Thread failed to terminate properly";
+        ret = JXR_ERROR_THREAD;
+    }
+
+    stage_stop(&clock, timings, JXR_STAGE_CONVERT);
+    if (timings) {
+        timings->convert_threads = convThreads;
+        for (uint32_t i = 0; i < convThreads && i < JXR_TIMED_THREADS; i++) {
+            timings->convert_thread_wall[i] = threadData[i].seconds;
+            timings->convert_thread_counters[i] = threadData[i].counters;
+        }
+    }
+
+    clock = stage_start(options);
+
+    if (!ret) {
+        *maxCLL = 0;
+        double sumOfMaxComp = 0;
+
+        for (uint32_t i = 0; i < convThreads; i++) {
+            uint16_t tMaxNits = threadData[i].maxNits;
+            if (tMaxNits > *maxCLL) {
+                *maxCLL = tMaxNits;
+            }
+
+            sumOfMaxComp += threadData[i].sumOfMaxComp;
+        }
+
+#ifdef MAXCLL_PERCENTILE
+        uint16_t currentIdx = *maxCLL;
+        uint64_t count = 0;
+        auto countTarget = (uint64_t) round((1 - MAXCLL_PERCENTILE) * (double) ((uint64_t) width * height));
+        while (true) {
+            for (uint32_t i = 0; i < convThreads; i++) {
+                count += threadData[i].nitCounts[currentIdx];
+            }
+            if (count >= countTarget || currentIdx == 0) {
+                *maxCLL = currentIdx;
+                break;
+            }
+            currentIdx--;
+        }
+#endif
+
+        *maxFALL = (uint16_t) round(10000 * (sumOfMaxComp / (double) ((uint64_t) width * height)));
+    }
+
+    stage_stop(&clock, timings, JXR_STAGE_STATISTICS);
+
+    for (uint32_t i = 0; i < convThreads; i++) {
+#ifdef MAXCLL_PERCENTILE
+        jxr_free(options, threadData[i].nitCounts);
+#endif
+        jxr_free(options, threadData[i].rows);
+    }
+
+    jxr_free(options, threadData);
+
+    return ret;
+}
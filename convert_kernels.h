@@ -0,0 +1,103 @@
+// The per-pixel kernels of the conversion, shared by convert.cpp and the kernel benchmarks
+#ifndef JXR_CONVERT_KERNELS_H
+#define JXR_CONVERT_KERNELS_H
+
+#define _XM_F16C_INTRINSICS_
+
+#include <cmath>
+#include <cstring>
+#include "DirectXMath/DirectXMath.h"
+#include "DirectXMath/DirectXPackedVector.h"
+#include "internal.h"
+
+using namespace DirectX;
+using namespace DirectX::PackedVector;
+
+static const XMVECTOR vm1 = XMVectorReplicate(1305.0f / 8192.0f);
+static const XMVECTOR vm2 = XMVectorReplicate(2523.0f / 32.0f);
+static const XMVECTOR vc1 = XMVectorReplicate(107.0f / 128.0f);
+static const XMVECTOR vc2 = XMVectorReplicate(2413.0f / 128.0f);
+static const XMVECTOR vc3 = XMVectorReplicate(2392.0f / 128.0f);
+
+static inline XMVECTOR pq_inv_eotf(XMVECTOR y) {
+    XMVECTOR pow1 = XMVectorPow(y, vm1);
+    return XMVectorPow(
+            XMVectorDivide(
+                    XMVectorAdd(vc1, XMVectorMultiply(vc2, pow1)),
+                    XMVectorAdd(g_XMOne, XMVectorMultiply(vc3, pow1))),
+            vm2);
+}
+
+static const XMMATRIX scrgb_to_bt2100(
+        2939026994.L / 585553224375.L,  76515593.L / 138420033750.L,   12225392.L / 93230009375.L,      0,
+        9255011753.L / 3513319346250.L, 6109575001.L / 830520202500.L, 1772384008.L / 2517210253125.L,  0,
+        173911579.L / 501902763750.L,   75493061.L / 830520202500.L,   18035212433.L / 2517210253125.L, 0,
+        0,                              0,                             0,                               1);
+
+static inline XMVECTOR load_pixel(const uint8_t *row, uint32_t j, uint8_t bytesPerColor) {
+    XMVECTOR v;
+
+    if (bytesPerColor == 4) {
+        v = XMLoadFloat4((const XMFLOAT4 *) ((const float *) row + 4 * j));
+    } else {
+        v = XMLoadHalf4((const XMHALF4 *) ((const HALF *) row + 4 * j));
+    }
+
+    return XMVectorSaturate(XMVector3Transform(v, scrgb_to_bt2100));
+}
+
+// PQ values quantized to TARGET_BITS and packed as big endian 16-bit samples in the low 6 bytes
+static inline __m128i pack_pixel(XMVECTOR pq) {
+    const auto maxTarget = (float) ((1 << TARGET_BITS) - 1);
+
+    __m128i vint = _mm_cvtps_epi32(XMVectorMultiply(pq, XMVectorReplicate(maxTarget)));
+
+    vint = _mm_slli_epi32(vint, INTERMEDIATE_BITS - TARGET_BITS);
+
+    __m128i vshort = _mm_packus_epi32(vint, vint);
+
+    const __m128i reverse_endian_mask = _mm_set_epi8(
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 4, 5, 2, 3, 0, 1);
+    return _mm_shuffle_epi8(vshort, reverse_endian_mask);
+}
+
+static inline __m128i encode_pixel(XMVECTOR v) {
+    return pack_pixel(pq_inv_eotf(v));
+}
+
+static inline void store_pixel(uint8_t *dst, __m128i v) {
+    uint8_t result[8];
+    _mm_storel_epi64((__m128i *) result, v);
+    memcpy(dst, result, 6);
+}
+
+#define NIT_LEVELS 10001
+
+// Light level statistics of one thread's pixels
+typedef struct LightLevels {
+    float maxMaxComp;
+    double sumOfMaxComp;
+#ifdef MAXCLL_PERCENTILE
+    uint32_t *nitCounts;  // NIT_LEVELS entries
+#endif
+} LightLevels;
+
+static inline void add_light_level(LightLevels *l, XMVECTOR v) {
+    auto bt2020 = XMFLOAT4A();
+
+    XMStoreFloat4A(&bt2020, v);
+
+    float maxComp = fmaxf(bt2020.x, fmaxf(bt2020.y, bt2020.z));
+
+#ifdef MAXCLL_PERCENTILE
+    auto nits = (uint32_t) roundf(maxComp * 10000);
+    l->nitCounts[nits]++;
+#endif
+    if (maxComp > l->maxMaxComp) {
+        l->maxMaxComp = maxComp;
+    }
+
+    l->sumOfMaxComp += maxComp;
+}
+
+#endif
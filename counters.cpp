@@ -0,0 +1,74 @@
+// Hardware event counters through perf_event_open. Each counter is opened on its own rather than
+// as a group, since inherited counters cannot be read as a group on older kernels, and scaled by
+// the share of time it was scheduled on the PMU.
+#include "internal.h"
+
+#ifdef __linux__
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static void counter_attr(int counter, struct perf_event_attr *attr) {
+    memset(attr, 0, sizeof(*attr));
+    attr->size = sizeof(*attr);
+    attr->type = PERF_TYPE_HW_CACHE;
+    attr->exclude_kernel = 1;
+    attr->exclude_hv = 1;
+    attr->read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    const uint64_t readMiss = (uint64_t) PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                              (uint64_t) PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+    switch (counter) {
+        case JXR_COUNTER_CYCLES:
+            attr->type = PERF_TYPE_HARDWARE;
+            attr->config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case JXR_COUNTER_INSTRUCTIONS:
+            attr->type = PERF_TYPE_HARDWARE;
+            attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case JXR_COUNTER_LLC_MISSES:
+            attr->config = PERF_COUNT_HW_CACHE_LL | readMiss;
+            break;
+        default:
+            attr->config = PERF_COUNT_HW_CACHE_DTLB | readMiss;
+            break;
+    }
+}
+
+void counters_start(CounterGroup *group, bool inherit) {
+    for (int i = 0; i < JXR_COUNTER_COUNT; i++) {
+        struct perf_event_attr attr;
+        counter_attr(i, &attr);
+        attr.inherit = inherit;
+        group->fds[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+}
+
+void counters_stop(CounterGroup *group, jxr_counters *counters) {
+    for (int i = 0; i < JXR_COUNTER_COUNT; i++) {
+        if (group->fds[i] < 0) {
+            continue;
+        }
+
+        uint64_t values[3];  // count, time enabled, time running
+        if (read(group->fds[i], values, sizeof(values)) == (ssize_t) sizeof(values) && values[2]) {
+            double scale = values[1] > values[2] ? (double) values[1] / (double) values[2] : 1;
+            counters->values[i] += (uint64_t) ((double) values[0] * scale);
+            counters->available |= 1u << i;
+        }
+        close(group->fds[i]);
+        group->fds[i] = -1;
+    }
+}
+#else
+void counters_start(CounterGroup *group, bool) {
+    for (int i = 0; i < JXR_COUNTER_COUNT; i++) {
+        group->fds[i] = -1;
+    }
+}
+
+void counters_stop(CounterGroup *, jxr_counters *) {
+}
+#endif
@@ -0,0 +1,181 @@
+// Sends one conversion job to jxr_to_pngd
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "jxr_to_png.h"
+#include "protocol.h"
+
+static int read_full(int fd, void *data, size_t size) {
+    auto p = (uint8_t *) data;
+    while (size) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 1;
+        }
+        p += n;
+        size -= (size_t) n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *data, size_t size) {
+    auto p = (const uint8_t *) data;
+    while (size) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 1;
+        }
+        p += n;
+        size -= (size_t) n;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    char defaultSocket[4096];
+    const char *socketPath = default_socket_path(defaultSocket, sizeof(defaultSocket));
+    int inlineData = 0;
+    RequestHeader request = {};
+    request.magic = DAEMON_REQUEST_MAGIC;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (i + 1 < argc && !strcmp(argv[i], "-s")) {
+            socketPath = argv[++i];
+        } else if (i + 1 < argc && !strcmp(argv[i], "-p")) {
+            request.priority = (uint8_t) strtoul(argv[++i], nullptr, 10);
+        } else if (i + 1 < argc && !strcmp(argv[i], "-t")) {
+            request.threads = (uint16_t) strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--inline")) {
+            inlineData = 1;
+        } else {
+            break;
+        }
+    }
+
+    if (argc - i != 2) {
+        fprintf(stderr, "jxr_to_png_client [-s socket] [-p priority] [-t threads] [--inline] input output.png\n"
+                        "  --inline  send the file contents and receive the PNG over the socket, instead of\n"
+                        "            letting the daemon read and write the files itself\n");
+        return 1;
+    }
+
+    const char *inputFile = argv[i];
+    const char *outputFile = argv[i + 1];
+
+    uint8_t *input;
+    size_t inputSize;
+    char inputPath[PATH_MAX];
+    char outputPath[PATH_MAX];
+
+    if (inlineData) {
+        FILE *f = fopen(inputFile, "rb");
+        if (!f) {
+            perror("Failed to open input file");
+            return 1;
+        }
+        fseek(f, 0, SEEK_END);
+        inputSize = (size_t) ftell(f);
+        fseek(f, 0, SEEK_SET);
+        input = (uint8_t *) malloc(inputSize);
+        if (input == nullptr || fread(input, 1, inputSize, f) != inputSize) {
+            fprintf(stderr, "Failed to read input file\n");
+            return 1;
+        }
+        fclose(f);
+
+        request.kind = DAEMON_JOB_INLINE;
+    } else {
+        // The daemon has its own working directory, so send absolute paths
+        if (realpath(inputFile, inputPath) == nullptr) {
+            perror("Failed to resolve input path");
+            return 1;
+        }
+
+        int length;
+        if (outputFile[0] == '/') {
+            length = snprintf(outputPath, sizeof(outputPath), "%s", outputFile);
+        } else {
+            char cwd[PATH_MAX];
+            if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+                perror("getcwd");
+                return 1;
+            }
+            length = snprintf(outputPath, sizeof(outputPath), "%s/%s", cwd, outputFile);
+        }
+        if (length < 0 || (size_t) length >= sizeof(outputPath)) {
+            fprintf(stderr, "Output path too long\n");
+            return 1;
+        }
+
+        input = (uint8_t *) inputPath;
+        inputSize = strlen(inputPath);
+
+        request.kind = DAEMON_JOB_PATH;
+        request.outputPathSize = (uint32_t) strlen(outputPath);
+    }
+
+    request.inputSize = inputSize;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, socketPath);
+
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+        perror("Failed to connect to daemon");
+        return 1;
+    }
+
+    // A daemon that turns the connection away answers without reading the request, so look for
+    // its response even if sending failed
+    int sendFailed = write_full(fd, &request, sizeof(request)) || write_full(fd, input, inputSize) ||
+                     write_full(fd, outputPath, request.outputPathSize);
+
+    ResponseHeader response;
+    if (read_full(fd, &response, sizeof(response)) || response.magic != DAEMON_RESPONSE_MAGIC) {
+        fprintf(stderr, sendFailed ? "Failed to send request\n" : "Invalid response from daemon\n");
+        return 1;
+    }
+
+    auto payload = (uint8_t *) malloc(response.payloadSize + 1);
+    if (payload == nullptr || read_full(fd, payload, response.payloadSize)) {
+        fprintf(stderr, "Failed to receive response payload\n");
+        return 1;
+    }
+    close(fd);
+
+    if (response.status != JXR_OK) {
+        payload[response.payloadSize] = 0;
+        fprintf(stderr, "%s\n", (char *) payload);
+        return 1;
+    }
+
+    if (inlineData) {
+        FILE *f = fopen(outputFile, "wb");
+        if (!f || fwrite(payload, 1, response.payloadSize, f) != response.payloadSize || fclose(f)) {
+            perror("Error writing output file");
+            return 1;
+        }
+    }
+
+    printf("%ux%u, %u MaxCLL, %u MaxFALL, queued %.1f ms, converted in %.1f ms\n", response.width,
+           response.height, response.maxCLL, response.maxFALL, response.queueMicros / 1000.0,
+           response.convertMicros / 1000.0);
+}
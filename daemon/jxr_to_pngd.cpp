@@ -0,0 +1,438 @@
+// Conversion daemon: keeps the worker threads and large buffers warm between jobs and serves
+// requests over a Unix domain socket
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "jxr_to_png.h"
+#include "mapped_file.h"
+#include "protocol.h"
+
+#define DEFAULT_MIN_AVAILABLE_MB 256  // idle buffers are released when the system has less than this left
+#define DEFAULT_MAX_CONNECTIONS 64
+#define ACCEPT_BACKOFF_MS 50  // wait after accept runs out of file descriptors
+#define SOCKET_TIMEOUT_S 30  // clients that stall mid-request or stop reading the response are dropped
+
+// Limits the number of concurrent conversions, admitting waiting jobs by priority and then in
+// arrival order
+typedef struct JobGate {
+    std::mutex mutex;
+    std::condition_variable changed;
+    uint32_t freeSlots;
+    uint32_t waiting[256];  // queued jobs per priority
+    uint64_t nextTicket[256];
+    uint64_t serving[256];
+} JobGate;
+
+static bool gate_is_turn(JobGate *gate, uint8_t priority, uint64_t ticket) {
+    if (gate->freeSlots == 0 || gate->serving[priority] != ticket) {
+        return false;
+    }
+    for (int p = priority + 1; p < 256; p++) {
+        if (gate->waiting[p]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void gate_enter(JobGate *gate, uint8_t priority) {
+    std::unique_lock<std::mutex> lock(gate->mutex);
+    uint64_t ticket = gate->nextTicket[priority]++;
+    gate->waiting[priority]++;
+    gate->changed.wait(lock, [&] { return gate_is_turn(gate, priority, ticket); });
+    gate->waiting[priority]--;
+    gate->serving[priority]++;
+    gate->freeSlots--;
+    gate->changed.notify_all();
+}
+
+static void gate_leave(JobGate *gate) {
+    {
+        std::lock_guard<std::mutex> guard(gate->mutex);
+        gate->freeSlots++;
+    }
+    gate->changed.notify_all();
+}
+
+typedef struct Daemon {
+    jxr_thread_pool *pool;
+    jxr_buffer_pool *buffers;
+    JobGate gate;
+    uint32_t defaultThreads;
+    uint64_t maxRequestBytes;
+    uint32_t maxConnections;
+    std::atomic<uint32_t> connections;
+} Daemon;
+
+static int read_full(int fd, void *data, size_t size) {
+    auto p = (uint8_t *) data;
+    while (size) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 1;
+        }
+        p += n;
+        size -= (size_t) n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *data, size_t size) {
+    auto p = (const uint8_t *) data;
+    while (size) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 1;
+        }
+        p += n;
+        size -= (size_t) n;
+    }
+    return 0;
+}
+
+static int send_response(int fd, ResponseHeader *response, const void *payload, size_t size) {
+    response->magic = DAEMON_RESPONSE_MAGIC;
+    response->payloadSize = size;
+    return write_full(fd, response, sizeof(ResponseHeader)) || write_full(fd, payload, size);
+}
+
+static int send_error(int fd, ResponseHeader *response, jxr_status status, const char *message) {
+    response->status = status;
+    return send_response(fd, response, message, strlen(message));
+}
+
+static uint32_t micros_since(std::chrono::steady_clock::time_point start) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return (uint32_t) std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+}
+
+static bool peer_trusted(int fd) {
+    struct ucred cred;
+    socklen_t size = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &size)) {
+        return false;
+    }
+    return cred.uid == 0 || cred.uid == getuid();
+}
+
+static void handle_client(Daemon *daemon, int fd) {
+    ResponseHeader response = {};
+    RequestHeader request;
+
+    if (read_full(fd, &request, sizeof(request)) || request.magic != DAEMON_REQUEST_MAGIC) {
+        close(fd);
+        return;
+    }
+
+    if (request.kind != DAEMON_JOB_PATH && request.kind != DAEMON_JOB_INLINE) {
+        send_error(fd, &response, JXR_ERROR_INVALID_ARGUMENT, "Unknown job kind");
+        close(fd);
+        return;
+    }
+
+    // Files are opened with the daemon's rights, so only its own user and root may name them. Other
+    // users a socket was shared with can still send inline jobs.
+    if ((request.kind == DAEMON_JOB_PATH || request.outputPathSize) && !peer_trusted(fd)) {
+        send_error(fd, &response, JXR_ERROR_INVALID_ARGUMENT, "Only the daemon's user may name files");
+        close(fd);
+        return;
+    }
+
+    if (request.inputSize == 0 || request.inputSize > daemon->maxRequestBytes ||
+        request.outputPathSize > 4096 || (request.kind == DAEMON_JOB_PATH && request.inputSize > 4096)) {
+        send_error(fd, &response, JXR_ERROR_INVALID_ARGUMENT, "Request too large");
+        close(fd);
+        return;
+    }
+
+    jxr_options options;
+    jxr_options_init(&options);
+    options.buffer_pool = daemon->buffers;
+    options.threading.parallel_for = jxr_thread_pool_parallel_for;
+    options.threading.user = daemon->pool;
+
+    uint32_t poolThreads = jxr_thread_pool_size(daemon->pool);
+    uint32_t threads = request.threads ? request.threads : daemon->defaultThreads;
+    options.threading.num_threads = threads < poolThreads ? threads : poolThreads;
+
+    char inputPath[4097] = {};
+    char outputPath[4097] = {};
+
+    // The body is only read once the job holds a slot, so at most -j request buffers exist at once
+    auto queued = std::chrono::steady_clock::now();
+    gate_enter(&daemon->gate, request.priority);
+    response.queueMicros = micros_since(queued);
+
+    size_t inputSize = request.inputSize;
+    auto input = (uint8_t *) jxr_buffer_pool_alloc(daemon->buffers,
+                                                   request.kind == DAEMON_JOB_PATH ? inputSize + 1 : inputSize);
+
+    if (input == nullptr || read_full(fd, input, inputSize) || read_full(fd, outputPath, request.outputPathSize)) {
+        if (input) {
+            jxr_buffer_pool_free(daemon->buffers, input);
+        }
+        gate_leave(&daemon->gate);
+        close(fd);
+        return;
+    }
+
+    // Path inputs are mapped rather than read, so the decoder works from the page cache
+    MappedFile mapped = {};
+
+    if (request.kind == DAEMON_JOB_PATH) {
+        memcpy(inputPath, input, inputSize);
+        jxr_buffer_pool_free(daemon->buffers, input);
+        input = nullptr;
+
+        if (map_input(inputPath, &mapped)) {
+            gate_leave(&daemon->gate);
+            send_error(fd, &response, JXR_ERROR_INVALID_ARGUMENT, "Failed to read input file");
+            close(fd);
+            return;
+        }
+    }
+
+    auto started = std::chrono::steady_clock::now();
+
+    jxr_image image;
+    jxr_result result;
+    jxr_status status;
+
+    if (input) {
+        status = jxr_decode_memory(input, inputSize, &options, &image, &result);
+        jxr_buffer_pool_free(daemon->buffers, input);
+    } else {
+        status = jxr_decode_memory(mapped.data, mapped.size, &options, &image, &result);
+        unmap_input(&mapped);
+    }
+
+    jxr_buffer png = {};
+    MappedFile out = {};
+
+    if (status == JXR_OK) {
+        // File outputs are encoded straight into a mapping of the destination
+        if (request.outputPathSize) {
+            if (map_output(outputPath, jxr_png_size_bound(image.width, image.height), &out)) {
+                status = JXR_ERROR_INVALID_ARGUMENT;
+                result.error = "Failed to create output file";
+            } else {
+                png = {out.data, 0, out.size, 0};
+            }
+        } else {
+            png.growable = 1;
+        }
+
+        if (status == JXR_OK) {
+            status = jxr_convert_pixels(&image, &options, &png, &result);
+        }
+
+        jxr_image_free(&options, &image);
+    }
+
+    gate_leave(&daemon->gate);
+
+    response.convertMicros = micros_since(started);
+    response.status = status;
+    response.width = result.width;
+    response.height = result.height;
+    response.maxCLL = result.max_cll;
+    response.maxFALL = result.max_fall;
+
+    if (status != JXR_OK) {
+        if (out.data) {
+            discard_output(&out, outputPath);
+        }
+        send_error(fd, &response, status, result.error ? result.error : jxr_status_string(status));
+    } else if (request.outputPathSize) {
+        if (finish_output(&out, png.size)) {
+            send_error(fd, &response, JXR_ERROR_ENCODE, "Failed to write output file");
+        } else {
+            send_response(fd, &response, nullptr, 0);
+        }
+    } else {
+        send_response(fd, &response, png.data, png.size);
+    }
+
+    printf("%ux%u priority %u: %s, queued %.1f ms, converted in %.1f ms\n", result.width, result.height,
+           request.priority, jxr_status_string(status), response.queueMicros / 1000.0,
+           response.convertMicros / 1000.0);
+    fflush(stdout);
+
+    if (png.growable) {
+        jxr_buffer_free(&options, &png);
+    }
+    close(fd);
+}
+
+static void serve_connection(Daemon *daemon, int fd) {
+    handle_client(daemon, fd);
+    daemon->connections--;
+}
+
+// Removes a stale socket left behind by a daemon that exited, but never another file or a live daemon
+static int remove_stale_socket(const struct sockaddr_un *addr) {
+    struct stat st;
+    if (lstat(addr->sun_path, &st)) {
+        return errno == ENOENT ? 0 : 1;
+    }
+    if (!S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "%s exists and is not a socket\n", addr->sun_path);
+        return 1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    int live = connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) == 0 || errno != ECONNREFUSED;
+    close(fd);
+
+    if (live) {
+        fprintf(stderr, "Another daemon is listening on %s\n", addr->sun_path);
+        return 1;
+    }
+    return unlink(addr->sun_path) && errno != ENOENT;
+}
+
+int main(int argc, char *argv[]) {
+    char defaultSocket[4096];
+    const char *socketPath = default_socket_path(defaultSocket, sizeof(defaultSocket));
+    uint32_t poolThreads = 0;
+    uint32_t maxJobs = 2;
+    uint64_t maxRequestMB = 1024;
+    uint64_t cacheMB = 2048;
+    uint64_t minAvailableMB = DEFAULT_MIN_AVAILABLE_MB;
+    uint32_t maxConnections = DEFAULT_MAX_CONNECTIONS;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && !strcmp(argv[i], "-s")) {
+            socketPath = argv[++i];
+        } else if (i + 1 < argc && !strcmp(argv[i], "-t")) {
+            poolThreads = (uint32_t) strtoul(argv[++i], nullptr, 10);
+        } else if (i + 1 < argc && !strcmp(argv[i], "-j")) {
+            maxJobs = (uint32_t) strtoul(argv[++i], nullptr, 10);
+        } else if (i + 1 < argc && !strcmp(argv[i], "-m")) {
+            maxRequestMB = strtoull(argv[++i], nullptr, 10);
+        } else if (i + 1 < argc && !strcmp(argv[i], "-c")) {
+            cacheMB = strtoull(argv[++i], nullptr, 10);
+        } else if (i + 1 < argc && !strcmp(argv[i], "-a")) {
+            minAvailableMB = strtoull(argv[++i], nullptr, 10);
+        } else if (i + 1 < argc && !strcmp(argv[i], "-n")) {
+            maxConnections = (uint32_t) strtoul(argv[++i], nullptr, 10);
+        } else {
+            fprintf(stderr, "jxr_to_pngd [-s socket] [-t pool threads] [-j concurrent jobs] [-n max connections] "
+                            "[-m max request MB] [-c buffer cache MB] [-a min available MB]\n");
+            return 1;
+        }
+    }
+
+    if (maxJobs == 0) {
+        maxJobs = 1;
+    }
+    if (maxConnections < maxJobs) {
+        maxConnections = maxJobs;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    auto daemon = new Daemon();
+    daemon->pool = jxr_thread_pool_create(poolThreads);
+    if (daemon->pool == nullptr) {
+        fprintf(stderr, "Failed to create thread pool\n");
+        return 1;
+    }
+    daemon->defaultThreads = jxr_default_threads();
+    daemon->maxRequestBytes = maxRequestMB << 20;
+    daemon->buffers = jxr_buffer_pool_create(cacheMB << 20, minAvailableMB << 20);
+    if (daemon->buffers == nullptr) {
+        fprintf(stderr, "Failed to create buffer pool\n");
+        return 1;
+    }
+    daemon->maxConnections = maxConnections;
+    daemon->gate.freeSlots = maxJobs;
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd < 0) {
+        perror("socket");
+        return 1;
+    }
+
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, socketPath);
+    if (remove_stale_socket(&addr)) {
+        return 1;
+    }
+
+    // The socket is created as 0600, there is no moment where other users could connect
+    mode_t oldMask = umask(0177);
+    int bound = bind(listenFd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(oldMask);
+    if (bound || listen(listenFd, 64)) {
+        perror("Failed to listen on socket");
+        return 1;
+    }
+
+    printf("Listening on %s with %u threads, %u concurrent jobs\n", socketPath,
+           jxr_thread_pool_size(daemon->pool), maxJobs);
+    fflush(stdout);
+
+    while (true) {
+        int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // Out of descriptors: the connection stays queued until running jobs close theirs
+            if (errno == EMFILE || errno == ENFILE) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(ACCEPT_BACKOFF_MS));
+                continue;
+            }
+            perror("accept");
+            return 1;
+        }
+
+        struct timeval timeout = {SOCKET_TIMEOUT_S, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        // Each connection holds a thread while it waits for a slot, so their number is capped too
+        if (daemon->connections >= daemon->maxConnections) {
+            ResponseHeader response = {};
+            send_error(fd, &response, JXR_ERROR_THREAD, "Too many connections");
+            close(fd);
+            continue;
+        }
+
+        daemon->connections++;
+        try {
+            std::thread(serve_connection, daemon, fd).detach();
+        } catch (...) {
+            daemon->connections--;
+            close(fd);
+        }
+    }
+}
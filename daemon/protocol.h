@@ -0,0 +1,56 @@
+// Wire format between jxr_to_pngd and its clients. Both ends run on the same host, so fields use
+// native byte order.
+#ifndef JXR_DAEMON_PROTOCOL_H
+#define JXR_DAEMON_PROTOCOL_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+#define DAEMON_REQUEST_MAGIC 0x5152584Au  // "JXRQ"
+#define DAEMON_RESPONSE_MAGIC 0x5252584Au  // "JXRR"
+
+#define DAEMON_SOCKET_NAME "jxr_to_png.sock"
+
+#define DAEMON_JOB_PATH 0    // input is a file path the daemon reads
+#define DAEMON_JOB_INLINE 1  // input bytes follow the header
+
+// The socket used without -s: in $XDG_RUNTIME_DIR, which only its user can enter, or else a per-user
+// name in /tmp. Daemon and client resolve it the same way.
+static inline const char *default_socket_path(char *buf, size_t size) {
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (dir && dir[0]) {
+        snprintf(buf, size, "%s/" DAEMON_SOCKET_NAME, dir);
+    } else {
+        snprintf(buf, size, "/tmp/jxr_to_png-%u.sock", (unsigned) getuid());
+    }
+    return buf;
+}
+
+// Followed by inputSize bytes of input (path or file contents), then outputPathSize bytes of output path
+typedef struct RequestHeader {
+    uint32_t magic;
+    uint8_t kind;
+    uint8_t priority;          // queued jobs with higher priority start first
+    uint16_t threads;          // most worker threads this job may use, 0 for the daemon default
+    uint32_t outputPathSize;   // 0 to receive the PNG in the response instead of writing a file
+    uint32_t reserved;
+    uint64_t inputSize;
+} RequestHeader;
+
+// Followed by payloadSize bytes: the PNG if it was requested inline, or an error message on failure
+typedef struct ResponseHeader {
+    uint32_t magic;
+    int32_t status;  // jxr_status
+    uint32_t width;
+    uint32_t height;
+    uint16_t maxCLL;
+    uint16_t maxFALL;
+    uint32_t queueMicros;    // time spent waiting for a job slot
+    uint32_t convertMicros;
+    uint32_t reserved;
+    uint64_t payloadSize;
+} ResponseHeader;
+
+#endif
@@ -0,0 +1,272 @@
+#include <cstdlib>
+#include <cstring>
+#include "internal.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <wincodec.h>
+
+template<typename T>
+static void release(T *&p) {
+    if (p) {
+        p->Release();
+        p = nullptr;
+    }
+}
+
+static jxr_status decode_jxr_wic(const jxr_options *options, const void *data, size_t size, DecodedImage *decoded,
+                                 const char **error) {
+    if (size > MAXDWORD) {
+        *error = "Input too large";
+        return JXR_ERROR_INVALID_ARGUMENT;
+    }
+
+    // Initialize COM, unless the calling thread already did so with another concurrency model
+    HRESULT hrCom = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+
+    jxr_status status = JXR_ERROR_DECODE;
+
+    IWICImagingFactory *pFactory = nullptr;
+    IWICStream *pStream = nullptr;
+    IWICBitmapDecoder *pDecoder = nullptr;
+    IWICBitmapFrameDecode *pFrame = nullptr;
+    IWICBitmapSource *pBitmapSource = nullptr;
+
+    do {
+        // Create the COM imaging factory
+        HRESULT hr = CoCreateInstance(
+                CLSID_WICImagingFactory,
+                nullptr,
+                CLSCTX_INPROC_SERVER,
+                IID_IWICImagingFactory,
+                (void **) &pFactory);
+
+        if (FAILED(hr)) {
+            *error = "Failed to create WIC imaging factory";
+            break;
+        }
+
+        hr = pFactory->CreateStream(&pStream);
+
+        if (SUCCEEDED(hr)) {
+            hr = pStream->InitializeFromMemory((BYTE *) data, (DWORD) size);
+        }
+
+        if (FAILED(hr)) {
+            *error = "Failed to create input stream";
+            break;
+        }
+
+        hr = pFactory->CreateDecoderFromStream(
+                pStream,                         // Image to be decoded
+                nullptr,                         // Do not prefer a particular vendor
+                WICDecodeMetadataCacheOnDemand,  // Cache metadata when needed
+                &pDecoder                        // Pointer to the decoder
+        );
+
+        if (FAILED(hr)) {
+            *error = "Failed to open input file";
+            break;
+        }
+
+        // Retrieve the first frame of the image from the decoder
+        hr = pDecoder->GetFrame(0, &pFrame);
+
+        if (FAILED(hr)) {
+            *error = "Failed to get frame";
+            break;
+        }
+
+        hr = pFrame->QueryInterface(IID_IWICBitmapSource, (void **) &pBitmapSource);
+
+        if (FAILED(hr)) {
+            *error = "Failed to get IWICBitmapSource";
+            break;
+        }
+
+        WICPixelFormatGUID pixelFormat;
+
+        hr = pBitmapSource->GetPixelFormat(&pixelFormat);
+
+        if (FAILED(hr)) {
+            *error = "Failed to get pixel format";
+            break;
+        }
+
+        jxr_pixel_format format;
+
+        if (IsEqualGUID(pixelFormat, GUID_WICPixelFormat128bppRGBAFloat)) {
+            format = JXR_PIXEL_FORMAT_RGBA_FLOAT;
+        } else if (IsEqualGUID(pixelFormat, GUID_WICPixelFormat64bppRGBAHalf)) {
+            format = JXR_PIXEL_FORMAT_RGBA_HALF;
+        } else {
+            *error = "Unsupported pixel format";
+            status = JXR_ERROR_UNSUPPORTED;
+            break;
+        }
+
+        uint32_t width, height;
+
+        hr = pBitmapSource->GetSize(&width, &height);
+
+        if (FAILED(hr)) {
+            *error = "Failed to get size";
+            break;
+        }
+
+        size_t stride = frame_stride(options, (size_t) width * format * 4);
+        if (stride * height > MAXDWORD) {
+            *error = "Image too large";
+            status = JXR_ERROR_UNSUPPORTED;
+            break;
+        }
+        auto cbStride = (UINT) stride;
+        UINT cbBufferSize = cbStride * height;
+
+        auto pixels = (uint8_t *) frame_alloc(options, cbBufferSize, JXR_MEMORY_INPUT_FRAME);
+
+        if (pixels == nullptr) {
+            *error = "Failed to allocate float pixels";
+            status = JXR_ERROR_OUT_OF_MEMORY;
+            break;
+        }
+
+        WICRect rc;
+        rc.Y = 0;
+        rc.X = 0;
+        rc.Width = (int) width;
+        rc.Height = (int) height;
+        hr = pBitmapSource->CopyPixels(
+                &rc,
+                cbStride,
+                cbBufferSize,
+                pixels);
+
+        if (FAILED(hr)) {
+            jxr_free(options, pixels);
+            *error = "Failed to copy pixels";
+            break;
+        }
+
+        decoded->pixels = pixels;
+        decoded->image = {pixels, width, height, cbStride, format};
+        status = JXR_OK;
+    } while (false);
+
+    release(pBitmapSource);
+    release(pFrame);
+    release(pDecoder);
+    release(pStream);
+    release(pFactory);
+
+    if (SUCCEEDED(hrCom)) {
+        CoUninitialize();
+    }
+
+    return status;
+}
+#endif
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Reads the next whitespace separated header token of a PFM file as a number
+static int pfm_token(const char *data, size_t size, size_t *pos, double *value) {
+    while (*pos < size && is_space(data[*pos])) {
+        (*pos)++;
+    }
+
+    char token[32];
+    size_t len = 0;
+    while (*pos < size && !is_space(data[*pos]) && len < sizeof(token) - 1) {
+        token[len++] = data[(*pos)++];
+    }
+    token[len] = 0;
+
+    char *end;
+    *value = strtod(token, &end);
+    return len == 0 || *end != 0;
+}
+
+// PFM stores RGB floats bottom row first, expand it to top-down RGBA float
+static jxr_status decode_pfm(const jxr_options *options, const void *data, size_t size, DecodedImage *decoded,
+                             const char **error) {
+    auto text = (const char *) data;
+    size_t pos = 2;
+    double w, h, scale;
+
+    if (pfm_token(text, size, &pos, &w) || pfm_token(text, size, &pos, &h) || pfm_token(text, size, &pos, &scale) ||
+        w < 1 || h < 1 || w > UINT32_MAX || h > UINT32_MAX || scale == 0 || pos >= size) {
+        *error = "Invalid PFM header";
+        return JXR_ERROR_DECODE;
+    }
+    pos++;  // single whitespace character before the raster
+
+    auto width = (uint32_t) w;
+    auto height = (uint32_t) h;
+    size_t rowFloats = (size_t) width * 3;
+
+    if ((size - pos) / sizeof(float) / rowFloats < height) {
+        *error = "PFM file is truncated";
+        return JXR_ERROR_DECODE;
+    }
+
+    size_t stride = frame_stride(options, sizeof(float) * 4 * width);
+    auto pixels = (uint8_t *) frame_alloc(options, stride * height, JXR_MEMORY_INPUT_FRAME);
+
+    if (pixels == nullptr) {
+        *error = "Failed to allocate float pixels";
+        return JXR_ERROR_OUT_OF_MEMORY;
+    }
+
+    const uint16_t endianTest = 1;
+    bool swap = (scale < 0) != (*(const uint8_t *) &endianTest == 1);
+
+    auto raster = (const uint8_t *) data + pos;
+
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *src = raster + (size_t) (height - 1 - y) * rowFloats * sizeof(float);
+        auto dst = (float *) (pixels + y * stride);
+
+        for (uint32_t x = 0; x < width; x++) {
+            for (int c = 0; c < 3; c++) {
+                uint8_t bytes[4];
+                memcpy(bytes, src + ((size_t) x * 3 + c) * sizeof(float), 4);
+                if (swap) {
+                    uint8_t t = bytes[0];
+                    bytes[0] = bytes[3];
+                    bytes[3] = t;
+                    t = bytes[1];
+                    bytes[1] = bytes[2];
+                    bytes[2] = t;
+                }
+                memcpy(&dst[4 * x + c], bytes, 4);
+            }
+            dst[4 * x + 3] = 1.0f;
+        }
+    }
+
+    decoded->pixels = pixels;
+    decoded->image = {pixels, width, height, stride, JXR_PIXEL_FORMAT_RGBA_FLOAT};
+
+    return JXR_OK;
+}
+
+jxr_status decode_image(const jxr_options *options, const void *data, size_t size, DecodedImage *decoded,
+                        const char **error) {
+    memset(decoded, 0, sizeof(DecodedImage));
+
+    auto magic = (const uint8_t *) data;
+
+    if (size >= 3 && magic[0] == 'P' && magic[1] == 'F' && is_space((char) magic[2])) {
+        return decode_pfm(options, data, size, decoded, error);
+    }
+
+#ifdef _WIN32
+    return decode_jxr_wic(options, data, size, decoded, error);
+#else
+    *error = "JPEG XR decoding requires WIC, which is only available on Windows";
+    return JXR_ERROR_UNSUPPORTED;
+#endif
+}
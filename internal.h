@@ -0,0 +1,178 @@
+// Shared declarations between the library translation units, not part of the public API
+#ifndef JXR_INTERNAL_H
+#define JXR_INTERNAL_H
+
+#include <cstddef>
+#include <cstdint>
+#include "jxr_to_png.h"
+
+#define INTERMEDIATE_BITS 16  // PNG bit depth (can only be 8 or 16, and 8 is insufficient for HDR)
+#define TARGET_BITS 10  // quantization bit depth
+
+#define MAXCLL_PERCENTILE 0.9999  // comment out to calculate true MaxCLL instead of top percentile
+
+// memory.cpp
+// Allocations through the options' allocator, counted in jxr_memory_usage under category
+void *jxr_malloc(const jxr_options *options, size_t size, jxr_memory_category category);
+void *jxr_calloc(const jxr_options *options, size_t count, size_t size, jxr_memory_category category);
+void *jxr_realloc(const jxr_options *options, void *ptr, size_t size, jxr_memory_category category);
+void jxr_free(const jxr_options *options, void *ptr);
+// Whether the caller's allocator hooks are usable: alloc and free together, realloc only with them
+bool allocator_valid(const jxr_allocator *allocator);
+
+// A frame-sized buffer, see jxr_frame_memory. Released with jxr_free, never reallocated.
+void *frame_alloc(const jxr_options *options, size_t size, jxr_memory_category category);
+// Bytes between the starts of decoded rows of rowSize bytes
+size_t frame_stride(const jxr_options *options, size_t rowSize);
+
+// threads.cpp
+uint32_t resolve_threads(const jxr_options *options);
+int run_parallel(const jxr_options *options, uint32_t count, jxr_task_fn fn, void *arg);
+
+double monotonic_seconds();
+double process_cpu_seconds();
+
+// counters.cpp
+// Hardware counters of the calling thread, and with inherit of the threads it starts until
+// counters_stop. Counters the host lacks stay closed.
+typedef struct CounterGroup {
+    int fds[JXR_COUNTER_COUNT];
+} CounterGroup;
+
+void counters_start(CounterGroup *group, bool inherit);
+void counters_stop(CounterGroup *group, jxr_counters *counters);  // adds to counters
+
+// Adds the wall and CPU time, and with options->counters the hardware counts, since stage_start
+// to a stage of timings, which may be null. The stage is also recorded as a trace span.
+typedef struct StageClock {
+    double wall;
+    double cpu;
+    double traceBegin;
+    bool counting;
+    CounterGroup counters;
+} StageClock;
+
+StageClock stage_start(const jxr_options *options);
+void stage_stop(StageClock *clock, jxr_timings *timings, jxr_stage stage);
+
+// trace.cpp
+// Records a span from construction to the end of the scope while tracing is on
+typedef struct TraceSpan {
+    const char *name;
+    int64_t arg;
+    double begin;
+
+    explicit TraceSpan(const char *name, int64_t arg = -1) : name(name), arg(arg), begin(jxr_trace_begin()) {}
+
+    ~TraceSpan() {
+        if (begin) {
+            jxr_trace_end(name, arg, begin);
+        }
+    }
+} TraceSpan;
+
+// convert.cpp
+// filter is a jxr_png_filter other than Paeth to emit filtered PNG rows, or -1 for plain samples.
+// timings, if given, receives the convert and statistics stages and the time of each task.
+jxr_status convert_frame(const jxr_options *options, const jxr_image *image, uint8_t *out, int filter,
+                         uint32_t numThreads, uint16_t *maxCLL, uint16_t *maxFALL, jxr_timings *timings,
+                         const char **error);
+
+// quality.cpp
+// Compares the plain rows produced by convert_frame with the source image
+int measure_quality(const jxr_options *options, const jxr_image *image, const uint8_t *converted,
+                    uint32_t numThreads, jxr_quality *quality);
+
+// png_filter.cpp
+// Filtered rows, each prefixed by its filter type byte, as they are compressed into IDAT
+size_t filtered_size(uint32_t width, uint32_t height);
+
+int filter_image(const jxr_options *options, const uint8_t *data, uint32_t width, uint32_t height,
+                 uint32_t numThreads, uint8_t *out);
+
+void filter_band(const uint8_t *data, uint32_t width, uint32_t start, uint32_t stop, jxr_filter_policy policy,
+                 jxr_png_filter fixedType, const uint8_t *zeroRow, uint8_t *scratch, uint8_t *out);
+
+// auto_compress.cpp
+// Copies options to chosen with the filter and compression settings that suit the plain rows best
+int choose_compression(const jxr_options *options, const uint8_t *data, uint32_t width, uint32_t height,
+                       jxr_options *chosen, char *report, size_t reportSize);
+// Bytes the samples allocate when they all run at once
+size_t auto_compress_memory(const jxr_options *options, uint32_t width);
+
+// optimize.cpp
+// Same as choose_compression, but tries every combination on the whole image and keeps the smallest
+int optimize_compression(const jxr_options *options, const uint8_t *data, uint32_t width, uint32_t height,
+                         jxr_options *chosen, char *report, size_t reportSize);
+// Bytes the trials allocate when they all run at once
+size_t optimize_memory(const jxr_options *options, uint32_t width);
+
+// budget.cpp
+// Copies options to chosen with the strongest settings and fewest threads expected to convert and
+// encode the image within remaining seconds, using options->calibration
+int choose_for_budget(const jxr_options *options, const jxr_image *image, double remaining, jxr_options *chosen,
+                      char *report, size_t reportSize);
+// Fills width * height RGBA float pixels with the mixed desktop and photo content calibration runs on
+void synthetic_image(float *pixels, uint32_t width, uint32_t height);
+
+// screen_deflate.cpp
+// A zlib stream in pieces, all in one allocation released with jxr_free
+typedef struct DeflateParts {
+    void *memory;
+    jxr_iovec *parts;
+    uint32_t count;
+} DeflateParts;
+
+int screen_deflate(const jxr_options *options, const uint8_t *data, size_t size, size_t rowSize,
+                   uint32_t numThreads, DeflateParts *result);
+
+// Bytes screen_deflate allocates for size bytes of input
+size_t screen_deflate_memory(size_t size, uint32_t numThreads);
+
+// png_encode.cpp
+// Either a buffer or a caller stream receives the encoded file
+typedef struct OutputSink {
+    const jxr_options *options;
+    jxr_buffer *buffer;
+    const jxr_stream *stream;
+    size_t written;
+} OutputSink;
+
+int sink_write(OutputSink *sink, const void *data, size_t size);
+int sink_writev(OutputSink *sink, const jxr_iovec *parts, uint32_t count);
+int sink_flush(OutputSink *sink);
+
+size_t png_size_bound(uint32_t width, uint32_t height);
+
+// zlib stream set up with the options' level and strategy, using the options' allocator
+struct z_stream_s;
+int deflate_init(struct z_stream_s *stream, const jxr_options *options);
+
+// Bytes a stream from deflate_init allocates
+size_t deflate_memory(const jxr_options *options);
+
+size_t compressed_size(const jxr_options *options, const uint8_t *filtered, size_t size, size_t rowSize);
+size_t compressed_size_memory(const jxr_options *options, size_t size);
+
+// Bytes write_png_file allocates with the options' compressor, not counting the output
+size_t encode_memory(const jxr_options *options, uint32_t width, uint32_t height, uint32_t numThreads);
+
+// Takes the rows as produced by filter_image
+int write_png_file(OutputSink *sink, const uint8_t *filtered, uint32_t width, uint32_t height, uint32_t numThreads,
+                   uint32_t maxCLL, uint32_t maxFALL, const char **error);
+
+// pnm_encode.cpp
+// Takes the plain rows, as produced by convert_frame without a filter
+int write_pnm_file(OutputSink *sink, const uint8_t *data, uint32_t width, uint32_t height, uint16_t maxCLL,
+                   uint16_t maxFALL, const char **error);
+
+// decode.cpp
+typedef struct DecodedImage {
+    jxr_image image;
+    void *pixels;  // owned, released with jxr_free
+} DecodedImage;
+
+jxr_status decode_image(const jxr_options *options, const void *data, size_t size, DecodedImage *decoded,
+                        const char **error);
+
+#endif
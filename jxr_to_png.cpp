@@ -0,0 +1,364 @@
+#include <cstdlib>
+#include <cstring>
+#include "internal.h"
+
+#define DECODE_FAST_IDAT_SIZE (4 << 20)
+#define DECODE_FAST_LEVEL 6  // level 9 inflates barely faster and can be very slow to encode
+
+void jxr_options_init(jxr_options *options) {
+    memset(options, 0, sizeof(jxr_options));
+}
+
+void jxr_options_decode_fast(jxr_options *options) {
+    options->filter_policy = JXR_FILTER_DECODE_FAST;
+    options->idat_size = DECODE_FAST_IDAT_SIZE;
+    options->deflate = JXR_DEFLATE_ZLIB;
+    options->level = DECODE_FAST_LEVEL;
+    options->strategy = JXR_STRATEGY_DEFAULT;
+}
+
+static jxr_status fail(jxr_result *result, jxr_status status, const char *error) {
+    result->error = error;
+    return status;
+}
+
+// start is when the caller's call began, which a time budget counts from
+static jxr_status convert_to_sink(const jxr_image *image, const jxr_options *options, OutputSink *sink,
+                                  jxr_result *result, double start) {
+    if (image == nullptr || image->pixels == nullptr || image->width == 0 || image->height == 0) {
+        return fail(result, JXR_ERROR_INVALID_ARGUMENT, "Missing image");
+    }
+
+    if (image->format != JXR_PIXEL_FORMAT_RGBA_HALF && image->format != JXR_PIXEL_FORMAT_RGBA_FLOAT) {
+        return fail(result, JXR_ERROR_UNSUPPORTED, "Unsupported pixel format");
+    }
+
+    if (options->filter_policy == JXR_FILTER_FIXED && (unsigned) options->filter_type > JXR_PNG_FILTER_PAETH) {
+        return fail(result, JXR_ERROR_INVALID_ARGUMENT, "Invalid PNG filter type");
+    }
+
+    if (options->level < 0 || options->level > 9) {
+        return fail(result, JXR_ERROR_INVALID_ARGUMENT, "Invalid compression level");
+    }
+
+    if (options->window_bits && (options->window_bits < 9 || options->window_bits > 15)) {
+        return fail(result, JXR_ERROR_INVALID_ARGUMENT, "Invalid zlib window size");
+    }
+
+    if (options->mem_level < 0 || options->mem_level > 9) {
+        return fail(result, JXR_ERROR_INVALID_ARGUMENT, "Invalid zlib memory level");
+    }
+
+    if ((unsigned) options->format > JXR_FORMAT_PAM) {
+        return fail(result, JXR_ERROR_INVALID_ARGUMENT, "Invalid output format");
+    }
+
+    // The compression settings only matter for PNG output
+    bool png = options->format == JXR_FORMAT_PNG;
+    jxr_options budgeted;
+    jxr_timings *timings = &result->timings;
+
+    if (png && options->time_budget_ms) {
+        if (options->calibration == nullptr) {
+            return fail(result, JXR_ERROR_INVALID_ARGUMENT, "Time budget without calibration");
+        }
+        StageClock clock = stage_start(options);
+        double remaining = options->time_budget_ms / 1000.0 - (monotonic_seconds() - start);
+        int ret = choose_for_budget(options, image, remaining, &budgeted, result->compression,
+                                    sizeof(result->compression));
+        stage_stop(&clock, timings, JXR_STAGE_SELECT);
+        if (ret) {
+            return fail(result, JXR_ERROR_ENCODE, "Failed to sample the image for the time budget");
+        }
+        options = &budgeted;
+    }
+
+    uint32_t width = image->width;
+    uint32_t height = image->height;
+
+    result->width = width;
+    result->height = height;
+    result->threads = resolve_threads(options);
+
+    // Fixed filters other than Paeth are applied by the conversion kernel itself, which writes the
+    // rows ready for compression and saves a pass over the image. Auto and optimize mode and the
+    // quality measurement need the plain rows.
+    bool fused = png && !options->auto_compression && !options->optimize && !options->quality &&
+                 options->filter_policy == JXR_FILTER_FIXED && options->filter_type != JXR_PNG_FILTER_PAETH;
+
+    size_t converted_size = fused ? filtered_size(width, height) : sizeof(uint16_t) * width * height * 3;
+    auto converted = (uint8_t *) frame_alloc(options, converted_size, JXR_MEMORY_OUTPUT_FRAME);
+
+    if (converted == nullptr) {
+        return fail(result, JXR_ERROR_OUT_OF_MEMORY, "Failed to allocate converted pixels");
+    }
+
+    const char *error = nullptr;
+
+    jxr_status status = convert_frame(options, image, converted, fused ? options->filter_type : -1,
+                                      result->threads, &result->max_cll, &result->max_fall, timings, &error);
+    if (status != JXR_OK) {
+        jxr_free(options, converted);
+        return fail(result, status, error);
+    }
+
+    if (options->quality) {
+        StageClock clock = stage_start(options);
+        int ret = measure_quality(options, image, converted, result->threads, &result->quality);
+        stage_stop(&clock, timings, JXR_STAGE_QUALITY);
+        if (ret) {
+            jxr_free(options, converted);
+            return fail(result, JXR_ERROR_THREAD, "Failed to measure quality");
+        }
+    }
+
+    if (!png) {
+        StageClock clock = stage_start(options);
+        int ret = write_pnm_file(sink, converted, width, height, result->max_cll, result->max_fall, &error);
+        stage_stop(&clock, timings, JXR_STAGE_ENCODE);
+        timings->bytes_out = sink->written;
+        jxr_free(options, converted);
+        return ret ? fail(result, JXR_ERROR_ENCODE, error) : JXR_OK;
+    }
+
+    const jxr_options *encodeOptions = options;
+    jxr_options chosen;
+
+    if (options->optimize || options->auto_compression) {
+        StageClock clock = stage_start(options);
+        int ret = options->optimize
+                  ? optimize_compression(options, converted, width, height, &chosen, result->compression,
+                                         sizeof(result->compression))
+                  : choose_compression(options, converted, width, height, &chosen, result->compression,
+                                       sizeof(result->compression));
+        stage_stop(&clock, timings, JXR_STAGE_SELECT);
+        if (ret) {
+            jxr_free(options, converted);
+            return fail(result, JXR_ERROR_ENCODE, options->optimize ? "Failed to search compression settings"
+                                                                    : "Failed to sample compression settings");
+        }
+        encodeOptions = &chosen;
+    }
+
+    uint8_t *filtered = converted;
+
+    if (!fused) {
+        filtered = (uint8_t *) frame_alloc(options, filtered_size(width, height), JXR_MEMORY_OUTPUT_FRAME);
+        if (filtered == nullptr) {
+            jxr_free(options, converted);
+            return fail(result, JXR_ERROR_OUT_OF_MEMORY, "Failed to allocate filtered rows");
+        }
+
+        StageClock clock = stage_start(options);
+        int ret = filter_image(encodeOptions, converted, width, height, result->threads, filtered);
+        stage_stop(&clock, timings, JXR_STAGE_FILTER);
+        jxr_free(options, converted);
+
+        if (ret) {
+            jxr_free(options, filtered);
+            return fail(result, JXR_ERROR_THREAD, "Failed to filter PNG rows");
+        }
+    }
+
+    uint32_t maxCLL_png = result->max_cll * 10000;
+    uint32_t maxFALL_png = result->max_fall * 10000;
+
+    const jxr_options *sinkOptions = sink->options;
+    sink->options = encodeOptions;
+    StageClock clock = stage_start(options);
+    int ret = write_png_file(sink, filtered, width, height, result->threads, maxCLL_png, maxFALL_png, &error);
+    stage_stop(&clock, timings, JXR_STAGE_ENCODE);
+    sink->options = sinkOptions;
+    timings->bytes_out = sink->written;
+
+    jxr_free(options, filtered);
+
+    if (ret) {
+        return fail(result, JXR_ERROR_ENCODE, error);
+    }
+
+    if (png && options->time_budget_ms) {
+        result->elapsed_ms = (uint32_t) ((monotonic_seconds() - start) * 1000);
+        result->budget_missed = result->elapsed_ms > options->time_budget_ms;
+    }
+
+    return JXR_OK;
+}
+
+// Decodes the input and converts it, shared by the buffer and stream entry points
+static jxr_status convert_memory_to_sink(const void *data, size_t size, const jxr_options *options,
+                                         OutputSink *sink, jxr_result *result) {
+    if (data == nullptr || size == 0) {
+        return fail(result, JXR_ERROR_INVALID_ARGUMENT, "Missing input data");
+    }
+
+    double start = monotonic_seconds();
+    DecodedImage decoded;
+    const char *error = nullptr;
+
+    StageClock clock = stage_start(options);
+    jxr_status status = decode_image(options, data, size, &decoded, &error);
+    stage_stop(&clock, &result->timings, JXR_STAGE_DECODE);
+    if (status != JXR_OK) {
+        return fail(result, status, error);
+    }
+    result->timings.bytes_in = size;
+
+    status = convert_to_sink(&decoded.image, options, sink, result, start);
+
+    jxr_free(options, decoded.pixels);
+
+    return status;
+}
+
+#define API_DEFAULTS() \
+    jxr_options defaults; \
+    if (options == nullptr) { \
+        jxr_options_init(&defaults); \
+        options = &defaults; \
+    } \
+    jxr_result ignored; \
+    if (result == nullptr) { \
+        result = &ignored; \
+    } \
+    memset(result, 0, sizeof(jxr_result)); \
+    if (!allocator_valid(&options->allocator)) { \
+        return fail(result, JXR_ERROR_INVALID_ARGUMENT, "Allocator needs both alloc and free"); \
+    }
+
+static jxr_status finish_buffer(jxr_status status, const jxr_buffer *out, jxr_result *result) {
+    if (status == JXR_OK && out->size > out->capacity) {
+        return fail(result, JXR_ERROR_BUFFER_TOO_SMALL, "Output buffer too small");
+    }
+    return status;
+}
+
+jxr_status jxr_convert_pixels(const jxr_image *image, const jxr_options *options, jxr_buffer *out,
+                              jxr_result *result) {
+    API_DEFAULTS();
+
+    if (out == nullptr) {
+        return fail(result, JXR_ERROR_INVALID_ARGUMENT, "Missing output buffer");
+    }
+
+    OutputSink sink = {options, out, nullptr, 0};
+    out->size = 0;
+
+    return finish_buffer(convert_to_sink(image, options, &sink, result, monotonic_seconds()), out, result);
+}
+
+jxr_status jxr_convert_memory(const void *data, size_t size, const jxr_options *options, jxr_buffer *out,
+                              jxr_result *result) {
+    API_DEFAULTS();
+
+    if (out == nullptr) {
+        return fail(result, JXR_ERROR_INVALID_ARGUMENT, "Missing output buffer");
+    }
+
+    OutputSink sink = {options, out, nullptr, 0};
+    out->size = 0;
+
+    return finish_buffer(convert_memory_to_sink(data, size, options, &sink, result), out, result);
+}
+
+jxr_status jxr_convert_pixels_stream(const jxr_image *image, const jxr_options *options, const jxr_stream *out,
+                                     jxr_result *result) {
+    API_DEFAULTS();
+
+    if (out == nullptr || out->write == nullptr) {
+        return fail(result, JXR_ERROR_INVALID_ARGUMENT, "Missing output stream");
+    }
+
+    OutputSink sink = {options, nullptr, out, 0};
+    return convert_to_sink(image, options, &sink, result, monotonic_seconds());
+}
+
+jxr_status jxr_convert_memory_stream(const void *data, size_t size, const jxr_options *options,
+                                     const jxr_stream *out, jxr_result *result) {
+    API_DEFAULTS();
+
+    if (out == nullptr || out->write == nullptr) {
+        return fail(result, JXR_ERROR_INVALID_ARGUMENT, "Missing output stream");
+    }
+
+    OutputSink sink = {options, nullptr, out, 0};
+    return convert_memory_to_sink(data, size, options, &sink, result);
+}
+
+jxr_status jxr_decode_memory(const void *data, size_t size, const jxr_options *options, jxr_image *image,
+                             jxr_result *result) {
+    API_DEFAULTS();
+
+    if (data == nullptr || size == 0 || image == nullptr) {
+        return fail(result, JXR_ERROR_INVALID_ARGUMENT, "Missing input data");
+    }
+
+    DecodedImage decoded;
+    const char *error = nullptr;
+
+    StageClock clock = stage_start(options);
+    jxr_status status = decode_image(options, data, size, &decoded, &error);
+    stage_stop(&clock, &result->timings, JXR_STAGE_DECODE);
+    if (status != JXR_OK) {
+        return fail(result, status, error);
+    }
+    result->timings.bytes_in = size;
+
+    *image = decoded.image;
+    result->width = image->width;
+    result->height = image->height;
+
+    return JXR_OK;
+}
+
+void jxr_image_free(const jxr_options *options, jxr_image *image) {
+    jxr_options defaults;
+    if (options == nullptr) {
+        jxr_options_init(&defaults);
+        options = &defaults;
+    }
+
+    jxr_free(options, (void *) image->pixels);
+    image->pixels = nullptr;
+}
+
+size_t jxr_png_size_bound(uint32_t width, uint32_t height) {
+    return png_size_bound(width, height);
+}
+
+void jxr_buffer_free(const jxr_options *options, jxr_buffer *buffer) {
+    jxr_options defaults;
+    if (options == nullptr) {
+        jxr_options_init(&defaults);
+        options = &defaults;
+    }
+
+    if (buffer->growable) {
+        jxr_free(options, buffer->data);
+        buffer->data = nullptr;
+        buffer->capacity = 0;
+    }
+    buffer->size = 0;
+}
+
+const char *jxr_status_string(jxr_status status) {
+    switch (status) {
+        case JXR_OK:
+            return "Success";
+        case JXR_ERROR_INVALID_ARGUMENT:
+            return "Invalid argument";
+        case JXR_ERROR_OUT_OF_MEMORY:
+            return "Out of memory";
+        case JXR_ERROR_UNSUPPORTED:
+            return "Unsupported input";
+        case JXR_ERROR_DECODE:
+            return "Decoding failed";
+        case JXR_ERROR_ENCODE:
+            return "PNG encoding failed";
+        case JXR_ERROR_THREAD:
+            return "Conversion failed";
+        case JXR_ERROR_BUFFER_TOO_SMALL:
+            return "Output buffer too small";
+    }
+    return "Unknown error";
+}
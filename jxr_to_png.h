@@ -0,0 +1,405 @@
+// C API for converting HDR JPEG XR images (or scRGB pixel buffers) to BT.2100 PQ PNG in memory
+#ifndef JXR_TO_PNG_H
+#define JXR_TO_PNG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(JXR_SHARED) && defined(_WIN32)
+#ifdef JXR_BUILDING_LIBRARY
+#define JXR_API __declspec(dllexport)
+#else
+#define JXR_API __declspec(dllimport)
+#endif
+#elif defined(JXR_SHARED) && defined(__GNUC__)
+#define JXR_API __attribute__((visibility("default")))
+#else
+#define JXR_API
+#endif
+
+typedef enum jxr_status {
+    JXR_OK = 0,
+    JXR_ERROR_INVALID_ARGUMENT,
+    JXR_ERROR_OUT_OF_MEMORY,
+    JXR_ERROR_UNSUPPORTED,        // input format or feature not available on this platform
+    JXR_ERROR_DECODE,
+    JXR_ERROR_ENCODE,
+    JXR_ERROR_THREAD,
+    JXR_ERROR_BUFFER_TOO_SMALL,   // caller-provided output buffer is full, see jxr_buffer.size
+} jxr_status;
+
+// scRGB input layouts, the value is the number of bytes per color component
+typedef enum jxr_pixel_format {
+    JXR_PIXEL_FORMAT_RGBA_HALF = 2,   // GUID_WICPixelFormat64bppRGBAHalf
+    JXR_PIXEL_FORMAT_RGBA_FLOAT = 4,  // GUID_WICPixelFormat128bppRGBAFloat
+} jxr_pixel_format;
+
+typedef struct jxr_image {
+    const void *pixels;
+    uint32_t width;
+    uint32_t height;
+    size_t stride;  // bytes from one row to the next, 0 for tightly packed rows
+    jxr_pixel_format format;
+} jxr_image;
+
+// All library allocations go through these, leave them null to use malloc/realloc/free. alloc and
+// free must be set together; realloc is optional, without it blocks grow by alloc, copy and free.
+typedef struct jxr_allocator {
+    void *(*alloc)(void *user, size_t size);
+    void *(*realloc)(void *user, void *ptr, size_t size);
+    void (*free)(void *user, void *ptr);
+    void *user;
+} jxr_allocator;
+
+typedef void (*jxr_task_fn)(void *arg, uint32_t index);
+
+// Must call fn(arg, i) for every i in [0, count) and only return once all calls are done.
+// Returns 0 on success.
+typedef int (*jxr_parallel_fn)(void *user, uint32_t count, jxr_task_fn fn, void *arg);
+
+typedef struct jxr_threading {
+    uint32_t num_threads;          // 0 to use jxr_default_threads()
+    jxr_parallel_fn parallel_for;  // null to create one thread per task for each call
+    void *user;
+} jxr_threading;
+
+// PNG row filter types
+typedef enum jxr_png_filter {
+    JXR_PNG_FILTER_NONE = 0,
+    JXR_PNG_FILTER_SUB,
+    JXR_PNG_FILTER_UP,
+    JXR_PNG_FILTER_AVERAGE,
+    JXR_PNG_FILTER_PAETH,
+} jxr_png_filter;
+
+// How the filter of each row is chosen. Rows are scored by the sum of absolute values of the
+// filtered bytes, and the filter with the lowest score wins.
+typedef enum jxr_filter_policy {
+    JXR_FILTER_EXHAUSTIVE = 0,  // scores all five filters on the whole row, like libpng
+    JXR_FILTER_FAST,            // scores all five filters on a sample of the row
+    JXR_FILTER_FIXED,           // filter_type for every row
+    JXR_FILTER_ENTROPY,         // all five filters on the whole row, keeps the lowest byte entropy
+    JXR_FILTER_DECODE_FAST,     // like exhaustive, but only none and up, which unfilter fastest
+} jxr_filter_policy;
+
+// Compressor for the PNG image data
+typedef enum jxr_deflate {
+    JXR_DEFLATE_ZLIB = 0,  // zlib, see level and strategy
+    JXR_DEFLATE_SCREEN,    // multithreaded, only finds runs and repeated rows, for desktop screenshots
+    JXR_DEFLATE_STORED,    // no compression, for consumers that decode right away (best with a none filter)
+} jxr_deflate;
+
+// PNG, or the converted 16-bit samples as they are with the HDR metadata in header comments
+typedef enum jxr_output_format {
+    JXR_FORMAT_PNG = 0,
+    JXR_FORMAT_PPM,  // binary P6, maxval 65535
+    JXR_FORMAT_PAM,  // P7, TUPLTYPE RGB
+} jxr_output_format;
+
+typedef enum jxr_strategy {
+    JXR_STRATEGY_LIBPNG = 0,  // filtered for filtered rows, default otherwise
+    JXR_STRATEGY_DEFAULT,
+    JXR_STRATEGY_FILTERED,
+    JXR_STRATEGY_RLE,
+} jxr_strategy;
+
+#define JXR_BUDGET_SETTINGS 5
+
+// Speed of this host, measured by jxr_calibrate and used to fit conversions into a time budget.
+// Costs are nanoseconds per pixel on one thread, for each compression setting the budget can pick.
+typedef struct jxr_calibration {
+    uint32_t threads;         // thread count parallel_speedup was measured with
+    double parallel_speedup;  // of the conversion on that many threads
+    double convert_ns;
+    double filter_ns[JXR_BUDGET_SETTINGS];
+    double deflate_ns[JXR_BUDGET_SETTINGS];
+} jxr_calibration;
+
+// Frame-sized buffers (decoded pixels, converted and filtered rows, screen compression output) are
+// mapped directly when no allocator is given, 64-byte aligned and on 2 MB pages where the system
+// allows it. Decoded rows are padded when their length is a multiple of 4 KB, so the input and
+// output streams of the conversion don't compete for the same cache sets.
+typedef struct jxr_frame_memory {
+    int no_huge_pages;  // 4 KB pages only
+    int row_padding;    // bytes added to such rows, 0 for 128, -1 for none
+    int prefault;       // touch new frame buffers on all threads before they are used
+} jxr_frame_memory;
+
+typedef struct jxr_buffer_pool jxr_buffer_pool;
+
+// With auto_compression set, the filter, deflate, level and strategy settings are chosen per
+// image: a few row bands are compressed with each candidate setting in parallel, and the fastest
+// candidate whose sample size is within auto_tolerance percent of the smallest one is used.
+// optimize instead compresses the whole image with every combination of filter policy and zlib
+// strategy at level 9 with a longer match search, one combination per thread, and keeps the
+// smallest. It takes minutes for large images and is meant for archival.
+// A time_budget_ms overrides all of these: a band of the image is converted and compressed to
+// scale the calibration, and the strongest setting predicted to finish in time is used, on the
+// fewest threads (up to threading.num_threads) that get it there.
+typedef struct jxr_options {
+    jxr_allocator allocator;
+    jxr_threading threading;
+    jxr_filter_policy filter_policy;
+    jxr_png_filter filter_type;  // only used by JXR_FILTER_FIXED
+    uint32_t idat_size;          // compressed bytes per IDAT chunk, 0 for 256 KB, at least 8 KB
+    jxr_deflate deflate;
+    int level;                   // zlib level 1-9, 0 for 6
+    jxr_strategy strategy;
+    int window_bits;             // zlib window 9-15, 0 for 15
+    int mem_level;               // zlib hash memory 1-9, 0 for 8 (9 with optimize)
+    int auto_compression;
+    uint32_t auto_tolerance;     // percent
+    int optimize;
+    uint32_t time_budget_ms;     // 0 for none, needs calibration
+    const jxr_calibration *calibration;
+    jxr_output_format format;
+    int counters;                // hardware counters per stage in jxr_result.timings, Linux only
+    uint32_t quality;            // 0 for none, N compares every Nth row of the output with the source
+    jxr_frame_memory frame_memory;
+    jxr_buffer_pool *buffer_pool;  // null to allocate every buffer anew, takes precedence over allocator
+} jxr_options;
+
+// Output PNG bytes. With growable set, data is allocated or grown with the options' allocator and
+// must be released with jxr_buffer_free. Otherwise data/capacity is caller memory, and on
+// JXR_ERROR_BUFFER_TOO_SMALL size holds the number of bytes that would have been needed.
+typedef struct jxr_buffer {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    int growable;
+} jxr_buffer;
+
+typedef struct jxr_iovec {
+    const void *data;
+    size_t size;
+} jxr_iovec;
+
+#define JXR_MAX_IOVECS 16
+
+// Receives the PNG as it is produced, for streaming output. All return 0 on success, flush and
+// writev may be null. flush is called once the header chunks are complete and again at the end of
+// the file. writev, when set, receives pieces that belong together in a single call, at most
+// JXR_MAX_IOVECS of them.
+typedef struct jxr_stream {
+    int (*write)(void *user, const void *data, size_t size);
+    int (*flush)(void *user);
+    void *user;
+    int (*writev)(void *user, const jxr_iovec *parts, uint32_t count);
+} jxr_stream;
+
+typedef enum jxr_stage {
+    JXR_STAGE_DECODE = 0,
+    JXR_STAGE_CONVERT,     // PQ conversion and the per-thread light level histograms
+    JXR_STAGE_STATISTICS,  // merging the histograms into MaxCLL and MaxFALL
+    JXR_STAGE_SELECT,      // sampling in auto, optimize and time budget mode
+    JXR_STAGE_FILTER,
+    JXR_STAGE_ENCODE,      // compressing and writing the PNG (or PPM/PAM)
+    JXR_STAGE_QUALITY,     // comparing the output with the source, after the conversion
+    JXR_STAGE_COUNT,
+} jxr_stage;
+
+#define JXR_TIMED_THREADS 64
+
+typedef enum jxr_counter {
+    JXR_COUNTER_CYCLES = 0,
+    JXR_COUNTER_INSTRUCTIONS,
+    JXR_COUNTER_LLC_MISSES,   // last level cache read misses
+    JXR_COUNTER_DTLB_MISSES,  // data TLB read misses
+    JXR_COUNTER_COUNT,
+} jxr_counter;
+
+// User mode hardware event counts. Bit 1 << jxr_counter of available is set for the counters the
+// host provides, virtual machines often have none.
+typedef struct jxr_counters {
+    uint64_t values[JXR_COUNTER_COUNT];
+    uint32_t available;
+} jxr_counters;
+
+// Stage counters include the threads the library starts for the stage, but not the workers of a
+// caller's thread pool. The per-thread conversion counters are complete either way.
+typedef struct jxr_stage_time {
+    double wall;  // seconds
+    double cpu;   // seconds of CPU time used by the whole process, on all threads
+    jxr_counters counters;
+} jxr_stage_time;
+
+// Where the time went, filled in by every call
+typedef struct jxr_timings {
+    jxr_stage_time stages[JXR_STAGE_COUNT];
+    uint32_t convert_threads;                       // the first JXR_TIMED_THREADS are timed below
+    double convert_thread_wall[JXR_TIMED_THREADS];  // seconds each conversion thread took
+    jxr_counters convert_thread_counters[JXR_TIMED_THREADS];
+    uint64_t bytes_in;                              // encoded input, 0 when converting pixels
+    uint64_t bytes_out;
+} jxr_timings;
+
+// How far what the output decodes to is from the source, with options.quality set. The reference
+// is the source's BT.2100 PQ signal before quantization.
+typedef struct jxr_quality {
+    uint64_t pixels;          // compared, 0 when not measured
+    double delta_e_itp_mean;  // BT.2124, 1 is about a just noticeable difference
+    double delta_e_itp_max;
+    double psnr_pq;           // dB, of the PQ signal with a peak of 1
+    double max_code_error;    // in output codes, 0.5 when every sample is rounded to the nearest code
+} jxr_quality;
+
+typedef struct jxr_result {
+    uint32_t width;
+    uint32_t height;
+    uint32_t threads;
+    uint16_t max_cll;
+    uint16_t max_fall;
+    const char *error;  // static description of what failed, null on success
+    char compression[128];  // the settings picked in auto, optimize or time budget mode and why, empty otherwise
+    uint32_t elapsed_ms;    // time spent when there was a time budget
+    int budget_missed;
+    jxr_timings timings;
+    jxr_quality quality;
+} jxr_result;
+
+// What the library's allocations are for
+typedef enum jxr_memory_category {
+    JXR_MEMORY_INPUT_FRAME = 0,  // decoded scRGB pixels
+    JXR_MEMORY_OUTPUT_FRAME,     // converted 16-bit samples and filtered PNG rows
+    JXR_MEMORY_HISTOGRAMS,       // light level histograms of the conversion threads
+    JXR_MEMORY_ENCODER,          // compressor state, IDAT buffers and compression sampling
+    JXR_MEMORY_OUTPUT,           // the encoded file in a growable jxr_buffer
+    JXR_MEMORY_OTHER,
+    JXR_MEMORY_CALLER,           // the caller's own buffers from jxr_buffer_pool_alloc
+    JXR_MEMORY_COUNT,
+} jxr_memory_category;
+
+// Bytes the library has allocated, for the whole process
+typedef struct jxr_memory_usage {
+    uint64_t current[JXR_MEMORY_COUNT];
+    uint64_t peak[JXR_MEMORY_COUNT];
+    uint64_t current_total;
+    uint64_t peak_total;  // of all categories at once, at most the sum of the peaks
+    uint64_t peak_rss;    // resident set of the process, 0 where unknown
+} jxr_memory_usage;
+
+JXR_API void jxr_options_init(jxr_options *options);
+
+// Output profile for images that are decoded far more often than written: filters that unfilter
+// fast, large IDAT chunks and zlib settings that inflate fast. Overrides those fields only.
+JXR_API void jxr_options_decode_fast(jxr_options *options);
+
+JXR_API uint32_t jxr_default_threads(void);
+
+// Measures conversion and compression speed on a built-in test image, takes about a second
+JXR_API jxr_status jxr_calibrate(const jxr_options *options, jxr_calibration *calibration);
+
+// Converts an scRGB pixel buffer
+JXR_API jxr_status jxr_convert_pixels(const jxr_image *image, const jxr_options *options,
+                                      jxr_buffer *out, jxr_result *result);
+
+// Decodes an encoded image held in memory and converts it. Accepts JPEG XR (through WIC, Windows
+// only) and little or big endian PFM, which is read as linear scRGB.
+JXR_API jxr_status jxr_convert_memory(const void *data, size_t size, const jxr_options *options,
+                                      jxr_buffer *out, jxr_result *result);
+
+// Decodes without converting, e.g. to size the output before converting with jxr_convert_pixels.
+// The pixels are allocated with the options' allocator, release them with jxr_image_free.
+JXR_API jxr_status jxr_decode_memory(const void *data, size_t size, const jxr_options *options,
+                                     jxr_image *image, jxr_result *result);
+
+JXR_API void jxr_image_free(const jxr_options *options, jxr_image *image);
+
+// Upper bound of the PNG size for an image of these dimensions, enough for a non-growable buffer
+// (and for PPM/PAM output)
+JXR_API size_t jxr_png_size_bound(uint32_t width, uint32_t height);
+
+// Same as above, but hand the PNG to a stream as it is encoded instead of collecting it in a buffer
+JXR_API jxr_status jxr_convert_pixels_stream(const jxr_image *image, const jxr_options *options,
+                                             const jxr_stream *out, jxr_result *result);
+
+JXR_API jxr_status jxr_convert_memory_stream(const void *data, size_t size, const jxr_options *options,
+                                             const jxr_stream *out, jxr_result *result);
+
+JXR_API void jxr_buffer_free(const jxr_options *options, jxr_buffer *buffer);
+
+JXR_API const char *jxr_status_string(jxr_status status);
+
+JXR_API void jxr_memory_usage_get(jxr_memory_usage *usage);
+
+// Starts the peaks over from the current allocations, e.g. between images
+JXR_API void jxr_memory_usage_reset(void);
+
+// Fills peak and peak_total with an upper estimate of the memory converting a width x height image
+// of format with options takes, so that jobs can be admitted before they start. The input frame is
+// counted even when the caller provides it, the output only with growable_output.
+JXR_API jxr_status jxr_estimate_memory(uint32_t width, uint32_t height, jxr_pixel_format format,
+                                       const jxr_options *options, int growable_output,
+                                       jxr_memory_usage *estimate);
+
+// Persistent worker threads for processes that convert many images. Pass the pool as
+// threading.user with jxr_thread_pool_parallel_for as threading.parallel_for. Several conversions
+// may share one pool concurrently, the calling thread helps with its own tasks.
+typedef struct jxr_thread_pool jxr_thread_pool;
+
+JXR_API jxr_thread_pool *jxr_thread_pool_create(uint32_t num_threads);
+
+JXR_API void jxr_thread_pool_destroy(jxr_thread_pool *pool);
+
+JXR_API uint32_t jxr_thread_pool_size(const jxr_thread_pool *pool);
+
+JXR_API int jxr_thread_pool_parallel_for(void *pool, uint32_t count, jxr_task_fn fn, void *arg);
+
+// Keeps freed library buffers for the next conversion, so processes that convert many images stop
+// allocating and page faulting once every buffer size has been seen. Buffers are rounded up to
+// size classes four per power of two, large ones are mapped like frames (see jxr_frame_memory).
+// At most max_idle_bytes are kept; when the system has less than min_available_bytes of memory
+// available (checked at most once a second, 0 to never check), all idle buffers are released.
+// A pool may be shared by concurrent conversions.
+typedef struct jxr_buffer_pool_stats {
+    uint64_t hits;           // allocations served by an idle buffer
+    uint64_t misses;         // allocations that needed new memory
+    uint64_t idle_bytes;
+    uint64_t idle_buffers;
+    uint64_t released_bytes; // idle or returned buffers given back to the system
+} jxr_buffer_pool_stats;
+
+JXR_API jxr_buffer_pool *jxr_buffer_pool_create(uint64_t max_idle_bytes, uint64_t min_available_bytes);
+
+// Every buffer from the pool must have been freed
+JXR_API void jxr_buffer_pool_destroy(jxr_buffer_pool *pool);
+
+// Releases idle buffers until at most keep_bytes remain
+JXR_API void jxr_buffer_pool_trim(jxr_buffer_pool *pool, uint64_t keep_bytes);
+
+JXR_API void jxr_buffer_pool_stats_get(jxr_buffer_pool *pool, jxr_buffer_pool_stats *stats);
+
+// The pool's buffers for the caller's own use, such as input files. Usable as a jxr_allocator
+// for other code, not as the library's (set buffer_pool instead).
+JXR_API void *jxr_buffer_pool_alloc(void *pool, size_t size);
+
+JXR_API void *jxr_buffer_pool_realloc(void *pool, void *ptr, size_t size);
+
+JXR_API void jxr_buffer_pool_free(void *pool, void *ptr);
+
+// Records what every thread does over time as Chrome trace events, which load in Perfetto or
+// chrome://tracing. Off until jxr_trace_start, each thread then keeps its last events_per_thread
+// spans (0 for the default). Fails with JXR_ERROR_INVALID_ARGUMENT while tracing is already on.
+JXR_API jxr_status jxr_trace_start(uint32_t events_per_thread);
+
+JXR_API void jxr_trace_stop(void);
+
+// Writes the recorded spans as trace event JSON. Call jxr_trace_stop first, this fails with
+// JXR_ERROR_INVALID_ARGUMENT while tracing is on.
+JXR_API jxr_status jxr_trace_write(const jxr_stream *out);
+
+// Spans of the caller's own work, such as I/O, shown next to the library's. begin is 0 while
+// tracing is off, name must stay valid until the trace is written and arg is shown unless negative.
+JXR_API double jxr_trace_begin(void);
+
+JXR_API void jxr_trace_end(const char *name, int64_t arg, double begin);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,498 +1,1041 @@
 #define _CRT_SECURE_NO_WARNINGS
-#define _XM_F16C_INTRINSICS_
 
+#define BATCH_READAHEAD 4  // inputs read ahead of the one being converted in batch mode
+#define DEFAULT_QUALITY_STEP 8  // rows per compared row for --quality, 1 compares every pixel
+#define DEFAULT_POOL_MB 2048  // idle buffers kept between batch conversions
+#define POOL_MIN_AVAILABLE_MB 256  // idle buffers are released when the system has less than this left
+
+#include <cerrno>
+#include <chrono>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include "async_io.h"
+#include "jxr_to_png.h"
+#include "mapped_file.h"
+#include "timings.h"
+
+#ifdef _WIN32
 #include <windows.h>
-#include <wincodec.h>
-#include <cmath>
-#include <Shlwapi.h>
-#include "DirectXMath/DirectXMath.h"
-#include "DirectXMath/DirectXPackedVector.h"
-#include "libpng/png.h"
-#include "icc_profile.h"
-
-using namespace DirectX;
-using namespace DirectX::PackedVector;
-
-#define INTERMEDIATE_BITS 16  // PNG bit depth (can only be 8 or 16, and 8 is insufficient for HDR)
-#define TARGET_BITS 10  // quantization bit depth
-
-#define MAXCLL_PERCENTILE 0.9999  // comment out to calculate true MaxCLL instead of top percentile
-
-
-static const XMVECTOR vm1 = XMVectorReplicate(1305.0f / 8192.0f);
-static const XMVECTOR vm2 = XMVectorReplicate(2523.0f / 32.0f);
-static const XMVECTOR vc1 = XMVectorReplicate(107.0f / 128.0f);
-static const XMVECTOR vc2 = XMVectorReplicate(2413.0f / 128.0f);
-static const XMVECTOR vc3 = XMVectorReplicate(2392.0f / 128.0f);
-
-inline XMVECTOR pq_inv_eotf(XMVECTOR y) {
-    XMVECTOR pow1 = XMVectorPow(y, vm1);
-    return XMVectorPow(
-            XMVectorDivide(
-                    XMVectorAdd(vc1, XMVectorMultiply(vc2, pow1)),
-                    XMVectorAdd(g_XMOne, XMVectorMultiply(vc3, pow1))),
-            vm2);
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <sys/stat.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef _WIN32
+// Converts the wide command line to UTF-8, so paths outside of the ANSI code page survive
+static char **utf8_args(int *argc) {
+    LPWSTR *szArglist;
+    int nArgs;
+
+    szArglist = CommandLineToArgvW(GetCommandLineW(), &nArgs);
+    if (nullptr == szArglist) {
+        return nullptr;
+    }
+
+    auto args = (char **) malloc(sizeof(char *) * nArgs);
+    if (args == nullptr) {
+        return nullptr;
+    }
+
+    for (int i = 0; i < nArgs; i++) {
+        int len = WideCharToMultiByte(CP_UTF8, 0, szArglist[i], -1, nullptr, 0, nullptr, nullptr);
+        args[i] = (char *) malloc(len);
+        if (args[i] == nullptr) {
+            return nullptr;
+        }
+        WideCharToMultiByte(CP_UTF8, 0, szArglist[i], -1, args[i], len, nullptr, nullptr);
+    }
+
+    LocalFree(szArglist);
+    *argc = nArgs;
+    return args;
 }
 
-static const XMMATRIX scrgb_to_bt2100 = {
-        {2939026994.L / 585553224375.L,  76515593.L / 138420033750.L,   12225392.L / 93230009375.L,      0},
-        {9255011753.L / 3513319346250.L, 6109575001.L / 830520202500.L, 1772384008.L / 2517210253125.L,  0},
-        {173911579.L / 501902763750.L,   75493061.L / 830520202500.L,   18035212433.L / 2517210253125.L, 0},
-        {0,                              0,                             0,                               1}};
-
-typedef struct ThreadData {
-    uint8_t *pixels;
-    uint16_t *converted;
-    uint32_t width;
-    uint32_t start;
-    uint32_t stop;
-    double sumOfMaxComp;
-#ifdef MAXCLL_PERCENTILE
-    uint32_t *nitCounts;
 #endif
-    uint16_t maxNits;
-    uint8_t bytesPerColor;
-} ThreadData;
-
-DWORD WINAPI ThreadFunc(LPVOID lpParam) {
-    auto d = (ThreadData *) lpParam;
-    uint8_t *pixels = d->pixels;
-    uint8_t bytesPerColor = d->bytesPerColor;
-    uint16_t *converted = d->converted;
-    uint32_t width = d->width;
-    uint32_t start = d->start;
-    uint32_t stop = d->stop;
-
-    float maxMaxComp = 0;
-    double sumOfMaxComp = 0;
-
-    for (uint32_t i = start; i < stop; i++) {
-        for (uint32_t j = 0; j < width; j++) {
-            XMVECTOR v;
-
-            if (bytesPerColor == 4) {
-                v = XMLoadFloat4A((XMFLOAT4A *) ((FLOAT *) pixels + i * 4 * width + 4 * j));
-            } else {
-                v = XMLoadHalf4((XMHALF4 * )((HALF *) pixels + i * 4 * width + 4 * j));
-            }
 
-            v = XMVectorSaturate(XMVector3Transform(v, scrgb_to_bt2100));
+static bool has_extension(const char *path, const char *ext) {
+    size_t len = strlen(path);
+    size_t extLen = strlen(ext);
+    if (len <= extLen) {
+        return false;
+    }
+    for (size_t i = 0; i < extLen; i++) {
+        char c = path[len - extLen + i];
+        if (c >= 'A' && c <= 'Z') {
+            c = (char) (c - 'A' + 'a');
+        }
+        if (c != ext[i]) {
+            return false;
+        }
+    }
+    return true;
+}
 
-            auto bt2020 = XMFLOAT4A();
+// Reads a pipe until its end
+static uint8_t *read_input(FILE *f, size_t *size) {
+    size_t capacity = 1 << 20;
+    size_t used = 0;
+    auto data = (uint8_t *) malloc(capacity);
 
-            XMStoreFloat4A(&bt2020, v);
+    while (data) {
+        used += fread(data + used, 1, capacity - used, f);
+        if (used < capacity) {
+            break;
+        }
+        capacity *= 2;
+        auto grown = (uint8_t *) realloc(data, capacity);
+        if (grown == nullptr) {
+            free(data);
+        }
+        data = grown;
+    }
 
-            float maxComp = max(bt2020.x, max(bt2020.y, bt2020.z));
+    if (data && ferror(f)) {
+        free(data);
+        data = nullptr;
+    }
 
-#ifdef MAXCLL_PERCENTILE
-            auto nits = (uint32_t) roundf(maxComp * 10000);
-            d->nitCounts[nits]++;
-#endif
-            if (maxComp > maxMaxComp) {
-                maxMaxComp = maxComp;
-            }
+    *size = used;
+    return data;
+}
 
-            sumOfMaxComp += maxComp;
+typedef struct OutputFile {
+    FILE *f;
+    size_t bytes;
+} OutputFile;
 
-            const auto maxTarget = (float) ((1 << TARGET_BITS) - 1);
+static int stream_write(void *user, const void *data, size_t size) {
+    auto out = (OutputFile *) user;
+    out->bytes += size;
+    return fwrite(data, 1, size, out->f) != size;
+}
 
-            __m128i vint = _mm_cvtps_epi32(XMVectorMultiply(pq_inv_eotf(v), XMVectorReplicate(maxTarget)));
+static int stream_flush(void *user) {
+    return fflush(((OutputFile *) user)->f);
+}
 
-            vint = _mm_slli_epi32(vint, INTERMEDIATE_BITS - TARGET_BITS);
+static const char *trace_file;
 
-            __m128i vshort = _mm_packus_epi32(vint, vint);
+// Registered with atexit, so failed conversions leave a trace as well
+static void write_trace() {
+    jxr_trace_stop();
 
-            const __m128i reverse_endian_mask = _mm_set_epi8(
-                    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 4, 5, 2, 3, 0, 1);
-            vshort = _mm_shuffle_epi8(vshort, reverse_endian_mask);
+    FILE *f = fopen(trace_file, "wb");
+    if (f == nullptr) {
+        perror("Error opening trace file");
+        return;
+    }
 
-            uint16_t *dst = &converted[(size_t) 3 * width * i + (size_t) 3 * j];
+    OutputFile out = {f, 0};
+    jxr_stream stream = {stream_write, stream_flush, &out, nullptr};
+    jxr_status status = jxr_trace_write(&stream);
+    if (fclose(f) || status != JXR_OK) {
+        fprintf(stderr, "Failed to write trace file\n");
+    }
+}
 
-            uint16_t result[4];
-            _mm_storel_epi64((__m128i *) result, vshort);
-            memcpy(dst, result, 3 * sizeof(uint16_t));
-        }
+#ifndef _WIN32
+// The header chunks go out in one system call
+static int stream_writev(void *user, const jxr_iovec *parts, uint32_t count) {
+    auto out = (OutputFile *) user;
+    if (fflush(out->f) || count > JXR_MAX_IOVECS) {
+        return 1;
     }
 
-    d->maxNits = (uint16_t) roundf(maxMaxComp * 10000);
-    d->sumOfMaxComp = sumOfMaxComp;
+    struct iovec iov[JXR_MAX_IOVECS];
+    for (uint32_t i = 0; i < count; i++) {
+        iov[i].iov_base = (void *) parts[i].data;
+        iov[i].iov_len = parts[i].size;
+        out->bytes += parts[i].size;
+    }
 
+    struct iovec *next = iov;
+    while (count) {
+        ssize_t n = writev(fileno(out->f), next, (int) count);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return 1;
+        }
+        while (count && (size_t) n >= next->iov_len) {
+            n -= (ssize_t) next->iov_len;
+            next++;
+            count--;
+        }
+        if (count) {
+            next->iov_base = (uint8_t *) next->iov_base + n;
+            next->iov_len -= (size_t) n;
+        }
+    }
     return 0;
 }
+#endif
 
-int write_png_file(FILE *file, png_bytep data, uint32_t width, uint32_t height, uint32_t maxCLL, uint32_t maxFALL) {
-    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
-    if (!png) {
-        fprintf(stderr, "Could not create PNG write struct\n");
-        return 1;
+static const char *const format_extensions[] = {"png", "ppm", "pam"};
+
+// Output file name for an input: its file name with the format's extension, inside dir if given
+static char *output_name(const char *inputFile, const char *dir, jxr_output_format format) {
+    const char *inputName = inputFile;
+    for (const char *p = inputFile; *p; p++) {
+        if (*p == '/' || *p == '\\') {
+            inputName = p + 1;
+        }
     }
 
-    png_infop info = png_create_info_struct(png);
-    if (!info) {
-        fprintf(stderr, "Could not create PNG info struct\n");
-        return 1;
+    size_t dirLen = dir ? strlen(dir) + 1 : 0;
+    size_t len = strlen(inputName);
+    auto outputFile = (char *) malloc(dirLen + len + 1);
+    if (outputFile == nullptr) {
+        return nullptr;
+    }
+
+    if (dir) {
+        memcpy(outputFile, dir, dirLen - 1);
+        outputFile[dirLen - 1] = '/';
+    }
+    memcpy(outputFile + dirLen, inputName, len - 3);
+    memcpy(outputFile + dirLen + len - 3, format_extensions[format], 4);
+    return outputFile;
+}
+
+// Where the calibration for --time-budget is kept between runs
+static const char *calibration_path(char *buf, size_t size) {
+#ifdef _WIN32
+    const char *dir = getenv("LOCALAPPDATA");
+    const char *sub = "";
+#else
+    const char *dir = getenv("XDG_CACHE_HOME");
+    const char *sub = "";
+    if (dir == nullptr || !dir[0]) {
+        dir = getenv("HOME");
+        sub = "/.cache";
     }
+#endif
+    if (dir == nullptr || !dir[0]) {
+        return nullptr;
+    }
+    snprintf(buf, size, "%s%s/jxr_to_png_calibration.txt", dir, sub);
+    return buf;
+}
 
-    if (setjmp(png_jmpbuf(png))) {
-        fprintf(stderr, "Error during PNG creation\n");
+// A cost read as nan, inf or zero would make every prediction fit or none, so it is measured again.
+// The exponent is tested directly, as -ffast-math lets comparisons assume there are no nans.
+static bool valid_cost(double v) {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return (bits >> 52 & 0x7ff) != 0x7ff && v > 0;
+}
+
+static int load_calibration(const char *path, jxr_calibration *c) {
+    FILE *f = fopen(path, "r");
+    if (f == nullptr) {
         return 1;
     }
 
-    png_init_io(png, file);
+    int version = 0;
+    int fields = fscanf(f, "jxr_to_png calibration %d threads %u speedup %lf convert %lf", &version, &c->threads,
+                        &c->parallel_speedup, &c->convert_ns);
+    for (int s = 0; s < JXR_BUDGET_SETTINGS; s++) {
+        fields += fscanf(f, " setting %*d filter %lf deflate %lf", &c->filter_ns[s], &c->deflate_ns[s]);
+    }
 
-    png_set_IHDR(
-            png, info, width, height, 16, PNG_COLOR_TYPE_RGB,
-            PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT
-    );
+    fclose(f);
+    if (version != 1 || fields != 4 + 2 * JXR_BUDGET_SETTINGS || c->threads == 0 || !valid_cost(c->parallel_speedup) ||
+        !valid_cost(c->convert_ns)) {
+        return 1;
+    }
+    for (int s = 0; s < JXR_BUDGET_SETTINGS; s++) {
+        if (!valid_cost(c->filter_ns[s]) || !valid_cost(c->deflate_ns[s])) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    uint8_t cicp_data[4] = {9, 16, 0, 1};
+// Creates the directories leading up to path, as a fresh home may not have ~/.cache yet
+static void create_parent_dirs(const char *path) {
+#ifndef _WIN32
+    char dir[4096];
+    if (strlen(path) >= sizeof(dir)) {
+        return;
+    }
+    strcpy(dir, path);
+    for (char *p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = 0;
+        mkdir(dir, 0700);
+        *p = '/';
+    }
+#else
+    (void) path;
+#endif
+}
 
-    uint8_t clli_data[8] = {
-            (uint8_t) ((maxCLL >> 24) & 0xFF),
-            (uint8_t) ((maxCLL >> 16) & 0xFF),
-            (uint8_t) ((maxCLL >> 8) & 0xFF),
-            (uint8_t) (maxCLL & 0xFF),
-            (uint8_t) ((maxFALL >> 24) & 0xFF),
-            (uint8_t) ((maxFALL >> 16) & 0xFF),
-            (uint8_t) ((maxFALL >> 8) & 0xFF),
-            (uint8_t) (maxFALL & 0xFF),
-    };
+static int save_calibration(const char *path, const jxr_calibration *c) {
+    create_parent_dirs(path);
+    FILE *f = fopen(path, "w");
+    if (f == nullptr) {
+        return 1;
+    }
 
-    png_unknown_chunk unknown_chunks[] = {
-            {.name = {'c', 'I', 'C', 'P'}, .data = cicp_data, .size = 4, .location = PNG_HAVE_IHDR},
-            {.name = {'c', 'L', 'L', 'i'}, .data = clli_data, .size = 8, .location = PNG_HAVE_IHDR}
-    };
+    fprintf(f, "jxr_to_png calibration 1\nthreads %u\nspeedup %.3f\nconvert %.4f\n", c->threads, c->parallel_speedup,
+            c->convert_ns);
+    for (int s = 0; s < JXR_BUDGET_SETTINGS; s++) {
+        fprintf(f, "setting %d filter %.4f deflate %.4f\n", s, c->filter_ns[s], c->deflate_ns[s]);
+    }
+    return fclose(f) != 0;
+}
 
-    int num_unknowns = sizeof(unknown_chunks) / sizeof(unknown_chunks[0]);
+// Loads the calibration for this thread count, or measures and stores a new one
+static int prepare_calibration(const char *path, bool force, const jxr_options *options, jxr_calibration *c) {
+    if (!force && path && !load_calibration(path, c) && c->threads == options->threading.num_threads) {
+        return 0;
+    }
 
-    for (int i = 0; i < num_unknowns; i++) {
-        png_set_keep_unknown_chunks(png, PNG_HANDLE_CHUNK_ALWAYS, unknown_chunks[i].name, 1);
-        png_set_unknown_chunks(png, info, &unknown_chunks[i], 1);
+    fprintf(stderr, "Calibrating for %u threads...\n", options->threading.num_threads);
+    if (jxr_calibrate(options, c) != JXR_OK) {
+        fprintf(stderr, "Calibration failed\n");
+        return 1;
     }
 
-    png_set_iCCP(png, info, icc_name, PNG_COMPRESSION_TYPE_BASE, icc_data, sizeof(icc_data));
+    if (path == nullptr || save_calibration(path, c)) {
+        fprintf(stderr, "Could not store the calibration%s%s\n", path ? " in " : "", path ? path : "");
+    }
+    return 0;
+}
 
-    png_set_cHRM_fixed(png, info, 31270, 32900, 70800, 29200, 17000, 79700, 13100, 4600);
+static void report_budget(FILE *log, const char *name, const jxr_result *result, uint32_t extraMs,
+                          uint32_t budgetMs, bool verbose) {
+    uint32_t elapsed = result->elapsed_ms + extraMs;
+    if (elapsed > budgetMs) {
+        fprintf(stderr, "%s: time budget missed, %u ms of %u ms\n", name, elapsed, budgetMs);
+    } else if (verbose) {
+        fprintf(log, "%s: %u ms of %u ms time budget\n", name, elapsed, budgetMs);
+    }
+}
 
-    png_color_8 sig_bit = {.red = TARGET_BITS, .green = TARGET_BITS, .blue = TARGET_BITS};
-    png_set_sBIT(png, info, &sig_bit);
+static void report_quality(FILE *log, const char *name, const jxr_result *result) {
+    const jxr_quality *q = &result->quality;
+    fprintf(log, "%s: dE-ITP mean %.3f, max %.2f, PSNR-PQ %.2f dB, max code error %.2f (%llu pixels)\n", name,
+            q->delta_e_itp_mean, q->delta_e_itp_max, q->psnr_pq, q->max_code_error, (unsigned long long) q->pixels);
+}
 
-    png_write_info(png, info);
+// Peak bytes by category, with the process peak RSS when it is known
+static void report_memory(FILE *log, const char *name, const char *what, const jxr_memory_usage *usage) {
+    const double mb = 1.0 / (1 << 20);
+    fprintf(log, "%s: %s %.1f MB (input %.1f, output frame %.1f, histograms %.2f, encoder %.1f, output %.1f, "
+                 "other %.2f, input files %.1f)", name, what, usage->peak_total * mb,
+            usage->peak[JXR_MEMORY_INPUT_FRAME] * mb, usage->peak[JXR_MEMORY_OUTPUT_FRAME] * mb,
+            usage->peak[JXR_MEMORY_HISTOGRAMS] * mb, usage->peak[JXR_MEMORY_ENCODER] * mb,
+            usage->peak[JXR_MEMORY_OUTPUT] * mb, usage->peak[JXR_MEMORY_OTHER] * mb,
+            usage->peak[JXR_MEMORY_CALLER] * mb);
+    if (usage->peak_rss) {
+        fprintf(log, ", peak RSS %.1f MB", usage->peak_rss * mb);
+    }
+    fputc('\n', log);
+}
 
-    auto *row_pointers = (png_bytep *) malloc(sizeof(png_bytep) * height);
-    if (row_pointers == nullptr) {
-        fprintf(stderr, "Failed to allocate PNG row pointers\n");
-        return 1;
+// Name a result is written under before it replaces the output
+static char *temp_name(const char *outputFile) {
+    size_t len = strlen(outputFile);
+    auto name = (char *) malloc(len + 5);
+    if (name) {
+        memcpy(name, outputFile, len);
+        memcpy(name + len, ".tmp", 5);
     }
+    return name;
+}
+
+// Size of an existing output if it is a complete PNG, 0 otherwise
+static size_t existing_png_size(const char *path) {
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    static const uint8_t iend[12] = {0, 0, 0, 0, 'I', 'E', 'N', 'D', 0xae, 0x42, 0x60, 0x82};
 
-    for (uint32_t y = 0; y < height; y++) {
-        row_pointers[y] = data + (size_t) y * width * 6; // 6 bytes per pixel for RGB16
+    MappedFile in;
+    if (map_input(path, &in)) {
+        return 0;
     }
 
-    png_write_image(png, row_pointers);
-    png_write_end(png, nullptr);
+    size_t size = in.size;
+    if (size < sizeof(signature) + sizeof(iend) || memcmp(in.data, signature, sizeof(signature)) ||
+        memcmp(in.data + size - sizeof(iend), iend, sizeof(iend))) {
+        size = 0;
+    }
 
-    return 0;
+    unmap_input(&in);
+    return size;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2 && argc != 3) {
-        fprintf(stderr, "jxr_to_png input.jxr [output.png]\n");
+// In optimize mode results are written next to the output and only replace it when they are
+// smaller than a complete PNG already there, so runs can be repeated and interrupted safely.
+// Returns 1 if the output could not be replaced, replaced tells whether the new result was used.
+static int keep_smaller(const char *tempFile, const char *outputFile, size_t size, FILE *log, bool *replaced) {
+    size_t existing = existing_png_size(outputFile);
+    *replaced = !existing || existing > size;
+
+    if (!*replaced) {
+        remove_file(tempFile);
+        fprintf(log, "%s: kept existing %zu bytes, new result is %zu bytes\n", outputFile, existing, size);
+    } else if (replace_file(tempFile, outputFile)) {
+        fprintf(stderr, "%s: Failed to replace output file\n", outputFile);
+        remove_file(tempFile);
         return 1;
     }
+    return 0;
+}
 
-    LPWSTR inputFile, outputFile;
+// Reports a landed write and moves an optimized result over its output, returns 1 on failure
+static int finish_write(const IoRequest *write, const char *input, char *pending) {
+    int failed = write->error != 0;
+    if (failed) {
+        fprintf(stderr, "%s: Failed to write output file (%s)\n", input, strerror(write->error));
+    }
 
-    {
-        LPWSTR *szArglist;
-        int nArgs;
+    if (pending) {
+        char *tempFile = temp_name(pending);
+        if (tempFile && (failed || replace_file(tempFile, pending))) {
+            if (!failed) {
+                fprintf(stderr, "%s: Failed to replace output file\n", pending);
+                failed = 1;
+            }
+            remove_file(tempFile);
+        }
+        free(tempFile);
+        free(pending);
+    }
+    return failed;
+}
 
-        szArglist = CommandLineToArgvW(GetCommandLineW(), &nArgs);
-        if (nullptr == szArglist) {
-            fprintf(stderr, "CommandLineToArgvW failed\n");
+// Converts many files, reading upcoming inputs and writing finished outputs asynchronously so the
+// conversion threads only wait for I/O when an input has not arrived yet. Inputs, outputs and the
+// library's buffers come from one pool, so after the first few files nothing is allocated anew.
+static int convert_batch(char **inputs, int count, const char *outputDir, bool allowUring, bool verbose,
+                         bool memory, uint64_t poolMB, TimingsFormat timings, jxr_options options) {
+    jxr_buffer_pool *buffers = nullptr;
+    if (poolMB) {
+        buffers = jxr_buffer_pool_create(poolMB << 20, (uint64_t) POOL_MIN_AVAILABLE_MB << 20);
+        if (buffers == nullptr) {
+            fprintf(stderr, "Failed to create buffer pool\n");
             return 1;
         }
+    }
+    options.buffer_pool = buffers;
+    jxr_allocator readBuffers = {jxr_buffer_pool_alloc, jxr_buffer_pool_realloc, jxr_buffer_pool_free, buffers};
 
-        inputFile = szArglist[1];
+    AsyncIO *aio = aio_create(64, allowUring, buffers ? &readBuffers : nullptr);
+    if (aio == nullptr) {
+        fprintf(stderr, "Failed to create I/O engine\n");
+        return 1;
+    }
 
-        if (!PathMatchSpecW(inputFile, L"*.jxr")) {
-            fprintf(stderr, "Input must be .jxr file\n");
-            return 1;
+    auto reads = (IoRequest *) calloc(count, sizeof(IoRequest));
+    auto readErrors = (int *) calloc(count, sizeof(int));
+    auto writes = (IoRequest *) calloc(count, sizeof(IoRequest));
+    auto outputs = (jxr_buffer *) calloc(count, sizeof(jxr_buffer));
+    auto pending = (char **) calloc(count, sizeof(char *));  // outputs to replace once written
+
+    if (reads == nullptr || readErrors == nullptr || writes == nullptr || outputs == nullptr || pending == nullptr) {
+        fprintf(stderr, "Failed to allocate batch state\n");
+        return 1;
+    }
+
+    options.threading.num_threads = jxr_default_threads();
+    printf("Using %d threads\n", options.threading.num_threads);
+
+    int failures = 0;
+    int submitted = 0;
+
+    for (int i = 0; i < count; i++) {
+        for (; submitted < count && submitted <= i + BATCH_READAHEAD; submitted++) {
+            readErrors[submitted] = aio_read_file(aio, inputs[submitted], &reads[submitted]);
         }
 
-        if (argc == 3) {
-            outputFile = szArglist[2];
-        } else {
-            auto inputName = PathFindFileNameW(inputFile);
-            size_t len = wcslen(inputName);
-            outputFile = (LPWSTR) malloc((len + 1) * sizeof(wchar_t));
-            if (outputFile == nullptr) {
-                fprintf(stderr, "Failed to allocate output name\n");
-                return 1;
-            }
-            memcpy(outputFile, inputName, (len - 3) * sizeof(wchar_t));
-            memcpy(outputFile + len - 3, L"png", 4 * sizeof(wchar_t));
+        double traceBegin = jxr_trace_begin();
+        int error = readErrors[i] ? readErrors[i] : aio_wait(aio, &reads[i]);
+        jxr_trace_end("wait for input", i, traceBegin);
+        if (error) {
+            fprintf(stderr, "%s: Failed to read input file (%s)\n", inputs[i], strerror(error));
+            aio_free_data(aio, reads[i].data);
+            failures++;
+            continue;
         }
-    }
 
-    // Create a decoder
-    IWICBitmapDecoder *pDecoder = nullptr;
+        outputs[i].growable = 1;
 
-    // Initialize COM
-    CoInitialize(nullptr);
+        // Outputs waiting to be written stay counted, the peak is what this conversion adds on top
+        jxr_memory_usage_reset();
 
-    // The factory pointer
-    IWICImagingFactory *pFactory = nullptr;
+        jxr_result result;
+        jxr_status status = jxr_convert_memory(reads[i].data, reads[i].size, &options, &outputs[i], &result);
 
-    // Create the COM imaging factory
-    HRESULT hr = CoCreateInstance(
-            CLSID_WICImagingFactory,
-            nullptr,
-            CLSCTX_INPROC_SERVER,
-            IID_IWICImagingFactory,
-            (void **) &pFactory);
+        aio_free_data(aio, reads[i].data);
 
-    if (FAILED(hr)) {
-        fprintf(stderr, "Failed to create WIC imaging factory\n");
-        return 1;
+        if (status != JXR_OK) {
+            fprintf(stderr, "%s: %s\n", inputs[i], result.error ? result.error : jxr_status_string(status));
+            jxr_buffer_free(&options, &outputs[i]);
+            failures++;
+            continue;
+        }
+
+        char *outputFile = output_name(inputs[i], outputDir, options.format);
+        if (outputFile == nullptr) {
+            fprintf(stderr, "%s: Failed to allocate output file name\n", inputs[i]);
+            jxr_buffer_free(&options, &outputs[i]);
+            failures++;
+            continue;
+        }
+
+        printf("%s: %u MaxCLL, %u MaxFALL, %zu bytes\n", inputs[i], result.max_cll, result.max_fall,
+               outputs[i].size);
+        if (verbose && result.compression[0]) {
+            printf("%s: compression %s\n", inputs[i], result.compression);
+        }
+        if (options.time_budget_ms) {
+            report_budget(stdout, inputs[i], &result, 0, options.time_budget_ms, verbose);
+        }
+        if (options.quality) {
+            report_quality(stdout, inputs[i], &result);
+        }
+        if (memory) {
+            jxr_memory_usage usage;
+            jxr_memory_usage_get(&usage);
+            report_memory(stdout, inputs[i], "peak memory", &usage);
+        }
+        if (timings) {
+            print_timings(stdout, timings, options.counters, inputs[i], &result);
+        }
+
+        const char *target = outputFile;
+        if (options.optimize) {
+            size_t existing = existing_png_size(outputFile);
+            if (existing && existing <= outputs[i].size) {
+                printf("%s: kept existing %zu bytes\n", outputFile, existing);
+                jxr_buffer_free(&options, &outputs[i]);
+                free(outputFile);
+                continue;
+            }
+            pending[i] = outputFile;
+            target = outputFile = temp_name(outputFile);
+        }
+
+        error = target ? aio_write_file(aio, target, outputs[i].data, outputs[i].size, &writes[i]) : ENOMEM;
+        if (error) {
+            fprintf(stderr, "%s: Failed to write output file (%s)\n", inputs[i], strerror(error));
+            jxr_buffer_free(&options, &outputs[i]);
+            free(pending[i]);
+            pending[i] = nullptr;
+            failures++;
+        }
+        free(outputFile);
+
+        // Release outputs whose writes have landed
+        for (int j = 0; j <= i; j++) {
+            if (outputs[j].data && aio_poll(aio, &writes[j])) {
+                failures += finish_write(&writes[j], inputs[j], pending[j]);
+                pending[j] = nullptr;
+                jxr_buffer_free(&options, &outputs[j]);
+            }
+        }
     }
 
-    hr = pFactory->CreateDecoderFromFilename(
-            inputFile,                       // Image to be decoded
-            nullptr,                            // Do not prefer a particular vendor
-            GENERIC_READ,                    // Desired read access to the file
-            WICDecodeMetadataCacheOnDemand,  // Cache metadata when needed
-            &pDecoder                        // Pointer to the decoder
-    );
+    for (int j = 0; j < count; j++) {
+        if (outputs[j].data) {
+            double traceBegin = jxr_trace_begin();
+            aio_wait(aio, &writes[j]);
+            jxr_trace_end("wait for output", j, traceBegin);
+            failures += finish_write(&writes[j], inputs[j], pending[j]);
+            pending[j] = nullptr;
+            jxr_buffer_free(&options, &outputs[j]);
+        }
+    }
 
-    if (FAILED(hr)) {
-        fprintf(stderr, "Failed to open input file\n");
-        return 1;
+    AioStats stats;
+    aio_stats(aio, &stats);
+    printf("I/O (%s): %llu transfers, %llu MB in %llu operations and %llu submissions, queue depth %.1f average, "
+           "%u max, %.1f ms waiting\n", stats.backend, (unsigned long long) stats.requests,
+           (unsigned long long) (stats.bytes >> 20), (unsigned long long) stats.operations,
+           (unsigned long long) stats.submitCalls, stats.averageDepth, stats.maxDepth, stats.waitSeconds * 1000);
+
+    aio_destroy(aio);
+
+    if (buffers) {
+        jxr_buffer_pool_stats pool;
+        jxr_buffer_pool_stats_get(buffers, &pool);
+        printf("Buffer pool: %llu allocations reused, %llu new, %llu MB idle in %llu buffers, %llu MB released\n",
+               (unsigned long long) pool.hits, (unsigned long long) pool.misses,
+               (unsigned long long) (pool.idle_bytes >> 20), (unsigned long long) pool.idle_buffers,
+               (unsigned long long) (pool.released_bytes >> 20));
+        jxr_buffer_pool_destroy(buffers);
     }
 
-    // Retrieve the first frame of the image from the decoder
-    IWICBitmapFrameDecode *pFrame = nullptr;
+    printf("Converted %d of %d files\n", count - failures, count);
+    return failures != 0;
+}
 
-    hr = pDecoder->GetFrame(0, &pFrame);
+static void usage() {
+    fprintf(stderr, "jxr_to_png [options] input.jxr [output.png]\n"
+                    "jxr_to_png --batch [-o output_dir] [--no-uring] [options] input.jxr...\n"
+                    "Use - as input or output for stdin/stdout.\n"
+                    "Options:\n"
+                    "  --filter policy  PNG row filters: exhaustive (default), fast, entropy, or one of\n"
+                    "                   none, sub, up, average, paeth for every row\n"
+                    "  --idat-size KB   compressed data per IDAT chunk, 256 by default\n"
+                    "  --screen         faster compression for desktop screenshots, see README\n"
+                    "  --fast-decode    output that viewers decode faster, see README\n"
+                    "  --stored         no filtering or compression, for consumers that decode right away\n"
+                    "  --format fmt     png (default), or 16-bit ppm or pam, also picked by the output\n"
+                    "                   file's extension\n"
+                    "  --level N        zlib compression level 1-9, 6 by default\n"
+                    "  --strategy name  zlib strategy: default, filtered or rle\n"
+                    "  --window-bits N  zlib window of 2^N bytes, 9-15, 15 by default\n"
+                    "  --mem-level N    zlib hash table memory 1-9, 8 by default\n"
+                    "  --auto [PCT]     pick filters and compression per image by sampling, favouring\n"
+                    "                   speed when within PCT percent (default 5) of the smallest size\n"
+                    "  --optimize       try every filter and zlib strategy at maximum effort and keep the\n"
+                    "                   smallest, slow; existing smaller outputs are kept\n"
+                    "  --quality [N]    compare the output with the source on every Nth row (default 8):\n"
+                    "                   dE-ITP, PSNR of the PQ signal and the largest code error\n"
+                    "  --no-huge-pages  keep frame buffers on 4 KB pages\n"
+                    "  --row-padding N  bytes added to decoded rows that are a multiple of 4 KB long,\n"
+                    "                   128 by default, -1 for none\n"
+                    "  --prefault       touch new frame buffers on all threads before they are used\n"
+                    "  --pool MB        keep up to MB of freed buffers for the next file in batch mode,\n"
+                    "                   2048 by default, 0 to allocate every buffer anew\n"
+                    "  --memory         print the estimated and measured peak memory by category\n"
+                    "  --skip-existing  skip inputs whose output is already a complete PNG\n"
+                    "  --time-budget MS pick the strongest compression and fewest threads expected to\n"
+                    "                   finish within MS milliseconds, using a calibration of this host\n"
+                    "  --calibrate      measure the calibration again (runs alone without inputs)\n"
+                    "  --calibration F  file the calibration is kept in\n"
+                    "  --trace F        write a Chrome trace of every thread's activity to F, for Perfetto\n"
+                    "  --timings [fmt]  print wall and CPU time per stage, as text (default) or json\n"
+                    "  --counters       add hardware counters per stage and thread to --timings, Linux only\n"
+                    "  -v               print the settings picked by --auto, --optimize or --time-budget\n");
+}
 
-    if (FAILED(hr)) {
-        fprintf(stderr, "Failed to get frame\n");
-        return 1;
+static const char *const filter_names[] = {"none", "sub", "up", "average", "paeth"};
+
+static bool parse_filter(const char *name, jxr_options *options) {
+    if (!strcmp(name, "exhaustive")) {
+        options->filter_policy = JXR_FILTER_EXHAUSTIVE;
+        return true;
+    }
+    if (!strcmp(name, "fast")) {
+        options->filter_policy = JXR_FILTER_FAST;
+        return true;
     }
+    if (!strcmp(name, "entropy")) {
+        options->filter_policy = JXR_FILTER_ENTROPY;
+        return true;
+    }
+    for (int i = 0; i < 5; i++) {
+        if (!strcmp(name, filter_names[i])) {
+            options->filter_policy = JXR_FILTER_FIXED;
+            options->filter_type = (jxr_png_filter) i;
+            return true;
+        }
+    }
+    return false;
+}
 
-    IWICBitmapSource *pBitmapSource = nullptr;
+static bool parse_strategy(const char *name, jxr_options *options) {
+    static const char *const names[] = {"default", "filtered", "rle"};
+    for (int i = 0; i < 3; i++) {
+        if (!strcmp(name, names[i])) {
+            options->strategy = (jxr_strategy) (JXR_STRATEGY_DEFAULT + i);
+            return true;
+        }
+    }
+    return false;
+}
 
-    hr = pFrame->QueryInterface(IID_IWICBitmapSource, (void **) &pBitmapSource);
+static bool parse_format(const char *name, jxr_options *options) {
+    for (int i = 0; i < 3; i++) {
+        if (!strcmp(name, format_extensions[i])) {
+            options->format = (jxr_output_format) i;
+            return true;
+        }
+    }
+    return false;
+}
 
-    if (FAILED(hr)) {
-        fprintf(stderr, "Failed to get IWICBitmapSource\n");
+int main(int argc, char *argv[]) {
+#ifdef _WIN32
+    argv = utf8_args(&argc);
+    if (argv == nullptr) {
+        fprintf(stderr, "CommandLineToArgvW failed\n");
         return 1;
     }
+#endif
 
-    WICPixelFormatGUID pixelFormat;
+    bool batch = false;
+    bool allowUring = true;
+    bool verbose = false;
+    bool skipExisting = false;
+    bool calibrate = false;
+    bool formatGiven = false;
+    bool memory = false;
+    uint64_t poolMB = DEFAULT_POOL_MB;
+    TimingsFormat timings = TIMINGS_OFF;
+    const char *outputDir = nullptr;
+    const char *calibrationFile = nullptr;
+    char defaultCalibration[4096];
+
+    jxr_options options;
+    jxr_options_init(&options);
+
+    int first = 1;
+    for (; first < argc && argv[first][0] == '-' && argv[first][1]; first++) {
+        if (!strcmp(argv[first], "--batch")) {
+            batch = true;
+        } else if (!strcmp(argv[first], "--no-uring")) {
+            allowUring = false;
+        } else if (!strcmp(argv[first], "-o") && first + 1 < argc) {
+            outputDir = argv[++first];
+        } else if (!strcmp(argv[first], "--level") && first + 1 < argc) {
+            options.level = atoi(argv[++first]);
+        } else if (!strcmp(argv[first], "--window-bits") && first + 1 < argc) {
+            options.window_bits = atoi(argv[++first]);
+        } else if (!strcmp(argv[first], "--mem-level") && first + 1 < argc) {
+            options.mem_level = atoi(argv[++first]);
+        } else if (!strcmp(argv[first], "--strategy") && first + 1 < argc && parse_strategy(argv[first + 1], &options)) {
+            first++;
+        } else if (!strcmp(argv[first], "--auto")) {
+            options.auto_compression = 1;
+            options.auto_tolerance = 5;
+            if (first + 1 < argc && argv[first + 1][0] >= '0' && argv[first + 1][0] <= '9') {
+                options.auto_tolerance = (uint32_t) strtoul(argv[++first], nullptr, 10);
+            }
+        } else if (!strcmp(argv[first], "--quality")) {
+            options.quality = DEFAULT_QUALITY_STEP;
+            if (first + 1 < argc && argv[first + 1][0] >= '0' && argv[first + 1][0] <= '9') {
+                options.quality = (uint32_t) strtoul(argv[++first], nullptr, 10);
+            }
+        } else if (!strcmp(argv[first], "--no-huge-pages")) {
+            options.frame_memory.no_huge_pages = 1;
+        } else if (!strcmp(argv[first], "--row-padding") && first + 1 < argc) {
+            options.frame_memory.row_padding = atoi(argv[++first]);
+        } else if (!strcmp(argv[first], "--prefault")) {
+            options.frame_memory.prefault = 1;
+        } else if (!strcmp(argv[first], "--pool") && first + 1 < argc) {
+            poolMB = strtoull(argv[++first], nullptr, 10);
+        } else if (!strcmp(argv[first], "--memory")) {
+            memory = true;
+        } else if (!strcmp(argv[first], "--optimize")) {
+            options.optimize = 1;
+        } else if (!strcmp(argv[first], "--skip-existing")) {
+            skipExisting = true;
+        } else if (!strcmp(argv[first], "--time-budget") && first + 1 < argc) {
+            options.time_budget_ms = (uint32_t) strtoul(argv[++first], nullptr, 10);
+        } else if (!strcmp(argv[first], "--calibrate")) {
+            calibrate = true;
+        } else if (!strcmp(argv[first], "--calibration") && first + 1 < argc) {
+            calibrationFile = argv[++first];
+        } else if (!strcmp(argv[first], "--trace") && first + 1 < argc) {
+            trace_file = argv[++first];
+        } else if (!strcmp(argv[first], "--counters")) {
+            options.counters = 1;
+        } else if (!strcmp(argv[first], "--timings")) {
+            timings = TIMINGS_TEXT;
+            if (first + 1 < argc && (!strcmp(argv[first + 1], "text") || !strcmp(argv[first + 1], "json"))) {
+                timings = !strcmp(argv[++first], "json") ? TIMINGS_JSON : TIMINGS_TEXT;
+            }
+        } else if (!strcmp(argv[first], "-v")) {
+            verbose = true;
+        } else if (!strcmp(argv[first], "--screen")) {
+            options.deflate = JXR_DEFLATE_SCREEN;
+        } else if (!strcmp(argv[first], "--fast-decode")) {
+            jxr_options_decode_fast(&options);
+        } else if (!strcmp(argv[first], "--stored")) {
+            options.deflate = JXR_DEFLATE_STORED;
+            options.filter_policy = JXR_FILTER_FIXED;
+            options.filter_type = JXR_PNG_FILTER_NONE;
+        } else if (!strcmp(argv[first], "--format") && first + 1 < argc && parse_format(argv[first + 1], &options)) {
+            formatGiven = true;
+            first++;
+        } else if (!strcmp(argv[first], "--idat-size") && first + 1 < argc) {
+            options.idat_size = (uint32_t) strtoul(argv[++first], nullptr, 10) * 1024;
+        } else if (!strcmp(argv[first], "--filter") && first + 1 < argc && parse_filter(argv[first + 1], &options)) {
+            first++;
+        } else {
+            usage();
+            return 1;
+        }
+    }
 
-    hr = pBitmapSource->GetPixelFormat(&pixelFormat);
+    int positional = argc - first;
 
-    if (FAILED(hr)) {
-        fprintf(stderr, "Failed to get pixel format\n");
+    bool calibrateOnly = calibrate && positional == 0;
+    if (!calibrateOnly && (batch ? positional < 1 : ((positional != 1 && positional != 2) || outputDir))) {
+        usage();
         return 1;
     }
 
-    uint8_t bytesPerColor;
+    int inputs = batch || calibrateOnly ? positional : 1;
+    for (int i = first; i < first + inputs; i++) {
+        bool stdio = !batch && !strcmp(argv[i], "-");
+        if (!stdio && !has_extension(argv[i], ".jxr") && !has_extension(argv[i], ".pfm")) {
+            fprintf(stderr, "Input must be .jxr or .pfm file\n");
+            return 1;
+        }
+    }
 
-    if (IsEqualGUID(pixelFormat, GUID_WICPixelFormat128bppRGBAFloat)) {
-        bytesPerColor = 4;
-    } else if (IsEqualGUID(pixelFormat, GUID_WICPixelFormat64bppRGBAHalf)) {
-        bytesPerColor = 2;
-    } else {
-        fprintf(stderr, "Unsupported pixel format\n");
-        return 1;
+    if (options.counters && !timings) {
+        timings = TIMINGS_TEXT;
     }
 
-    uint32_t width, height;
+    if (trace_file) {
+        jxr_trace_start(0);
+        atexit(write_trace);
+    }
 
-    hr = pBitmapSource->GetSize(&width, &height);
+    jxr_calibration calibration;
 
-    if (FAILED(hr)) {
-        fprintf(stderr, "Failed to get size\n");
-        return 1;
+    if (options.time_budget_ms || calibrate) {
+        if (calibrationFile == nullptr) {
+            calibrationFile = calibration_path(defaultCalibration, sizeof(defaultCalibration));
+        }
+        options.threading.num_threads = jxr_default_threads();
+        if (prepare_calibration(calibrationFile, calibrate, &options, &calibration)) {
+            return 1;
+        }
+        options.calibration = &calibration;
+        if (calibrateOnly) {
+            return 0;
+        }
     }
 
-    size_t converted_size = sizeof(uint16_t) * width * height * 3;
-    auto converted = (uint16_t *) malloc(converted_size);
+    if (batch) {
+        char **batchInputs = argv + first;
+        if (skipExisting) {
+            // Inputs are compacted in place, the list only shrinks
+            int kept = 0;
+            for (int i = 0; i < positional; i++) {
+                char *name = output_name(batchInputs[i], outputDir, options.format);
+                if (name && existing_png_size(name)) {
+                    printf("%s: output exists, skipped\n", batchInputs[i]);
+                } else {
+                    batchInputs[kept++] = batchInputs[i];
+                }
+                free(name);
+            }
+            if (kept == 0) {
+                return 0;
+            }
+            positional = kept;
+        }
+        return convert_batch(batchInputs, positional, outputDir, allowUring, verbose, memory, poolMB, timings, options);
+    }
 
-    if (converted == nullptr) {
-        fprintf(stderr, "Failed to allocate converted pixels\n");
-        return 1;
+    const char *inputFile = argv[first];
+    char *outputFile;
+
+    bool fromStdin = !strcmp(inputFile, "-");
+
+    if (positional == 2) {
+        outputFile = argv[first + 1];
+        for (int i = 1; i < 3 && !formatGiven; i++) {
+            char ext[5] = {'.'};
+            memcpy(ext + 1, format_extensions[i], 4);
+            if (has_extension(outputFile, ext)) {
+                options.format = (jxr_output_format) i;
+            }
+        }
+    } else if (fromStdin) {
+        outputFile = (char *) "-";
+    } else {
+        outputFile = output_name(inputFile, nullptr, options.format);
+        if (outputFile == nullptr) {
+            fprintf(stderr, "Failed to allocate output name\n");
+            return 1;
+        }
     }
 
-    SYSTEM_INFO systemInfo;
-    GetSystemInfo(&systemInfo);
-    uint32_t numThreads = min(8, systemInfo.dwNumberOfProcessors / 2);
-    printf("Using %d threads\n", numThreads);
+    bool toStdout = !strcmp(outputFile, "-");
 
-    puts("Converting pixels to BT.2100 PQ...");
+    if (skipExisting && !toStdout && existing_png_size(outputFile)) {
+        printf("%s exists, skipped\n", outputFile);
+        return 0;
+    }
 
-    uint16_t maxCLL, maxPALL;
+    // Progress messages must not end up in the PNG when it goes to stdout
+    FILE *log = toStdout ? stderr : stdout;
 
-    {
+#ifdef _WIN32
+    if (fromStdin) {
+        _setmode(_fileno(stdin), _O_BINARY);
+    }
+    if (toStdout) {
+        _setmode(_fileno(stdout), _O_BINARY);
+    }
+#endif
 
-        UINT cbStride = width * bytesPerColor * 4;
-        UINT cbBufferSize = cbStride * height;
+    jxr_image image;
+    jxr_result result;
+    jxr_status status;
 
-        auto pixels = (uint8_t *) malloc(cbBufferSize);
+    auto decodeStart = std::chrono::steady_clock::now();
 
-        if (pixels == nullptr) {
-            fprintf(stderr, "Failed to allocate float pixels\n");
+    if (fromStdin) {
+        size_t inputSize;
+        double traceBegin = jxr_trace_begin();
+        uint8_t *input = read_input(stdin, &inputSize);
+        jxr_trace_end("read input", -1, traceBegin);
+
+        if (input == nullptr) {
+            fprintf(stderr, "Failed to read input file\n");
             return 1;
         }
 
-        WICRect rc;
-        rc.Y = 0;
-        rc.X = 0;
-        rc.Width = (int) width;
-        rc.Height = (int) height;
-        hr = pBitmapSource->CopyPixels(
-                &rc,
-                cbStride,
-                cbBufferSize,
-                pixels);
+        status = jxr_decode_memory(input, inputSize, &options, &image, &result);
+        free(input);
+    } else {
+        // The decoder reads straight from the page cache
+        MappedFile in;
 
-        if (FAILED(hr)) {
-            fprintf(stderr, "Failed to copy pixels\n");
-            exit(1);
+        if (map_input(inputFile, &in)) {
+            fprintf(stderr, "Failed to open input file\n");
+            return 1;
         }
 
-        uint32_t convThreads = numThreads;
+        status = jxr_decode_memory(in.data, in.size, &options, &image, &result);
+        unmap_input(&in);
+    }
 
-        uint32_t chunkSize = height / convThreads;
+    if (status != JXR_OK) {
+        fprintf(stderr, "%s\n", result.error ? result.error : jxr_status_string(status));
+        return 1;
+    }
 
-        if (chunkSize == 0) {
-            convThreads = height;
-            chunkSize = 1;
-        }
+    // The conversion call starts a new result
+    jxr_timings decodeTimings = result.timings;
 
-        auto hThreadArray = (HANDLE *) malloc(sizeof(HANDLE) * convThreads);
-        auto threadData = (ThreadData **) malloc(sizeof(ThreadData *) * convThreads);
-        auto dwThreadIdArray = (DWORD *) malloc(sizeof(DWORD) * convThreads);
+    // The budget covers decoding, which happens before the library takes over
+    uint32_t budgetMs = options.time_budget_ms;
+    uint32_t decodeMs = (uint32_t) std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - decodeStart).count();
+    if (budgetMs) {
+        options.time_budget_ms = budgetMs > decodeMs ? budgetMs - decodeMs : 1;
+    }
 
-        if (hThreadArray == nullptr || threadData == nullptr || dwThreadIdArray == nullptr) {
-            fprintf(stderr, "Failed to allocate array for thread data\n");
-            return 1;
+    options.threading.num_threads = jxr_default_threads();
+    fprintf(log, "Using %d threads\n", options.threading.num_threads);
+
+    if (memory) {
+        // The output is streamed or mapped, never a growable buffer
+        jxr_memory_usage estimate;
+        if (jxr_estimate_memory(image.width, image.height, image.format, &options, 0, &estimate) == JXR_OK) {
+            report_memory(log, "Memory", "estimated peak", &estimate);
         }
+    }
 
-        for (uint32_t i = 0; i < convThreads; i++) {
-            threadData[i] = (ThreadData *) malloc(sizeof(ThreadData));
-            if (threadData[i] == nullptr) {
-                fprintf(stderr, "Failed to allocate thread data\n");
-                return 1;
-            }
+    fputs("Converting pixels to BT.2100 PQ...\n", log);
 
-            threadData[i]->pixels = pixels;
-            threadData[i]->bytesPerColor = bytesPerColor;
-            threadData[i]->converted = converted;
-            threadData[i]->width = width;
-            threadData[i]->start = i * chunkSize;
-            if (i != convThreads - 1) {
-                threadData[i]->stop = (i + 1) * chunkSize;
-            } else {
-                threadData[i]->stop = height;
-            }
+    size_t outputBytes;
 
-#ifdef MAXCLL_PERCENTILE
-            threadData[i]->nitCounts = (uint32_t *) calloc(10000, sizeof(uint32_t));
-#endif
+    if (toStdout) {
+        // The PNG is written chunk by chunk as it is compressed, so downstream consumers start
+        // receiving data while the image is still being encoded
+        static char outputBuffer[1 << 16];
+        setvbuf(stdout, outputBuffer, _IOFBF, sizeof(outputBuffer));
 
-            HANDLE hThread = CreateThread(
-                    nullptr,                   // default security attributes
-                    0,                      // use default stack size
-                    ThreadFunc,       // thread function name
-                    threadData[i],          // argument to thread function
-                    0,                      // use default creation flags
-                    &dwThreadIdArray[i]);   // returns the thread identifier
-
-            if (hThread) {
-                hThreadArray[i] = hThread;
-            } else {
-                fprintf(stderr, "Failed to create thread\n");
-                return 1;
-            }
-        }
+        OutputFile out = {stdout, 0};
+#ifdef _WIN32
+        jxr_stream stream = {stream_write, stream_flush, &out, nullptr};
+#else
+        jxr_stream stream = {stream_write, stream_flush, &out, stream_writev};
+#endif
 
-        WaitForMultipleObjects(convThreads, hThreadArray, TRUE, INFINITE);
+        status = jxr_convert_pixels_stream(&image, &options, &stream, &result);
+        jxr_image_free(&options, &image);
+        result.timings.stages[JXR_STAGE_DECODE] = decodeTimings.stages[JXR_STAGE_DECODE];
+        result.timings.bytes_in = decodeTimings.bytes_in;
 
-        maxCLL = 0;
-        double sumOfMaxComp = 0;
+        if (status != JXR_OK || fflush(stdout)) {
+            fprintf(stderr, "%s\n", status != JXR_OK && result.error ? result.error : "Error on PNG encode");
+            return 1;
+        }
 
-        for (uint32_t i = 0; i < convThreads; i++) {
-            HANDLE hThread = hThreadArray[i];
+        outputBytes = out.bytes;
+    } else {
+        // Encode directly into the mapped output, sized for the worst case and truncated afterwards
+        MappedFile out;
+        const char *target = outputFile;
 
-            DWORD exitCode;
-            if (!GetExitCodeThread(hThread, &exitCode) || exitCode) {
-                fprintf(stderr, "Thread failed to terminate properly\n");
+        if (options.optimize) {
+            target = temp_name(outputFile);
+            if (target == nullptr) {
+                fprintf(stderr, "Failed to allocate output name\n");
                 return 1;
             }
-            CloseHandle(hThread);
+        }
 
-            uint16_t tMaxNits = threadData[i]->maxNits;
-            if (tMaxNits > maxCLL) {
-                maxCLL = tMaxNits;
-            }
+        if (map_output(target, jxr_png_size_bound(image.width, image.height), &out)) {
+            perror("Error opening output file");
+            return 1;
+        }
+
+        jxr_buffer png = {out.data, 0, out.size, 0};
 
-            sumOfMaxComp += threadData[i]->sumOfMaxComp;
+        status = jxr_convert_pixels(&image, &options, &png, &result);
+        jxr_image_free(&options, &image);
+        result.timings.stages[JXR_STAGE_DECODE] = decodeTimings.stages[JXR_STAGE_DECODE];
+        result.timings.bytes_in = decodeTimings.bytes_in;
+
+        if (status != JXR_OK) {
+            discard_output(&out, target);
+            fprintf(stderr, "%s\n", result.error ? result.error : jxr_status_string(status));
+            return 1;
         }
 
-#ifdef MAXCLL_PERCENTILE
-        uint16_t currentIdx = maxCLL;
-        uint64_t count = 0;
-        auto countTarget = (uint64_t) round((1 - MAXCLL_PERCENTILE) * (double) ((uint64_t) width * height));
-        while (true) {
-            for (uint32_t i = 0; i < convThreads; i++) {
-                count += threadData[i]->nitCounts[currentIdx];
-            }
-            if (count >= countTarget) {
-                maxCLL = currentIdx;
-                break;
-            }
-            currentIdx--;
+        double traceBegin = jxr_trace_begin();
+        int finishFailed = finish_output(&out, png.size);
+        jxr_trace_end("finish output", -1, traceBegin);
+        if (finishFailed) {
+            fprintf(stderr, "Error on PNG encode\n");
+            return 1;
         }
-#endif
 
-        for (uint32_t i = 0; i < convThreads; i++) {
-#ifdef MAXCLL_PERCENTILE
-            free(threadData[i]->nitCounts);
-#endif
-            free(threadData[i]);
+        bool replaced = true;
+        if (options.optimize && keep_smaller(target, outputFile, png.size, log, &replaced)) {
+            return 1;
+        }
+        if (!replaced) {
+            if (timings) {
+                print_timings(log, timings, options.counters, inputFile, &result);
+            }
+            return 0;
         }
 
-        free(hThreadArray);
-        free(threadData);
-        free(dwThreadIdArray);
+        outputBytes = png.size;
+    }
 
-        maxPALL = (uint16_t) round(10000 * (sumOfMaxComp / (double) ((uint64_t) width * height)));
+    fprintf(log, "Computed HDR metadata: %u MaxCLL, %u MaxFALL\n", result.max_cll, result.max_fall);
 
-        free(pixels);
+    if (verbose && result.compression[0]) {
+        fprintf(log, "Compression: %s\n", result.compression);
     }
 
-    printf("Computed HDR metadata: %u MaxCLL, %u MaxFALL\n", maxCLL, maxPALL);
-
-    FILE *f = _wfopen(outputFile, L"wb");
+    if (budgetMs) {
+        report_budget(log, inputFile, &result, decodeMs, budgetMs, verbose);
+    }
 
-    if (!f) {
-        perror("Error opening output file");
-        return 1;
+    if (options.quality) {
+        report_quality(log, "Quality", &result);
     }
 
-    uint32_t maxCLL_png = maxCLL * 10000;
-    uint32_t maxFALL_png = maxPALL * 10000;
+    if (memory) {
+        jxr_memory_usage usage;
+        jxr_memory_usage_get(&usage);
+        report_memory(log, "Memory", "peak", &usage);
+    }
 
-    printf("Doing PNG encoding...\n");
-    if (write_png_file(f, (unsigned char *) converted, width, height, maxCLL_png, maxFALL_png)) {
-        printf("Error on PNG encode\n");
-        return 1;
+    if (timings) {
+        print_timings(log, timings, options.counters, inputFile, &result);
     }
 
-    printf("Encode success: %ld total bytes\n", ftell(f));
+    fprintf(log, "Encode success: %zu total bytes\n", outputBytes);
 }
@@ -0,0 +1,198 @@
+#include <cstdio>
+#include <cstdlib>
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#include <windows.h>
+
+static wchar_t *wide_path(const char *path) {
+    int len = MultiByteToWideChar(CP_UTF8, 0, path, -1, nullptr, 0);
+    auto wpath = (wchar_t *) malloc(len * sizeof(wchar_t));
+    if (wpath) {
+        MultiByteToWideChar(CP_UTF8, 0, path, -1, wpath, len);
+    }
+    return wpath;
+}
+
+static int map_file(const char *path, DWORD access, DWORD creation, size_t capacity, MappedFile *m) {
+    wchar_t *wpath = wide_path(path);
+    if (wpath == nullptr) {
+        return 1;
+    }
+
+    bool writable = access & GENERIC_WRITE;
+
+    HANDLE file = CreateFileW(wpath, access, writable ? 0 : FILE_SHARE_READ, nullptr, creation,
+                              writable ? FILE_ATTRIBUTE_NORMAL : FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    free(wpath);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        return 1;
+    }
+
+    if (!writable) {
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+            CloseHandle(file);
+            return 1;
+        }
+        capacity = (size_t) size.QuadPart;
+    }
+
+    HANDLE mapping = CreateFileMappingW(file, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY,
+                                        (DWORD) ((uint64_t) capacity >> 32), (DWORD) capacity, nullptr);
+    if (mapping == nullptr) {
+        CloseHandle(file);
+        return 1;
+    }
+
+    void *data = MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, capacity);
+    if (data == nullptr) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return 1;
+    }
+
+    m->data = (uint8_t *) data;
+    m->size = capacity;
+    m->file = file;
+    m->mapping = mapping;
+    return 0;
+}
+
+int map_input(const char *path, MappedFile *m) {
+    return map_file(path, GENERIC_READ, OPEN_EXISTING, 0, m);
+}
+
+void unmap_input(MappedFile *m) {
+    UnmapViewOfFile(m->data);
+    CloseHandle(m->mapping);
+    CloseHandle(m->file);
+}
+
+int map_output(const char *path, size_t capacity, MappedFile *m) {
+    return map_file(path, GENERIC_READ | GENERIC_WRITE, CREATE_ALWAYS, capacity, m);
+}
+
+int finish_output(MappedFile *m, size_t used) {
+    int ret = !UnmapViewOfFile(m->data);
+    CloseHandle(m->mapping);
+
+    LARGE_INTEGER size;
+    size.QuadPart = (LONGLONG) used;
+    if (!SetFilePointerEx(m->file, size, nullptr, FILE_BEGIN) || !SetEndOfFile(m->file)) {
+        ret = 1;
+    }
+
+    CloseHandle(m->file);
+    return ret;
+}
+
+void discard_output(MappedFile *m, const char *path) {
+    finish_output(m, 0);
+    remove_file(path);
+}
+
+int replace_file(const char *from, const char *path) {
+    wchar_t *wfrom = wide_path(from);
+    wchar_t *wpath = wide_path(path);
+    int ret = !wfrom || !wpath || !MoveFileExW(wfrom, wpath, MOVEFILE_REPLACE_EXISTING);
+    free(wfrom);
+    free(wpath);
+    return ret;
+}
+
+void remove_file(const char *path) {
+    wchar_t *wpath = wide_path(path);
+    if (wpath) {
+        DeleteFileW(wpath);
+    }
+    free(wpath);
+}
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int map_input(const char *path, MappedFile *m) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size <= 0) {
+        close(fd);
+        return 1;
+    }
+
+    void *data = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return 1;
+    }
+
+    madvise(data, (size_t) st.st_size, MADV_SEQUENTIAL);
+
+    m->data = (uint8_t *) data;
+    m->size = (size_t) st.st_size;
+    m->fd = fd;
+    return 0;
+}
+
+void unmap_input(MappedFile *m) {
+    munmap(m->data, m->size);
+    close(m->fd);
+}
+
+int map_output(const char *path, size_t capacity, MappedFile *m) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return 1;
+    }
+
+    // Sparse until written, the unused tail is cut off again by finish_output
+    if (ftruncate(fd, (off_t) capacity)) {
+        close(fd);
+        return 1;
+    }
+
+    void *data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return 1;
+    }
+
+    madvise(data, capacity, MADV_SEQUENTIAL);
+
+    m->data = (uint8_t *) data;
+    m->size = capacity;
+    m->fd = fd;
+    return 0;
+}
+
+int finish_output(MappedFile *m, size_t used) {
+    int ret = munmap(m->data, m->size) != 0;
+    if (ftruncate(m->fd, (off_t) used)) {
+        ret = 1;
+    }
+    if (close(m->fd)) {
+        ret = 1;
+    }
+    return ret;
+}
+
+void discard_output(MappedFile *m, const char *path) {
+    finish_output(m, 0);
+    remove_file(path);
+}
+
+int replace_file(const char *from, const char *path) {
+    return rename(from, path) != 0;
+}
+
+void remove_file(const char *path) {
+    unlink(path);
+}
+#endif
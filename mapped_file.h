@@ -0,0 +1,38 @@
+// Memory-mapped file input and output for the command line tools
+#ifndef JXR_MAPPED_FILE_H
+#define JXR_MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+
+typedef struct MappedFile {
+    uint8_t *data;
+    size_t size;
+#ifdef _WIN32
+    void *file;
+    void *mapping;
+#else
+    int fd;
+#endif
+} MappedFile;
+
+// Maps a whole file read-only, so decoders read straight from the page cache
+int map_input(const char *path, MappedFile *m);
+
+void unmap_input(MappedFile *m);
+
+// Creates the file with the given capacity and maps it writable
+int map_output(const char *path, size_t capacity, MappedFile *m);
+
+// Unmaps the output and truncates the file to the bytes actually used
+int finish_output(MappedFile *m, size_t used);
+
+// Unmaps and deletes an output that could not be completed
+void discard_output(MappedFile *m, const char *path);
+
+// Moves a finished output over path, replacing what was there in one step
+int replace_file(const char *from, const char *path);
+
+void remove_file(const char *path);
+
+#endif
@@ -0,0 +1,714 @@
+// The library's allocator: every allocation carries a small header with its size and category,
+// which keeps the process-wide usage counters by category. Frame-sized buffers are mapped directly,
+// and with a buffer pool freed buffers are kept for reuse.
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include "convert_kernels.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
+
+#define ALLOC_HEADER_SIZE 16  // keeps the 16 byte alignment of malloc
+#define OUTPUT_INITIAL_CAPACITY (1 << 20)  // sink_grow's first allocation
+#define PNM_HEADER_SIZE 256
+#define BOOKKEEPING_SIZE (64 * 1024)  // thread handles, task lists and other small allocations
+
+#define FRAME_ALIGNMENT 64
+#define FRAME_STAGGER 576  // successive frames start this much further into their first page, up to
+#define FRAME_STAGGERS 7   // 7 steps, so frames read and written together don't alias by 4 KB
+#define FRAME_MAP_SIZE (1 << 20)  // smaller frames come from the heap
+#define PAGE_SIZE_4K 4096
+#define HUGE_PAGE_SIZE (2 << 20)
+#define DEFAULT_ROW_PADDING 128
+#define PREFAULT_CHUNK (4 << 20)
+
+#define POOL_SMALL_CLASSES 64  // multiples of 64 bytes up to 4 KB, then four classes per power of two
+#define POOL_CLASSES (POOL_SMALL_CLASSES + 4 * 36)  // up to 256 TB
+#define POOL_PRESSURE_INTERVAL 1.0  // seconds between checks of the available memory
+
+typedef enum AllocKind {
+    ALLOC_HEAP = 0,     // options' allocator or malloc
+    ALLOC_MALLOC,       // malloc, for pool buffers
+    ALLOC_MAPPED,       // anonymous mapping of whole pages
+    ALLOC_MAPPED_HUGE,  // the same, on 2 MB pages
+} AllocKind;
+
+#define ALLOC_POOLED 0x80  // kind flag, the pool pointer is stored in front of the header
+
+typedef struct AllocHeader {
+    uint64_t size;
+    uint16_t category;
+    uint8_t kind;
+    uint8_t sizeClass;  // of pooled buffers
+    uint32_t offset;    // from the start of the block to the data
+} AllocHeader;
+
+static_assert(sizeof(AllocHeader) <= ALLOC_HEADER_SIZE, "allocation header too large");
+static_assert(ALLOC_HEADER_SIZE + sizeof(void *) <= FRAME_ALIGNMENT, "pool pointer does not fit");
+
+static std::atomic<uint64_t> current_bytes[JXR_MEMORY_COUNT];
+static std::atomic<uint64_t> peak_bytes[JXR_MEMORY_COUNT];
+static std::atomic<uint64_t> current_total;
+static std::atomic<uint64_t> peak_total;
+static std::atomic<uint32_t> frame_count;
+
+static void raise_peak(std::atomic<uint64_t> *peak, uint64_t value) {
+    uint64_t seen = peak->load(std::memory_order_relaxed);
+    while (value > seen && !peak->compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+    }
+}
+
+static void account(uint32_t category, uint64_t added, uint64_t removed) {
+    uint64_t now = current_bytes[category].fetch_add(added - removed, std::memory_order_relaxed) + added - removed;
+    raise_peak(&peak_bytes[category], now);
+    now = current_total.fetch_add(added - removed, std::memory_order_relaxed) + added - removed;
+    raise_peak(&peak_total, now);
+}
+
+static AllocHeader read_header(const void *ptr) {
+    AllocHeader header;
+    memcpy(&header, (const uint8_t *) ptr - ALLOC_HEADER_SIZE, sizeof(header));
+    return header;
+}
+
+static void write_header(void *ptr, const AllocHeader *header) {
+    memcpy((uint8_t *) ptr - ALLOC_HEADER_SIZE, header, sizeof(AllocHeader));
+}
+
+static size_t round_up(size_t size, size_t unit) {
+    return (size + unit - 1) / unit * unit;
+}
+
+static void *raw_malloc(const jxr_options *options, size_t size) {
+    if (options->allocator.alloc) {
+        return options->allocator.alloc(options->allocator.user, size);
+    }
+    return malloc(size);
+}
+
+// Whole pages, 2 MB aligned for huge pages. Sets huge to whether they were used.
+static uint8_t *map_pages(size_t length, bool *huge) {
+#ifdef _WIN32
+    // Large pages need the lock pages privilege, without it the allocation fails and normal pages are used
+    if (*huge && GetLargePageMinimum() == HUGE_PAGE_SIZE) {
+        void *p = VirtualAlloc(nullptr, length, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (p) {
+            return (uint8_t *) p;
+        }
+    }
+    *huge = false;
+    return (uint8_t *) VirtualAlloc(nullptr, length, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    if (!*huge) {
+        void *p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return p == MAP_FAILED ? nullptr : (uint8_t *) p;
+    }
+
+    // Map an extra huge page and trim both ends so the mapping starts on a 2 MB boundary
+    void *p = mmap(nullptr, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return nullptr;
+    }
+    auto raw = (uint8_t *) p;
+    auto base = (uint8_t *) round_up((uintptr_t) raw, HUGE_PAGE_SIZE);
+    if (base > raw) {
+        munmap(raw, base - raw);
+    }
+    if (raw + HUGE_PAGE_SIZE > base) {
+        munmap(base + length, raw + HUGE_PAGE_SIZE - base);
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(base, length, MADV_HUGEPAGE);
+#endif
+    return base;
+#endif
+}
+
+// Gives the block holding ptr, of capacity data bytes, back to where it came from
+static void release_block(const jxr_options *options, void *ptr, const AllocHeader *header, size_t capacity) {
+    uint8_t *base = (uint8_t *) ptr - header->offset;
+    switch (header->kind & ~ALLOC_POOLED) {
+        case ALLOC_MAPPED:
+        case ALLOC_MAPPED_HUGE: {
+#ifdef _WIN32
+            (void) capacity;
+            VirtualFree(base, 0, MEM_RELEASE);
+#else
+            size_t page = (header->kind & ~ALLOC_POOLED) == ALLOC_MAPPED_HUGE ? HUGE_PAGE_SIZE : PAGE_SIZE_4K;
+            munmap(base, round_up(header->offset + capacity, page));
+#endif
+            break;
+        }
+        case ALLOC_HEAP:
+            if (options->allocator.alloc) {
+                options->allocator.free(options->allocator.user, base);
+                break;
+            }
+            free(base);
+            break;
+        default:
+            free(base);
+            break;
+    }
+}
+
+typedef struct PrefaultTask {
+    uint8_t *data;
+    size_t size;
+    size_t chunks;
+    uint32_t tasks;
+} PrefaultTask;
+
+// Writes one byte of every page, so the faults are taken here instead of by the first user
+static void PrefaultFunc(void *arg, uint32_t index) {
+    auto t = (PrefaultTask *) arg;
+    TraceSpan span("prefault", index);
+    for (size_t chunk = index; chunk < t->chunks; chunk += t->tasks) {
+        size_t start = chunk * PREFAULT_CHUNK;
+        size_t stop = start + PREFAULT_CHUNK < t->size ? start + PREFAULT_CHUNK : t->size;
+        for (size_t i = start; i < stop; i += PAGE_SIZE_4K) {
+            t->data[i] = 0;
+        }
+    }
+}
+
+// A 64-byte aligned block for size bytes, mapped when large and no caller allocator is used.
+// Returns the data pointer, with room for the header and pool pointer in front of it.
+static uint8_t *aligned_block(const jxr_options *options, size_t size, bool callerAllocator, AllocHeader *header) {
+    // Only frame-sized blocks are staggered, small pooled classes would just waste the space
+    size_t stagger = 0;
+    if (size >= FRAME_MAP_SIZE) {
+        stagger = (size_t) (frame_count.fetch_add(1, std::memory_order_relaxed) % FRAME_STAGGERS) * FRAME_STAGGER;
+    }
+    size_t offset = FRAME_ALIGNMENT + stagger;
+    if (size > SIZE_MAX - offset - 2 * HUGE_PAGE_SIZE) {
+        return nullptr;
+    }
+
+    uint8_t *base;
+    uint8_t *ptr;
+
+    if ((callerAllocator && options->allocator.alloc) || size < FRAME_MAP_SIZE) {
+        // Aligned within a heap block with room for the alignment
+        base = (uint8_t *) (callerAllocator ? raw_malloc(options, size + offset + FRAME_ALIGNMENT)
+                                            : malloc(size + offset + FRAME_ALIGNMENT));
+        if (base == nullptr) {
+            return nullptr;
+        }
+        ptr = (uint8_t *) round_up((uintptr_t) base + FRAME_ALIGNMENT, FRAME_ALIGNMENT) + stagger;
+        header->kind = callerAllocator ? ALLOC_HEAP : ALLOC_MALLOC;
+    } else {
+        bool huge = !options->frame_memory.no_huge_pages && size >= HUGE_PAGE_SIZE;
+        base = map_pages(round_up(offset + size, huge ? HUGE_PAGE_SIZE : PAGE_SIZE_4K), &huge);
+        if (base == nullptr) {
+            return nullptr;
+        }
+        ptr = base + offset;
+        header->kind = huge ? ALLOC_MAPPED_HUGE : ALLOC_MAPPED;
+    }
+    header->offset = (uint32_t) (ptr - base);
+
+    if (options->frame_memory.prefault) {
+        uint32_t threads = resolve_threads(options);
+        PrefaultTask task = {ptr, size, (size + PREFAULT_CHUNK - 1) / PREFAULT_CHUNK, 0};
+        task.tasks = task.chunks < threads ? (uint32_t) task.chunks : threads;
+        if (task.tasks > 1) {
+            run_parallel(options, task.tasks, PrefaultFunc, &task);
+        } else {
+            PrefaultFunc(&task, 0);
+        }
+    }
+
+    return ptr;
+}
+
+struct jxr_buffer_pool {
+    std::mutex mutex;
+    void *idle[POOL_CLASSES];  // each idle buffer holds the next one's address in its first bytes
+    uint64_t maxIdleBytes;
+    uint64_t minAvailableBytes;
+    double nextPressureCheck;
+    jxr_buffer_pool_stats stats;
+};
+
+static uint32_t size_class(size_t size) {
+    if (size <= (size_t) POOL_SMALL_CLASSES * 64) {
+        return size ? (uint32_t) ((size + 63) / 64 - 1) : 0;
+    }
+    uint32_t e = 0;
+    while ((size - 1) >> (e + 1)) {
+        e++;
+    }
+    size_t quarter = (size_t) 1 << (e - 2);
+    auto q = (uint32_t) ((size - ((size_t) 1 << e) + quarter - 1) / quarter - 1);
+    return POOL_SMALL_CLASSES + 4 * (e - 12) + q;
+}
+
+static size_t class_size(uint32_t index) {
+    if (index < POOL_SMALL_CLASSES) {
+        return (size_t) (index + 1) * 64;
+    }
+    uint32_t e = 12 + (index - POOL_SMALL_CLASSES) / 4;
+    uint32_t q = (index - POOL_SMALL_CLASSES) % 4;
+    return ((size_t) 1 << e) + (size_t) (q + 1) * ((size_t) 1 << (e - 2));
+}
+
+// Memory the system can still hand out without swapping
+static uint64_t available_memory() {
+#ifdef _WIN32
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    return GlobalMemoryStatusEx(&status) ? status.ullAvailPhys : UINT64_MAX;
+#elif defined(__linux__)
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (f == nullptr) {
+        return UINT64_MAX;
+    }
+    char line[256];
+    unsigned long long kb = 0;
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), f)) {
+        found = sscanf(line, "MemAvailable: %llu kB", &kb) == 1;
+    }
+    fclose(f);
+    return found ? (uint64_t) kb * 1024 : UINT64_MAX;
+#else
+    return UINT64_MAX;
+#endif
+}
+
+// Takes idle buffers off the lists until at most keep bytes remain, returns them as a list
+static void *pool_take_idle(jxr_buffer_pool *pool, uint64_t keep) {
+    void *taken = nullptr;
+    for (uint32_t c = POOL_CLASSES; c-- > 0 && pool->stats.idle_bytes > keep;) {
+        while (pool->idle[c] && pool->stats.idle_bytes > keep) {
+            void *ptr = pool->idle[c];
+            memcpy(&pool->idle[c], ptr, sizeof(void *));
+            memcpy(ptr, &taken, sizeof(void *));
+            taken = ptr;
+            pool->stats.idle_bytes -= class_size(c);
+            pool->stats.idle_buffers--;
+            pool->stats.released_bytes += class_size(c);
+        }
+    }
+    return taken;
+}
+
+static void release_list(void *list) {
+    jxr_options defaults;
+    jxr_options_init(&defaults);
+    while (list) {
+        void *next;
+        memcpy(&next, list, sizeof(void *));
+        AllocHeader header = read_header(list);
+        release_block(&defaults, list, &header, class_size(header.sizeClass));
+        list = next;
+    }
+}
+
+// Checks the available memory now and then, the caller holds the lock. Returns buffers to release.
+static void *pool_check_pressure(jxr_buffer_pool *pool) {
+    if (pool->minAvailableBytes == 0) {
+        return nullptr;
+    }
+    double now = monotonic_seconds();
+    if (now < pool->nextPressureCheck) {
+        return nullptr;
+    }
+    pool->nextPressureCheck = now + POOL_PRESSURE_INTERVAL;
+    return available_memory() < pool->minAvailableBytes ? pool_take_idle(pool, 0) : nullptr;
+}
+
+static void *pool_alloc(jxr_buffer_pool *pool, const jxr_options *options, size_t size,
+                        jxr_memory_category category) {
+    uint32_t c = size_class(size);
+    if (c >= POOL_CLASSES) {
+        return nullptr;
+    }
+
+    void *ptr = nullptr;
+    void *released;
+    {
+        std::lock_guard<std::mutex> guard(pool->mutex);
+        if (pool->idle[c]) {
+            ptr = pool->idle[c];
+            memcpy(&pool->idle[c], ptr, sizeof(void *));
+            pool->stats.idle_bytes -= class_size(c);
+            pool->stats.idle_buffers--;
+            pool->stats.hits++;
+        } else {
+            pool->stats.misses++;
+        }
+        released = pool_check_pressure(pool);
+    }
+    release_list(released);
+
+    AllocHeader header = {};
+    if (ptr) {
+        header = read_header(ptr);
+    } else {
+        ptr = aligned_block(options, class_size(c), false, &header);
+        if (ptr == nullptr) {
+            return nullptr;
+        }
+        header.kind |= ALLOC_POOLED;
+        header.sizeClass = (uint8_t) c;
+        memcpy((uint8_t *) ptr - ALLOC_HEADER_SIZE - sizeof(void *), &pool, sizeof(void *));
+    }
+
+    header.size = size;
+    header.category = (uint16_t) category;
+    write_header(ptr, &header);
+    account(category, size, 0);
+    return ptr;
+}
+
+static void pool_free(void *ptr, const AllocHeader *header) {
+    jxr_buffer_pool *pool;
+    memcpy(&pool, (uint8_t *) ptr - ALLOC_HEADER_SIZE - sizeof(void *), sizeof(void *));
+    size_t capacity = class_size(header->sizeClass);
+
+    void *released;
+    bool keep;
+    {
+        std::lock_guard<std::mutex> guard(pool->mutex);
+        released = pool_check_pressure(pool);
+        keep = released == nullptr && pool->stats.idle_bytes + capacity <= pool->maxIdleBytes;
+        if (keep) {
+            memcpy(ptr, &pool->idle[header->sizeClass], sizeof(void *));
+            pool->idle[header->sizeClass] = ptr;
+            pool->stats.idle_bytes += capacity;
+            pool->stats.idle_buffers++;
+        } else {
+            pool->stats.released_bytes += capacity;
+        }
+    }
+    release_list(released);
+
+    if (!keep) {
+        jxr_options defaults;
+        jxr_options_init(&defaults);
+        release_block(&defaults, ptr, header, capacity);
+    }
+}
+
+void *jxr_malloc(const jxr_options *options, size_t size, jxr_memory_category category) {
+    if (options->buffer_pool) {
+        return pool_alloc(options->buffer_pool, options, size, category);
+    }
+    if (size > SIZE_MAX - ALLOC_HEADER_SIZE) {
+        return nullptr;
+    }
+    auto base = (uint8_t *) raw_malloc(options, size + ALLOC_HEADER_SIZE);
+    if (base == nullptr) {
+        return nullptr;
+    }
+    AllocHeader header = {size, (uint16_t) category, ALLOC_HEAP, 0, ALLOC_HEADER_SIZE};
+    write_header(base + ALLOC_HEADER_SIZE, &header);
+    account(category, size, 0);
+    return base + ALLOC_HEADER_SIZE;
+}
+
+void *jxr_calloc(const jxr_options *options, size_t count, size_t size, jxr_memory_category category) {
+    if (size && count > SIZE_MAX / size) {
+        return nullptr;
+    }
+    void *ptr = jxr_malloc(options, count * size, category);
+    if (ptr) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+void *jxr_realloc(const jxr_options *options, void *ptr, size_t size, jxr_memory_category category) {
+    if (ptr == nullptr) {
+        return jxr_malloc(options, size, category);
+    }
+
+    AllocHeader header = read_header(ptr);
+
+    // Pooled buffers grow within their size class, then move to a larger one
+    if (header.kind & ALLOC_POOLED) {
+        if (size <= class_size(header.sizeClass)) {
+            account(header.category, size, header.size);
+            header.size = size;
+            write_header(ptr, &header);
+            return ptr;
+        }
+        void *grown = jxr_malloc(options, size, category);
+        if (grown) {
+            memcpy(grown, ptr, header.size);
+            jxr_free(options, ptr);
+        }
+        return grown;
+    }
+
+    if (size > SIZE_MAX - ALLOC_HEADER_SIZE) {
+        return nullptr;
+    }
+
+    uint8_t *base = (uint8_t *) ptr - ALLOC_HEADER_SIZE;
+    const jxr_allocator *allocator = &options->allocator;
+    if (allocator->alloc && allocator->realloc) {
+        base = (uint8_t *) allocator->realloc(allocator->user, base, size + ALLOC_HEADER_SIZE);
+    } else if (allocator->alloc) {
+        // Without a realloc hook the block moves, but stays with the caller's allocator
+        auto grown = (uint8_t *) allocator->alloc(allocator->user, size + ALLOC_HEADER_SIZE);
+        if (grown) {
+            memcpy(grown, base, ALLOC_HEADER_SIZE + (size < header.size ? size : header.size));
+            allocator->free(allocator->user, base);
+        }
+        base = grown;
+    } else {
+        base = (uint8_t *) realloc(base, size + ALLOC_HEADER_SIZE);
+    }
+    if (base == nullptr) {
+        return nullptr;
+    }
+
+    account(header.category, size, header.size);
+    header.size = size;
+    write_header(base + ALLOC_HEADER_SIZE, &header);
+    return base + ALLOC_HEADER_SIZE;
+}
+
+bool allocator_valid(const jxr_allocator *allocator) {
+    return (allocator->alloc == nullptr) == (allocator->free == nullptr) &&
+           (allocator->realloc == nullptr || allocator->alloc != nullptr);
+}
+
+void jxr_free(const jxr_options *options, void *ptr) {
+    if (ptr == nullptr) {
+        return;
+    }
+    AllocHeader header = read_header(ptr);
+    account(header.category, 0, header.size);
+
+    if (header.kind & ALLOC_POOLED) {
+        pool_free(ptr, &header);
+        return;
+    }
+    release_block(options, ptr, &header, header.size);
+}
+
+void *frame_alloc(const jxr_options *options, size_t size, jxr_memory_category category) {
+    if (options->buffer_pool) {
+        return pool_alloc(options->buffer_pool, options, size, category);
+    }
+
+    AllocHeader header = {size, (uint16_t) category, 0, 0, 0};
+    uint8_t *ptr = aligned_block(options, size, true, &header);
+    if (ptr == nullptr) {
+        return nullptr;
+    }
+    write_header(ptr, &header);
+    account(category, size, 0);
+    return ptr;
+}
+
+size_t frame_stride(const jxr_options *options, size_t rowSize) {
+    size_t stride = round_up(rowSize, FRAME_ALIGNMENT);
+    int padding = options->frame_memory.row_padding;
+    if (stride % PAGE_SIZE_4K == 0 && padding >= 0) {
+        stride += padding ? round_up((size_t) padding, FRAME_ALIGNMENT) : DEFAULT_ROW_PADDING;
+    }
+    return stride;
+}
+
+jxr_buffer_pool *jxr_buffer_pool_create(uint64_t max_idle_bytes, uint64_t min_available_bytes) {
+    auto pool = new(std::nothrow) jxr_buffer_pool();
+    if (pool) {
+        pool->maxIdleBytes = max_idle_bytes;
+        pool->minAvailableBytes = min_available_bytes;
+    }
+    return pool;
+}
+
+void jxr_buffer_pool_destroy(jxr_buffer_pool *pool) {
+    if (pool == nullptr) {
+        return;
+    }
+    jxr_buffer_pool_trim(pool, 0);
+    delete pool;
+}
+
+void jxr_buffer_pool_trim(jxr_buffer_pool *pool, uint64_t keep_bytes) {
+    void *released;
+    {
+        std::lock_guard<std::mutex> guard(pool->mutex);
+        released = pool_take_idle(pool, keep_bytes);
+    }
+    release_list(released);
+}
+
+void jxr_buffer_pool_stats_get(jxr_buffer_pool *pool, jxr_buffer_pool_stats *stats) {
+    std::lock_guard<std::mutex> guard(pool->mutex);
+    *stats = pool->stats;
+}
+
+void *jxr_buffer_pool_alloc(void *pool, size_t size) {
+    jxr_options options;
+    jxr_options_init(&options);
+    options.buffer_pool = (jxr_buffer_pool *) pool;
+    return jxr_malloc(&options, size, JXR_MEMORY_CALLER);
+}
+
+void *jxr_buffer_pool_realloc(void *pool, void *ptr, size_t size) {
+    jxr_options options;
+    jxr_options_init(&options);
+    options.buffer_pool = (jxr_buffer_pool *) pool;
+    return jxr_realloc(&options, ptr, size, JXR_MEMORY_CALLER);
+}
+
+void jxr_buffer_pool_free(void *pool, void *ptr) {
+    jxr_options options;
+    jxr_options_init(&options);
+    options.buffer_pool = (jxr_buffer_pool *) pool;
+    jxr_free(&options, ptr);
+}
+
+static uint64_t peak_rss() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    return GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ? counters.PeakWorkingSetSize : 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage)) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return (uint64_t) usage.ru_maxrss;
+#else
+    return (uint64_t) usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+void jxr_memory_usage_get(jxr_memory_usage *usage) {
+    for (int i = 0; i < JXR_MEMORY_COUNT; i++) {
+        usage->current[i] = current_bytes[i].load(std::memory_order_relaxed);
+        usage->peak[i] = peak_bytes[i].load(std::memory_order_relaxed);
+    }
+    usage->current_total = current_total.load(std::memory_order_relaxed);
+    usage->peak_total = peak_total.load(std::memory_order_relaxed);
+    usage->peak_rss = peak_rss();
+}
+
+void jxr_memory_usage_reset(void) {
+    for (int i = 0; i < JXR_MEMORY_COUNT; i++) {
+        peak_bytes[i].store(current_bytes[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    peak_total.store(current_total.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+// Capacity a growable buffer reaches for size bytes
+static size_t grown_capacity(size_t size) {
+    size_t capacity = OUTPUT_INITIAL_CAPACITY;
+    while (capacity < size) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+// What is alive at the same time in one phase of convert_to_sink
+typedef struct Phase {
+    uint64_t bytes[JXR_MEMORY_COUNT];
+} Phase;
+
+static void add_phase(jxr_memory_usage *estimate, const Phase *phase) {
+    uint64_t total = 0;
+    for (int i = 0; i < JXR_MEMORY_COUNT; i++) {
+        estimate->peak[i] = phase->bytes[i] > estimate->peak[i] ? phase->bytes[i] : estimate->peak[i];
+        total += phase->bytes[i];
+    }
+    estimate->peak_total = total > estimate->peak_total ? total : estimate->peak_total;
+}
+
+jxr_status jxr_estimate_memory(uint32_t width, uint32_t height, jxr_pixel_format format,
+                               const jxr_options *options, int growable_output, jxr_memory_usage *estimate) {
+    jxr_options defaults;
+    if (options == nullptr) {
+        jxr_options_init(&defaults);
+        options = &defaults;
+    }
+    if (estimate == nullptr || width == 0 || height == 0 ||
+        (format != JXR_PIXEL_FORMAT_RGBA_HALF && format != JXR_PIXEL_FORMAT_RGBA_FLOAT)) {
+        return JXR_ERROR_INVALID_ARGUMENT;
+    }
+    memset(estimate, 0, sizeof(jxr_memory_usage));
+
+    uint32_t threads = resolve_threads(options);
+    uint32_t convThreads = threads < height ? threads : height;
+    bool png = options->format == JXR_FORMAT_PNG;
+    bool fused = png && !options->auto_compression && !options->optimize && !options->quality &&
+                 options->filter_policy == JXR_FILTER_FIXED && options->filter_type != JXR_PNG_FILTER_PAETH;
+
+    size_t length = (size_t) width * 6;
+    uint64_t input = (uint64_t) frame_stride(options, (size_t) width * format * 4) * height;
+    uint64_t converted = fused ? filtered_size(width, height) : (uint64_t) length * height;
+
+    Phase convert = {};
+    convert.bytes[JXR_MEMORY_INPUT_FRAME] = input;
+    convert.bytes[JXR_MEMORY_OUTPUT_FRAME] = converted;
+#ifdef MAXCLL_PERCENTILE
+    convert.bytes[JXR_MEMORY_HISTOGRAMS] = (uint64_t) convThreads * NIT_LEVELS * sizeof(uint32_t);
+#endif
+    convert.bytes[JXR_MEMORY_OTHER] = (uint64_t) convThreads * 2 * (length + 8) + BOOKKEEPING_SIZE;
+    add_phase(estimate, &convert);
+
+    Phase encode = {};
+    encode.bytes[JXR_MEMORY_INPUT_FRAME] = input;
+
+    if (png) {
+        Phase select = {};
+        select.bytes[JXR_MEMORY_INPUT_FRAME] = input;
+        select.bytes[JXR_MEMORY_OUTPUT_FRAME] = converted;
+        if (options->optimize) {
+            select.bytes[JXR_MEMORY_ENCODER] = optimize_memory(options, width);
+        } else if (options->auto_compression) {
+            select.bytes[JXR_MEMORY_ENCODER] = auto_compress_memory(options, width);
+        }
+        select.bytes[JXR_MEMORY_OTHER] = BOOKKEEPING_SIZE;
+        add_phase(estimate, &select);
+
+        // Filtering reads the plain rows into a second frame
+        Phase filter = {};
+        if (!fused) {
+            filter.bytes[JXR_MEMORY_INPUT_FRAME] = input;
+            filter.bytes[JXR_MEMORY_OUTPUT_FRAME] = converted + filtered_size(width, height);
+            filter.bytes[JXR_MEMORY_OTHER] = length + 2 * length * convThreads + BOOKKEEPING_SIZE;
+        }
+        add_phase(estimate, &filter);
+
+        // Auto and optimize may pick any compressor, so the largest one is assumed
+        jxr_options encoder = *options;
+        uint64_t encoderBytes = encode_memory(&encoder, width, height, threads);
+        if (options->auto_compression || options->optimize) {
+            for (int d = JXR_DEFLATE_ZLIB; d <= JXR_DEFLATE_STORED; d++) {
+                encoder.deflate = (jxr_deflate) d;
+                uint64_t bytes = encode_memory(&encoder, width, height, threads);
+                encoderBytes = bytes > encoderBytes ? bytes : encoderBytes;
+            }
+        }
+
+        encode.bytes[JXR_MEMORY_OUTPUT_FRAME] = filtered_size(width, height);
+        encode.bytes[JXR_MEMORY_ENCODER] = encoderBytes;
+        encode.bytes[JXR_MEMORY_OUTPUT] = growable_output ? grown_capacity(png_size_bound(width, height)) : 0;
+        encode.bytes[JXR_MEMORY_OTHER] = BOOKKEEPING_SIZE;
+    } else {
+        encode.bytes[JXR_MEMORY_OUTPUT_FRAME] = converted;
+        encode.bytes[JXR_MEMORY_OUTPUT] = growable_output ? grown_capacity(converted + PNM_HEADER_SIZE) : 0;
+    }
+    add_phase(estimate, &encode);
+
+    return JXR_OK;
+}
@@ -0,0 +1,148 @@
+// Archival compression: every combination of filter policy and zlib strategy is tried on the whole
+// image, one combination per thread, and the smallest one is used
+#include <cstdio>
+#include "internal.h"
+
+#ifdef JXR_SYSTEM_ZLIB
+#include <zlib.h>
+#else
+#include "zlib/zlib.h"
+#endif
+
+#define OPTIMIZE_BAND_ROWS 16  // rows filtered at a time before they are fed to zlib
+#define OPTIMIZE_OUT_SIZE (64 * 1024)
+
+typedef struct FilterChoice {
+    const char *name;
+    jxr_filter_policy policy;
+    jxr_png_filter type;
+} FilterChoice;
+
+static const FilterChoice filter_choices[] = {
+        {"adaptive filters", JXR_FILTER_EXHAUSTIVE, JXR_PNG_FILTER_NONE},
+        {"entropy filters", JXR_FILTER_ENTROPY, JXR_PNG_FILTER_NONE},
+        {"none", JXR_FILTER_FIXED, JXR_PNG_FILTER_NONE},
+        {"sub", JXR_FILTER_FIXED, JXR_PNG_FILTER_SUB},
+        {"up", JXR_FILTER_FIXED, JXR_PNG_FILTER_UP},
+        {"average", JXR_FILTER_FIXED, JXR_PNG_FILTER_AVERAGE},
+        {"paeth", JXR_FILTER_FIXED, JXR_PNG_FILTER_PAETH},
+};
+
+static const jxr_strategy strategies[] = {JXR_STRATEGY_DEFAULT, JXR_STRATEGY_FILTERED, JXR_STRATEGY_RLE};
+static const char *const strategy_names[] = {"default", "filtered", "rle"};
+
+#define NUM_FILTERS (sizeof(filter_choices) / sizeof(filter_choices[0]))
+#define NUM_STRATEGIES (sizeof(strategies) / sizeof(strategies[0]))
+#define NUM_TRIALS (NUM_FILTERS * NUM_STRATEGIES)
+
+static void apply(uint32_t trial, jxr_options *options) {
+    const FilterChoice *f = &filter_choices[trial / NUM_STRATEGIES];
+    options->filter_policy = f->policy;
+    options->filter_type = f->type;
+    options->deflate = JXR_DEFLATE_ZLIB;
+    options->strategy = strategies[trial % NUM_STRATEGIES];
+    options->level = 9;
+    options->optimize = 1;
+}
+
+typedef struct TrialTask {
+    const jxr_options *options;
+    const uint8_t *data;
+    uint32_t width;
+    uint32_t height;
+    size_t bytes[NUM_TRIALS];  // 0 if the trial failed
+} TrialTask;
+
+// Compresses the whole image with one combination, filtering a band of rows at a time
+static void TrialFunc(void *arg, uint32_t index) {
+    auto t = (TrialTask *) arg;
+    TraceSpan span("optimize trial", index);
+    t->bytes[index] = 0;
+
+    jxr_options options = *t->options;
+    apply(index, &options);
+
+    size_t length = (size_t) t->width * 6;
+    size_t bandSize = filtered_size(t->width, OPTIMIZE_BAND_ROWS);
+
+    auto memory = (uint8_t *) jxr_calloc(&options, 1, 3 * length + bandSize + OPTIMIZE_OUT_SIZE,
+                                         JXR_MEMORY_ENCODER);
+    if (memory == nullptr) {
+        return;
+    }
+    uint8_t *band = memory + 3 * length;
+    uint8_t *out = band + bandSize;
+
+    z_stream stream;
+    if (deflate_init(&stream, &options) != Z_OK) {
+        jxr_free(&options, memory);
+        return;
+    }
+
+    int ret = Z_OK;
+    for (uint32_t y = 0; y < t->height && ret != Z_STREAM_ERROR; y += OPTIMIZE_BAND_ROWS) {
+        uint32_t stop = y + OPTIMIZE_BAND_ROWS < t->height ? y + OPTIMIZE_BAND_ROWS : t->height;
+        filter_band(t->data, t->width, y, stop, options.filter_policy, options.filter_type, memory,
+                    memory + length, band);
+
+        int flush = stop == t->height ? Z_FINISH : Z_NO_FLUSH;
+        stream.next_in = band;
+        stream.avail_in = (uInt) filtered_size(t->width, stop - y);
+        do {
+            stream.next_out = out;
+            stream.avail_out = OPTIMIZE_OUT_SIZE;
+            ret = deflate(&stream, flush);
+        } while (ret == Z_OK && stream.avail_out == 0);
+    }
+
+    if (ret == Z_STREAM_END) {
+        t->bytes[index] = stream.total_out;
+    }
+
+    deflateEnd(&stream);
+    jxr_free(&options, memory);
+}
+
+size_t optimize_memory(const jxr_options *options, uint32_t width) {
+    jxr_options trial = *options;
+    apply(0, &trial);
+    size_t perTrial = 3 * (size_t) width * 6 + filtered_size(width, OPTIMIZE_BAND_ROWS) + OPTIMIZE_OUT_SIZE +
+                      deflate_memory(&trial);
+    return perTrial * NUM_TRIALS;
+}
+
+int optimize_compression(const jxr_options *options, const uint8_t *data, uint32_t width, uint32_t height,
+                         jxr_options *chosen, char *report, size_t reportSize) {
+    TrialTask task;
+    task.options = options;
+    task.data = data;
+    task.width = width;
+    task.height = height;
+
+    if (run_parallel(options, (uint32_t) NUM_TRIALS, TrialFunc, &task)) {
+        return 1;
+    }
+
+    size_t pick = NUM_TRIALS;
+    size_t largest = 0;
+    for (size_t i = 0; i < NUM_TRIALS; i++) {
+        if (task.bytes[i] && (pick == NUM_TRIALS || task.bytes[i] < task.bytes[pick])) {
+            pick = i;
+        }
+        if (task.bytes[i] > largest) {
+            largest = task.bytes[i];
+        }
+    }
+
+    if (pick == NUM_TRIALS) {
+        return 1;
+    }
+
+    *chosen = *options;
+    apply((uint32_t) pick, chosen);
+
+    snprintf(report, reportSize, "%s, zlib 9 %s (smallest of %zu trials: %zu bytes, largest %zu)",
+             filter_choices[pick / NUM_STRATEGIES].name, strategy_names[pick % NUM_STRATEGIES],
+             (size_t) NUM_TRIALS, task.bytes[pick], largest);
+    return 0;
+}
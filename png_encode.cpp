@@ -0,0 +1,538 @@
+#include <cstring>
+#include "internal.h"
+#include "png_chunks.h"
+
+#ifdef JXR_SYSTEM_ZLIB
+#include <zlib.h>
+#else
+#include "zlib/zlib.h"
+#endif
+
+#define IDAT_DEFAULT_SIZE (256 * 1024)
+#define IDAT_MIN_SIZE (8 * 1024)
+#define IDAT_MAX_SIZE (1 << 30)
+#define STORED_BLOCK_SIZE 65535  // largest stored deflate block
+#define COUNT_BUFFER_SIZE (64 * 1024)  // output buffer when only the compressed size is needed
+#define OPTIMIZE_GOOD_LENGTH 258  // zlib level 9 shortens the search after a 32 byte match
+#define OPTIMIZE_MAX_CHAIN 16384  // zlib level 9 follows 4096 hash chain entries
+
+// Makes room for size bytes at the end of the output buffer, growing it if allowed
+static int sink_grow(OutputSink *sink, size_t size) {
+    jxr_buffer *buf = sink->buffer;
+    size_t needed = sink->written + size;
+
+    if (needed > buf->capacity && buf->growable) {
+        size_t capacity = buf->capacity ? buf->capacity : 1 << 20;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        auto data_new = (uint8_t *) jxr_realloc(sink->options, buf->data, capacity, JXR_MEMORY_OUTPUT);
+        if (data_new == nullptr) {
+            return 1;
+        }
+        buf->data = data_new;
+        buf->capacity = capacity;
+    }
+    return 0;
+}
+
+// Appends to the output buffer, growing it if allowed. Once a fixed buffer is full, further
+// writes are only counted so the caller learns the required size.
+int sink_write(OutputSink *sink, const void *data, size_t size) {
+    if (sink->stream) {
+        TraceSpan span("write", (int64_t) size);
+        sink->written += size;
+        return sink->stream->write(sink->stream->user, data, size);
+    }
+
+    if (sink_grow(sink, size)) {
+        return 1;
+    }
+
+    jxr_buffer *buf = sink->buffer;
+    size_t needed = sink->written + size;
+
+    if (needed <= buf->capacity) {
+        memcpy(buf->data + sink->written, data, size);
+    }
+
+    sink->written = needed;
+    buf->size = needed;
+    return 0;
+}
+
+int sink_writev(OutputSink *sink, const jxr_iovec *parts, uint32_t count) {
+    if (sink->stream && sink->stream->writev) {
+        TraceSpan span("writev", count);
+        for (uint32_t i = 0; i < count; i++) {
+            sink->written += parts[i].size;
+        }
+        return sink->stream->writev(sink->stream->user, parts, count);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (sink_write(sink, parts[i].data, parts[i].size)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int sink_flush(OutputSink *sink) {
+    if (sink->stream && sink->stream->flush) {
+        return sink->stream->flush(sink->stream->user);
+    }
+    return 0;
+}
+
+// Space for the caller to write up to size bytes into the output buffer in place, or null when
+// the output is a stream or a fixed buffer without room
+static uint8_t *sink_reserve(OutputSink *sink, size_t size) {
+    if (sink->stream || sink_grow(sink, size) || sink->written + size > sink->buffer->capacity) {
+        return nullptr;
+    }
+    return sink->buffer->data + sink->written;
+}
+
+static void sink_commit(OutputSink *sink, size_t size) {
+    sink->written += size;
+    sink->buffer->size = sink->written;
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t) (v >> 24);
+    p[1] = (uint8_t) (v >> 16);
+    p[2] = (uint8_t) (v >> 8);
+    p[3] = (uint8_t) v;
+}
+
+// Fills in the length and type in front of the chunk data and returns the CRC that follows it
+static uint32_t chunk_header(uint8_t *header, const char *type, const uint8_t *data, uint32_t size) {
+    put_be32(header, size);
+    memcpy(header + 4, type, 4);
+    uint32_t crc = (uint32_t) crc32(0, header + 4, 4);
+    return (uint32_t) crc32(crc, data, size);
+}
+
+static void make_chunk(uint8_t *chunk, const char *type, uint32_t size) {
+    put_be32(chunk + 8 + size, chunk_header(chunk, type, chunk + 8, size));
+}
+
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size) {
+    return jxr_calloc((const jxr_options *) opaque, items, size, JXR_MEMORY_ENCODER);
+}
+
+static void zlib_free(voidpf opaque, voidpf address) {
+    jxr_free((const jxr_options *) opaque, address);
+}
+
+int deflate_init(z_stream *stream, const jxr_options *options) {
+    bool unfiltered = options->filter_policy == JXR_FILTER_FIXED && options->filter_type == JXR_PNG_FILTER_NONE;
+    int strategy = unfiltered ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+
+    switch (options->strategy) {
+        case JXR_STRATEGY_DEFAULT:
+            strategy = Z_DEFAULT_STRATEGY;
+            break;
+        case JXR_STRATEGY_FILTERED:
+            strategy = Z_FILTERED;
+            break;
+        case JXR_STRATEGY_RLE:
+            strategy = Z_RLE;
+            break;
+        default:
+            break;
+    }
+
+    *stream = {};
+    stream->zalloc = zlib_alloc;
+    stream->zfree = zlib_free;
+    stream->opaque = (voidpf) options;
+
+    int level = options->level ? options->level : Z_DEFAULT_COMPRESSION;
+    int windowBits = options->window_bits ? options->window_bits : 15;
+    if (!options->optimize) {
+        return deflateInit2(stream, level, Z_DEFLATED, windowBits, options->mem_level ? options->mem_level : 8, strategy);
+    }
+
+    // Bigger hash table, and the match search is never cut short by a good enough match
+    int ret = deflateInit2(stream, level, Z_DEFLATED, windowBits, options->mem_level ? options->mem_level : 9,
+                           strategy);
+    if (ret == Z_OK) {
+        ret = deflateTune(stream, OPTIMIZE_GOOD_LENGTH, 258, 258, OPTIMIZE_MAX_CHAIN);
+    }
+    return ret;
+}
+
+// zlib's own estimate: the window and its chain table, the hash table and the pending buffer,
+// plus the stream state
+size_t deflate_memory(const jxr_options *options) {
+    int windowBits = options->window_bits ? options->window_bits : 15;
+    int memLevel = options->mem_level ? options->mem_level : options->optimize ? 9 : 8;
+    return ((size_t) 1 << (windowBits + 2)) + ((size_t) 1 << (memLevel + 9)) + 6 * 1024;
+}
+
+static size_t stored_blocks(size_t size) {
+    return size ? (size + STORED_BLOCK_SIZE - 1) / STORED_BLOCK_SIZE : 1;
+}
+
+// Size of the filtered rows compressed with the options' settings, 0 on failure
+size_t compressed_size(const jxr_options *options, const uint8_t *filtered, size_t size, size_t rowSize) {
+    if (options->deflate == JXR_DEFLATE_STORED) {
+        return 2 + 5 * stored_blocks(size) + size + 4;
+    }
+    if (options->deflate == JXR_DEFLATE_SCREEN) {
+        DeflateParts compressed;
+        if (screen_deflate(options, filtered, size, rowSize, 1, &compressed)) {
+            return 0;
+        }
+        size_t total = 0;
+        for (uint32_t i = 0; i < compressed.count; i++) {
+            total += compressed.parts[i].size;
+        }
+        jxr_free(options, compressed.memory);
+        return total;
+    }
+
+    z_stream stream;
+    if (deflate_init(&stream, options) != Z_OK) {
+        return 0;
+    }
+
+    // Only the size is needed, so the output goes through a small buffer
+    size_t total = 0;
+    auto out = (uint8_t *) jxr_malloc(options, COUNT_BUFFER_SIZE, JXR_MEMORY_ENCODER);
+    if (out != nullptr) {
+        stream.next_in = (Bytef *) filtered;
+        stream.avail_in = (uInt) size;
+        int ret;
+        do {
+            stream.next_out = out;
+            stream.avail_out = COUNT_BUFFER_SIZE;
+            ret = deflate(&stream, Z_FINISH);
+        } while (ret == Z_OK || (ret == Z_BUF_ERROR && stream.avail_out == 0));
+        if (ret == Z_STREAM_END) {
+            total = stream.total_out;
+        }
+    }
+
+    deflateEnd(&stream);
+    jxr_free(options, out);
+    return total;
+}
+
+size_t compressed_size_memory(const jxr_options *options, size_t size) {
+    if (options->deflate == JXR_DEFLATE_STORED) {
+        return 0;
+    }
+    if (options->deflate == JXR_DEFLATE_SCREEN) {
+        return screen_deflate_memory(size, 1);
+    }
+    return deflate_memory(options) + COUNT_BUFFER_SIZE;
+}
+
+static size_t idat_size(const jxr_options *options) {
+    size_t size = options->idat_size ? options->idat_size : IDAT_DEFAULT_SIZE;
+    return size < IDAT_MIN_SIZE ? IDAT_MIN_SIZE : size > IDAT_MAX_SIZE ? IDAT_MAX_SIZE : size;
+}
+
+// Compresses the filtered rows into IDAT chunks. When the output is a buffer, deflate writes
+// straight into it and only the chunk length, type and CRC are filled in around the data.
+static int write_idat(OutputSink *sink, const uint8_t *filtered, size_t size, const char **error) {
+    const jxr_options *options = sink->options;
+    size_t chunkSize = idat_size(options);
+
+    z_stream stream;
+    if (deflate_init(&stream, options) != Z_OK) {
+        *error = "Failed to initialize deflate";
+        return 1;
+    }
+
+    uint8_t *scratch = nullptr;
+    const char *failure = nullptr;
+    int ret = Z_OK;
+
+    stream.next_in = (Bytef *) filtered;
+    for (int64_t index = 0; ret != Z_STREAM_END; index++) {
+        TraceSpan span("deflate IDAT", index);
+        uint8_t *chunk = sink_reserve(sink, chunkSize + 12);
+        if (chunk == nullptr && scratch == nullptr) {
+            scratch = (uint8_t *) jxr_malloc(options, chunkSize + 12, JXR_MEMORY_ENCODER);
+            if (scratch == nullptr) {
+                failure = "Failed to allocate IDAT buffer";
+                break;
+            }
+        }
+        uint8_t *out = chunk ? chunk : scratch;
+
+        stream.next_out = out + 8;
+        stream.avail_out = (uInt) chunkSize;
+
+        while (stream.avail_out && ret != Z_STREAM_END) {
+            // avail_in is 32 bits wide, feed very large images in pieces
+            if (stream.avail_in == 0) {
+                size_t remaining = size - (size_t) (stream.next_in - filtered);
+                stream.avail_in = (uInt) (remaining < (1u << 30) ? remaining : (1u << 30));
+            }
+            size_t consumed = (size_t) (stream.next_in - filtered) + stream.avail_in;
+
+            ret = deflate(&stream, consumed == size ? Z_FINISH : Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END) {
+                break;
+            }
+        }
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            failure = "Failed to compress image data";
+            break;
+        }
+
+        auto produced = (uint32_t) (chunkSize - stream.avail_out);
+        if (produced == 0) {
+            continue;
+        }
+
+        make_chunk(out, "IDAT", produced);
+
+        if (chunk) {
+            sink_commit(sink, produced + 12);
+        } else if (sink_write(sink, out, produced + 12)) {
+            failure = "Failed to write output";
+            break;
+        }
+    }
+
+    deflateEnd(&stream);
+    jxr_free(options, scratch);
+
+    if (failure) {
+        *error = failure;
+        return 1;
+    }
+    return 0;
+}
+
+typedef struct AdlerTask {
+    const uint8_t *data;
+    size_t size;
+    uint32_t tasks;
+    uint32_t *sums;
+} AdlerTask;
+
+static size_t adler_band_start(const AdlerTask *t, uint32_t index) {
+    return (size_t) ((unsigned long long) t->size * index / t->tasks);
+}
+
+static void AdlerFunc(void *arg, uint32_t index) {
+    auto t = (AdlerTask *) arg;
+    TraceSpan span("adler32 band", index);
+    size_t start = adler_band_start(t, index);
+    size_t stop = adler_band_start(t, index + 1);
+
+    uLong sum = adler32(1, nullptr, 0);
+    for (size_t i = start; i < stop;) {
+        auto n = (uInt) (stop - i < (1u << 30) ? stop - i : (1u << 30));
+        sum = adler32(sum, t->data + i, n);
+        i += n;
+    }
+    t->sums[index] = (uint32_t) sum;
+}
+
+// The rows as stored deflate blocks: only the block headers and checksum are new, the pieces
+// in between point into data. The checksum is computed in bands on all threads.
+static int stored_deflate(const jxr_options *options, const uint8_t *data, size_t size, uint32_t numThreads,
+                          DeflateParts *result) {
+    size_t blocks = stored_blocks(size);
+    uint32_t tasks = size / STORED_BLOCK_SIZE + 1 < numThreads ? (uint32_t) (size / STORED_BLOCK_SIZE + 1)
+                                                                 : numThreads;
+    size_t count = 2 * blocks + 1;
+    size_t metaSize = 2 + 5 * blocks + 4;
+
+    auto memory = (uint8_t *) jxr_malloc(options, count * sizeof(jxr_iovec) + tasks * sizeof(uint32_t) + metaSize,
+                                         JXR_MEMORY_ENCODER);
+    if (memory == nullptr) {
+        return 1;
+    }
+
+    auto parts = (jxr_iovec *) memory;
+    auto sums = (uint32_t *) (parts + count);
+    auto meta = (uint8_t *) (sums + tasks);
+
+    AdlerTask task = {data, size, tasks, sums};
+    if (run_parallel(options, tasks, AdlerFunc, &task)) {
+        jxr_free(options, memory);
+        return 1;
+    }
+
+    uLong adler = sums[0];
+    for (uint32_t i = 1; i < tasks; i++) {
+        size_t length = adler_band_start(&task, i + 1) - adler_band_start(&task, i);
+        adler = adler32_combine(adler, sums[i], (z_off_t) length);
+    }
+
+    // 32K window, fastest compression level hint
+    meta[0] = 0x78;
+    meta[1] = 0x01;
+
+    uint8_t *header = meta + 2;
+    const uint8_t *start = meta;
+    for (size_t b = 0; b < blocks; b++, header += 5) {
+        size_t offset = b * STORED_BLOCK_SIZE;
+        auto len = (uint16_t) (size - offset < STORED_BLOCK_SIZE ? size - offset : STORED_BLOCK_SIZE);
+        header[0] = b + 1 == blocks;
+        header[1] = (uint8_t) len;
+        header[2] = (uint8_t) (len >> 8);
+        header[3] = (uint8_t) ~len;
+        header[4] = (uint8_t) (~len >> 8);
+
+        parts[2 * b] = {start, (size_t) (header + 5 - start)};
+        parts[2 * b + 1] = {data + offset, len};
+        start = header + 5;
+    }
+
+    put_be32(header, (uint32_t) adler);
+    parts[count - 1] = {header, 4};
+
+    result->memory = memory;
+    result->parts = parts;
+    result->count = (uint32_t) count;
+    return 0;
+}
+
+// Splits the pieces of a zlib stream into IDAT chunks, without copying them
+static int write_idat_parts(OutputSink *sink, const jxr_iovec *parts, uint32_t count) {
+    size_t chunkSize = idat_size(sink->options);
+    uint32_t part = 0;
+    size_t offset = 0;
+
+    while (part < count) {
+        jxr_iovec iov[JXR_MAX_IOVECS];
+        uint8_t header[8];
+        uint8_t crc[4];
+        uint32_t n = 1;
+        size_t size = 0;
+
+        memcpy(header + 4, "IDAT", 4);
+        uint32_t sum = (uint32_t) crc32(0, header + 4, 4);
+
+        while (part < count && size < chunkSize && n < JXR_MAX_IOVECS - 1) {
+            size_t take = parts[part].size - offset;
+            take = take < chunkSize - size ? take : chunkSize - size;
+
+            auto data = (const uint8_t *) parts[part].data + offset;
+            iov[n++] = {data, take};
+            sum = (uint32_t) crc32(sum, data, (uInt) take);
+            size += take;
+            offset += take;
+
+            if (offset == parts[part].size) {
+                part++;
+                offset = 0;
+            }
+        }
+
+        if (size == 0) {
+            continue;
+        }
+
+        put_be32(header, (uint32_t) size);
+        put_be32(crc, sum);
+        iov[0] = {header, 8};
+        iov[n++] = {crc, 4};
+
+        if (sink_writev(sink, iov, n)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Worst case for the layout written below: the fixed chunks, plus the filtered rows as stored
+// deflate blocks (using zlib's conservative deflateBound for non-default window and memory
+// settings) split into the smallest allowed IDAT chunks
+size_t png_size_bound(uint32_t width, uint32_t height) {
+    size_t raw = filtered_size(width, height);
+    size_t zlib = raw + ((raw + 7) >> 3) + ((raw + 63) >> 6) + 5 + 6;
+    size_t idatChunks = zlib / IDAT_MIN_SIZE + 1;
+
+    return 8 + 25 + sizeof(png_static_chunks) + 20 + zlib + idatChunks * 12 + 12;
+}
+
+int write_png_file(OutputSink *sink, const uint8_t *filtered, uint32_t width, uint32_t height, uint32_t numThreads,
+                   uint32_t maxCLL, uint32_t maxFALL, const char **error) {
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+    // 16-bit RGB, no interlacing
+    uint8_t ihdr[25];
+    put_be32(ihdr + 8, width);
+    put_be32(ihdr + 12, height);
+    ihdr[16] = INTERMEDIATE_BITS;
+    ihdr[17] = 2;
+    ihdr[18] = 0;
+    ihdr[19] = 0;
+    ihdr[20] = 0;
+    make_chunk(ihdr, "IHDR", 13);
+
+    uint8_t clli[20];
+    put_be32(clli + 8, maxCLL);
+    put_be32(clli + 12, maxFALL);
+    make_chunk(clli, "cLLi", 8);
+
+    jxr_iovec header[] = {
+            {signature, sizeof(signature)},
+            {ihdr, sizeof(ihdr)},
+            {png_static_chunks, sizeof(png_static_chunks)},
+            {clli, sizeof(clli)},
+    };
+
+    // Let streaming consumers see the header chunks before compression starts
+    if (sink_writev(sink, header, sizeof(header) / sizeof(header[0])) || sink_flush(sink)) {
+        *error = "Failed to write output";
+        return 1;
+    }
+
+    size_t size = filtered_size(width, height);
+
+    if (sink->options->deflate == JXR_DEFLATE_SCREEN || sink->options->deflate == JXR_DEFLATE_STORED) {
+        DeflateParts compressed;
+        int failed = sink->options->deflate == JXR_DEFLATE_STORED
+                     ? stored_deflate(sink->options, filtered, size, numThreads, &compressed)
+                     : screen_deflate(sink->options, filtered, size, 1 + (size_t) width * 6, numThreads, &compressed);
+        if (failed) {
+            *error = "Failed to compress image data";
+            return 1;
+        }
+
+        int ret = write_idat_parts(sink, compressed.parts, compressed.count);
+        jxr_free(sink->options, compressed.memory);
+
+        if (ret) {
+            *error = "Failed to write output";
+            return 1;
+        }
+    } else if (write_idat(sink, filtered, size, error)) {
+        return 1;
+    }
+
+    uint8_t iend[12];
+    make_chunk(iend, "IEND", 0);
+
+    if (sink_write(sink, iend, sizeof(iend)) || sink_flush(sink)) {
+        *error = "Failed to write output";
+        return 1;
+    }
+
+    return 0;
+}
+
+size_t encode_memory(const jxr_options *options, uint32_t width, uint32_t height, uint32_t numThreads) {
+    size_t size = filtered_size(width, height);
+    if (options->deflate == JXR_DEFLATE_SCREEN) {
+        return screen_deflate_memory(size, numThreads);
+    }
+    if (options->deflate == JXR_DEFLATE_STORED) {
+        size_t blocks = stored_blocks(size);
+        return (2 * blocks + 1) * sizeof(jxr_iovec) + numThreads * sizeof(uint32_t) + 2 + 5 * blocks + 4;
+    }
+    // A stream sink needs a chunk of scratch to compress into
+    return deflate_memory(options) + idat_size(options) + 12;
+}
@@ -0,0 +1,263 @@
+// Vectorized PNG row filtering for 16-bit RGB rows (6 bytes per pixel). The filters are applied to
+// the raw neighbouring rows, so every byte of a row can be computed independently.
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <immintrin.h>
+#include "internal.h"
+
+#define BPP 6  // bytes per pixel, the distance of the left neighbour
+#define FAST_SAMPLE_STRIDE 64  // the fast policy scores one 16-byte block out of every 64 bytes
+
+static inline uint8_t filter_byte(int type, const uint8_t *row, const uint8_t *prev, size_t i) {
+    int x = row[i];
+    int a = i >= BPP ? row[i - BPP] : 0;
+    int b = prev[i];
+    int c = i >= BPP ? prev[i - BPP] : 0;
+
+    switch (type) {
+        case JXR_PNG_FILTER_SUB:
+            return (uint8_t) (x - a);
+        case JXR_PNG_FILTER_UP:
+            return (uint8_t) (x - b);
+        case JXR_PNG_FILTER_AVERAGE:
+            return (uint8_t) (x - ((a + b) >> 1));
+        case JXR_PNG_FILTER_PAETH: {
+            int pa = abs(b - c);
+            int pb = abs(a - c);
+            int pc = abs(a + b - 2 * c);
+            return (uint8_t) (x - (pa <= pb && pa <= pc ? a : pb <= pc ? b : c));
+        }
+        default:
+            return (uint8_t) x;
+    }
+}
+
+// Same tie-breaking as the scalar version: a, then b, then c
+static inline __m128i paeth_predict(__m128i a, __m128i b, __m128i c) {
+    __m128i pa = _mm_abs_epi16(_mm_sub_epi16(b, c));
+    __m128i pb = _mm_abs_epi16(_mm_sub_epi16(a, c));
+    __m128i pc = _mm_abs_epi16(_mm_add_epi16(_mm_sub_epi16(b, c), _mm_sub_epi16(a, c)));
+
+    __m128i notA = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+    __m128i bc = _mm_blendv_epi8(b, c, _mm_cmpgt_epi16(pb, pc));
+    return _mm_blendv_epi8(a, bc, notA);
+}
+
+// Filters the 16 bytes at offset i, which must be at least BPP
+template<int type>
+static inline __m128i filter_block(const uint8_t *row, const uint8_t *prev, size_t i) {
+    __m128i x = _mm_loadu_si128((const __m128i *) (row + i));
+
+    if (type == JXR_PNG_FILTER_NONE) {
+        return x;
+    }
+    if (type == JXR_PNG_FILTER_UP) {
+        return _mm_sub_epi8(x, _mm_loadu_si128((const __m128i *) (prev + i)));
+    }
+
+    __m128i a = _mm_loadu_si128((const __m128i *) (row + i - BPP));
+    if (type == JXR_PNG_FILTER_SUB) {
+        return _mm_sub_epi8(x, a);
+    }
+
+    __m128i b = _mm_loadu_si128((const __m128i *) (prev + i));
+    if (type == JXR_PNG_FILTER_AVERAGE) {
+        // _mm_avg_epu8 rounds up, the filter rounds down
+        __m128i odd = _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1));
+        return _mm_sub_epi8(x, _mm_sub_epi8(_mm_avg_epu8(a, b), odd));
+    }
+
+    __m128i c = _mm_loadu_si128((const __m128i *) (prev + i - BPP));
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = paeth_predict(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+    __m128i hi = paeth_predict(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+    return _mm_sub_epi8(x, _mm_packus_epi16(lo, hi));
+}
+
+// Sum of absolute values of the filtered bytes read as signed, the heuristic libpng uses
+static inline uint64_t score_byte(uint8_t v) {
+    return v < 128 ? v : 256 - v;
+}
+
+static inline __m128i score_block(__m128i f) {
+    return _mm_sad_epu8(_mm_abs_epi8(f), _mm_setzero_si128());
+}
+
+static inline uint64_t score_total(__m128i sum) {
+    return (uint64_t) _mm_cvtsi128_si64(sum) + (uint64_t) _mm_extract_epi64(sum, 1);
+}
+
+// Filters a whole row into out and returns its score
+template<int type>
+static uint64_t filter_row(const uint8_t *row, const uint8_t *prev, size_t length, uint8_t *out) {
+    uint64_t score = 0;
+    size_t i = 0;
+
+    for (; i < BPP && i < length; i++) {
+        out[i] = filter_byte(type, row, prev, i);
+        score += score_byte(out[i]);
+    }
+
+    __m128i sum = _mm_setzero_si128();
+    for (; i + 16 <= length; i += 16) {
+        __m128i f = filter_block<type>(row, prev, i);
+        _mm_storeu_si128((__m128i *) (out + i), f);
+        sum = _mm_add_epi64(sum, score_block(f));
+    }
+
+    for (; i < length; i++) {
+        out[i] = filter_byte(type, row, prev, i);
+        score += score_byte(out[i]);
+    }
+
+    return score + score_total(sum);
+}
+
+// Estimates the score of a row from a sample of its blocks, without storing anything
+template<int type>
+static uint64_t sample_row(const uint8_t *row, const uint8_t *prev, size_t length) {
+    __m128i sum = _mm_setzero_si128();
+    for (size_t i = BPP; i + 16 <= length; i += FAST_SAMPLE_STRIDE) {
+        sum = _mm_add_epi64(sum, score_block(filter_block<type>(row, prev, i)));
+    }
+    return score_total(sum);
+}
+
+// Bits needed to code the row's bytes with an order-0 model of the row itself
+static double row_entropy(const uint8_t *row, size_t length) {
+    uint32_t counts[256] = {};
+    for (size_t i = 0; i < length; i++) {
+        counts[row[i]]++;
+    }
+
+    double bits = (double) length * std::log2((double) length);
+    for (int v = 0; v < 256; v++) {
+        if (counts[v]) {
+            bits -= counts[v] * std::log2((double) counts[v]);
+        }
+    }
+    return bits;
+}
+
+typedef uint64_t (*FilterRowFn)(const uint8_t *row, const uint8_t *prev, size_t length, uint8_t *out);
+typedef uint64_t (*SampleRowFn)(const uint8_t *row, const uint8_t *prev, size_t length);
+
+static const FilterRowFn filter_rows[5] = {
+        filter_row<JXR_PNG_FILTER_NONE>, filter_row<JXR_PNG_FILTER_SUB>, filter_row<JXR_PNG_FILTER_UP>,
+        filter_row<JXR_PNG_FILTER_AVERAGE>, filter_row<JXR_PNG_FILTER_PAETH>,
+};
+
+static const SampleRowFn sample_rows[5] = {
+        sample_row<JXR_PNG_FILTER_NONE>, sample_row<JXR_PNG_FILTER_SUB>, sample_row<JXR_PNG_FILTER_UP>,
+        sample_row<JXR_PNG_FILTER_AVERAGE>, sample_row<JXR_PNG_FILTER_PAETH>,
+};
+
+// Filters rows [start, stop) of the image into out. zeroRow stands in for the row above the
+// first one, scratch holds two rows for the adaptive policies.
+void filter_band(const uint8_t *data, uint32_t width, uint32_t start, uint32_t stop, jxr_filter_policy policy,
+                 jxr_png_filter fixedType, const uint8_t *zeroRow, uint8_t *scratch, uint8_t *out) {
+    size_t length = (size_t) width * BPP;
+    uint8_t *candidate = scratch;
+    uint8_t *best = scratch + length;
+
+    for (uint32_t y = start; y < stop; y++, out += length + 1) {
+        const uint8_t *row = data + y * length;
+        const uint8_t *prev = y ? row - length : zeroRow;
+
+        int type = fixedType;
+
+        if (policy == JXR_FILTER_FAST && length >= BPP + 16) {
+            uint64_t bestScore = UINT64_MAX;
+            for (int f = 0; f < 5; f++) {
+                uint64_t score = sample_rows[f](row, prev, length);
+                if (score < bestScore) {
+                    bestScore = score;
+                    type = f;
+                }
+            }
+        } else if (policy != JXR_FILTER_FIXED) {
+            // Ties go to the earlier filter, as in libpng
+            double bestScore = DBL_MAX;
+            // Sub, Average and Paeth depend on the previous pixel when unfiltering, which keeps
+            // decoders from vectorizing them at 6 bytes per pixel
+            bool decodeFast = policy == JXR_FILTER_DECODE_FAST;
+            for (int f = 0; f < 5; f++) {
+                if (decodeFast && f != JXR_PNG_FILTER_NONE && f != JXR_PNG_FILTER_UP) {
+                    continue;
+                }
+                double score = (double) filter_rows[f](row, prev, length, candidate);
+                if (policy == JXR_FILTER_ENTROPY) {
+                    score = row_entropy(candidate, length);
+                }
+                if (score < bestScore) {
+                    bestScore = score;
+                    type = f;
+                    uint8_t *tmp = best;
+                    best = candidate;
+                    candidate = tmp;
+                }
+            }
+            out[0] = (uint8_t) type;
+            memcpy(out + 1, best, length);
+            continue;
+        }
+
+        out[0] = (uint8_t) type;
+        filter_rows[type](row, prev, length, out + 1);
+    }
+}
+
+typedef struct FilterTask {
+    const uint8_t *data;
+    const uint8_t *zeroRow;
+    uint8_t *out;
+    uint8_t *scratch;
+    uint32_t width;
+    uint32_t height;
+    uint32_t tasks;
+    jxr_filter_policy policy;
+    jxr_png_filter type;
+} FilterTask;
+
+static void FilterFunc(void *arg, uint32_t index) {
+    auto t = (FilterTask *) arg;
+    TraceSpan span("filter rows", index);
+    size_t length = (size_t) t->width * BPP;
+    uint32_t start = (uint32_t) ((uint64_t) t->height * index / t->tasks);
+    uint32_t stop = (uint32_t) ((uint64_t) t->height * (index + 1) / t->tasks);
+
+    filter_band(t->data, t->width, start, stop, t->policy, t->type, t->zeroRow, t->scratch + 2 * length * index,
+                t->out + start * (length + 1));
+}
+
+size_t filtered_size(uint32_t width, uint32_t height) {
+    return (size_t) height * (1 + (size_t) width * 6);
+}
+
+int filter_image(const jxr_options *options, const uint8_t *data, uint32_t width, uint32_t height,
+                 uint32_t numThreads, uint8_t *out) {
+    FilterTask task;
+    task.data = data;
+    task.out = out;
+    task.width = width;
+    task.height = height;
+    task.tasks = numThreads < height ? numThreads : height;
+    task.policy = options->filter_policy;
+    task.type = options->filter_type;
+
+    size_t length = (size_t) width * BPP;
+    size_t scratchSize = task.policy != JXR_FILTER_FIXED ? 2 * length * task.tasks : 0;
+    auto zeroRow = (uint8_t *) jxr_calloc(options, 1, length + scratchSize, JXR_MEMORY_OTHER);
+    if (zeroRow == nullptr) {
+        return 1;
+    }
+    task.zeroRow = zeroRow;
+    task.scratch = zeroRow + length;
+
+    int ret = run_parallel(options, task.tasks, FilterFunc, &task);
+
+    jxr_free(options, zeroRow);
+    return ret;
+}
@@ -0,0 +1,35 @@
+// Raw 16-bit PPM and PAM output, for pipeline stages that would decode a PNG again right away. The
+// samples are the same big endian PQ values the PNG holds, and the PNG's color and light level
+// metadata goes into header comments.
+#include <cstdio>
+#include "internal.h"
+
+int write_pnm_file(OutputSink *sink, const uint8_t *data, uint32_t width, uint32_t height, uint16_t maxCLL,
+                   uint16_t maxFALL, const char **error) {
+    char comments[192];
+    snprintf(comments, sizeof(comments),
+             "# BT.2100 PQ, cICP 9 16 0 1, %d significant bits\n"
+             "# cLLi MaxCLL %u MaxFALL %u\n", TARGET_BITS, maxCLL, maxFALL);
+
+    char header[384];
+    int length;
+    if (sink->options->format == JXR_FORMAT_PAM) {
+        length = snprintf(header, sizeof(header),
+                          "P7\n%sWIDTH %u\nHEIGHT %u\nDEPTH 3\nMAXVAL %u\nTUPLTYPE RGB\nENDHDR\n", comments, width,
+                          height, (1u << INTERMEDIATE_BITS) - 1);
+    } else {
+        length = snprintf(header, sizeof(header), "P6\n%s%u %u\n%u\n", comments, width, height,
+                          (1u << INTERMEDIATE_BITS) - 1);
+    }
+
+    jxr_iovec parts[] = {
+            {header, (size_t) length},
+            {data, (size_t) width * height * 6},
+    };
+
+    if (sink_writev(sink, parts, 2) || sink_flush(sink)) {
+        *error = "Failed to write output";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,165 @@
+// Quality of the output: ΔE-ITP (BT.2124), PSNR of the PQ signal and the largest code error,
+// comparing the source with what the output samples decode to
+#include <cfloat>
+#include "convert_kernels.h"
+
+#define PQ_CODES (1 << TARGET_BITS)
+
+// BT.2020 to LMS and PQ L'M'S' to ITP, with T already halved as BT.2124 asks. Rows are the input
+// components, the last one is zero so the w lane drops out of both.
+static const XMMATRIX bt2020_to_lms(
+        1688.0f / 4096, 683.0f / 4096,  99.0f / 4096,   0,
+        2146.0f / 4096, 2951.0f / 4096, 309.0f / 4096,  0,
+        262.0f / 4096,  462.0f / 4096,  3688.0f / 4096, 0,
+        0,              0,              0,              0);
+
+static const XMMATRIX lms_to_itp(
+        0.5f, 0.5f * 6610 / 4096,   17933.0f / 4096, 0,
+        0.5f, 0.5f * -13613 / 4096, -17390.0f / 4096, 0,
+        0,    0.5f * 7003 / 4096,   -543.0f / 4096,  0,
+        0,    0,                    0,               0);
+
+static const XMVECTOR itp_scale = XMVectorReplicate(720.0f);
+static const XMVECTOR pq_floor = XMVectorReplicate(1e-30f);
+
+// pow as exp2(y * log2(x)), which DirectXMath vectorizes, unlike XMVectorPow
+static inline XMVECTOR vector_pow(XMVECTOR x, XMVECTOR y) {
+    return XMVectorExp2(XMVectorMultiply(y, XMVectorLog2(XMVectorMax(x, pq_floor))));
+}
+
+static inline XMVECTOR pq_encode(XMVECTOR y) {
+    XMVECTOR pow1 = vector_pow(y, vm1);
+    return vector_pow(
+            XMVectorDivide(
+                    XMVectorAdd(vc1, XMVectorMultiply(vc2, pow1)),
+                    XMVectorAdd(g_XMOne, XMVectorMultiply(vc3, pow1))),
+            vm2);
+}
+
+static inline XMVECTOR ictcp(XMVECTOR bt2020) {
+    return XMVector3Transform(pq_encode(XMVector3Transform(bt2020, bt2020_to_lms)), lms_to_itp);
+}
+
+typedef struct QualityStats {
+    uint64_t pixels;
+    double sumDeltaE;
+    double sumSquaredError;
+    float maxDeltaE;
+    float maxError;  // PQ signal
+} QualityStats;
+
+typedef struct QualityTask {
+    const uint8_t *pixels;
+    size_t stride;
+    const uint8_t *converted;
+    const float *eotf;  // linear light of each code
+    uint32_t width;
+    uint32_t height;
+    uint32_t step;
+    uint32_t tasks;
+    uint8_t bytesPerColor;
+    QualityStats *stats;
+} QualityTask;
+
+static void QualityFunc(void *arg, uint32_t index) {
+    auto t = (QualityTask *) arg;
+    TraceSpan span("quality rows", index);
+    QualityStats s = {};
+
+    const XMVECTOR codeScale = XMVectorReplicate(1.0f / (PQ_CODES - 1));
+    const XMVECTOR rgbMask = g_XMSelect1110;
+    XMVECTOR maxDeltaE = g_XMZero;
+    XMVECTOR maxError = g_XMZero;
+
+    // Rows are dealt out round robin so every task gets a share of each part of the image
+    for (uint32_t i = index * t->step; i < t->height; i += t->tasks * t->step) {
+        const uint8_t *row = t->pixels + i * t->stride;
+        const uint8_t *out = t->converted + (size_t) i * t->width * 6;
+        XMVECTOR sumDeltaE = g_XMZero;
+        XMVECTOR sumSquared = g_XMZero;
+
+        for (uint32_t j = 0; j < t->width; j++) {
+            XMVECTOR source = load_pixel(row, j, t->bytesPerColor);
+
+            const uint8_t *p = out + (size_t) 6 * j;
+            uint32_t r = (uint32_t) (p[0] << 8 | p[1]) >> (INTERMEDIATE_BITS - TARGET_BITS);
+            uint32_t g = (uint32_t) (p[2] << 8 | p[3]) >> (INTERMEDIATE_BITS - TARGET_BITS);
+            uint32_t b = (uint32_t) (p[4] << 8 | p[5]) >> (INTERMEDIATE_BITS - TARGET_BITS);
+            XMVECTOR decoded = XMVectorSet(t->eotf[r], t->eotf[g], t->eotf[b], 0);
+            XMVECTOR signal = XMVectorMultiply(XMVectorSet((float) r, (float) g, (float) b, 0), codeScale);
+
+            XMVECTOR error = XMVectorAndInt(XMVectorSubtract(signal, pq_encode(source)), rgbMask);
+            sumSquared = XMVectorMultiplyAdd(error, error, sumSquared);
+            maxError = XMVectorMax(maxError, XMVectorAbs(error));
+
+            XMVECTOR deltaE = XMVectorMultiply(XMVector3Length(XMVectorSubtract(ictcp(source), ictcp(decoded))),
+                                               itp_scale);
+            sumDeltaE = XMVectorAdd(sumDeltaE, deltaE);
+            maxDeltaE = XMVectorMax(maxDeltaE, deltaE);
+        }
+
+        // Sums in float are fine for one row, the image total needs double
+        XMFLOAT4A squared;
+        XMStoreFloat4A(&squared, sumSquared);
+        s.sumSquaredError += (double) squared.x + squared.y + squared.z;
+        s.sumDeltaE += XMVectorGetX(sumDeltaE);
+        s.pixels += t->width;
+    }
+
+    XMFLOAT4A errors;
+    XMStoreFloat4A(&errors, maxError);
+    s.maxError = fmaxf(errors.x, fmaxf(errors.y, errors.z));
+    s.maxDeltaE = XMVectorGetX(maxDeltaE);
+    t->stats[index] = s;
+}
+
+int measure_quality(const jxr_options *options, const jxr_image *image, const uint8_t *converted,
+                    uint32_t numThreads, jxr_quality *quality) {
+    uint32_t step = options->quality ? options->quality : 1;
+    uint32_t rows = (image->height + step - 1) / step;
+    uint32_t tasks = numThreads < rows ? numThreads : rows;
+
+    auto memory = (uint8_t *) jxr_malloc(options, PQ_CODES * sizeof(float) + tasks * sizeof(QualityStats),
+                                         JXR_MEMORY_OTHER);
+    if (memory == nullptr) {
+        return 1;
+    }
+    auto eotf = (float *) memory;
+    auto stats = (QualityStats *) (memory + PQ_CODES * sizeof(float));
+
+    // The PQ EOTF of every code, in double
+    const double m1 = 1305.0 / 8192, m2 = 2523.0 / 32, c1 = 107.0 / 128, c2 = 2413.0 / 128, c3 = 2392.0 / 128;
+    for (uint32_t code = 0; code < PQ_CODES; code++) {
+        double p = pow((double) code / (PQ_CODES - 1), 1 / m2);
+        double numerator = p - c1 > 0 ? p - c1 : 0;
+        eotf[code] = (float) pow(numerator / (c2 - c3 * p), 1 / m1);
+    }
+
+    uint8_t bytesPerColor = (uint8_t) image->format;
+    QualityTask task = {(const uint8_t *) image->pixels,
+                        image->stride ? image->stride : (size_t) image->width * bytesPerColor * 4,
+                        converted, eotf, image->width, image->height, step, tasks, bytesPerColor, stats};
+
+    if (run_parallel(options, tasks, QualityFunc, &task)) {
+        jxr_free(options, memory);
+        return 1;
+    }
+
+    QualityStats total = {};
+    for (uint32_t i = 0; i < tasks; i++) {
+        total.pixels += stats[i].pixels;
+        total.sumDeltaE += stats[i].sumDeltaE;
+        total.sumSquaredError += stats[i].sumSquaredError;
+        total.maxDeltaE = fmaxf(total.maxDeltaE, stats[i].maxDeltaE);
+        total.maxError = fmaxf(total.maxError, stats[i].maxError);
+    }
+    jxr_free(options, memory);
+
+    double mse = total.sumSquaredError / (3.0 * (double) total.pixels);
+    quality->pixels = total.pixels;
+    quality->delta_e_itp_mean = total.sumDeltaE / (double) total.pixels;
+    quality->delta_e_itp_max = total.maxDeltaE;
+    quality->psnr_pq = mse > 0 ? -10 * log10(mse) : DBL_MAX;
+    quality->max_code_error = total.maxError * (PQ_CODES - 1);
+    return 0;
+}
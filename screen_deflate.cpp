@@ -0,0 +1,594 @@
+// Fast deflate encoder for filtered screenshot rows. Flat areas and repeated rows turn into long
+// runs after filtering, so instead of a general match search it first tries the distances those
+// produce: the previous byte, the previous pixel and the previous row. Only when none of them
+// gives a long match, a single hash table entry is checked for repeated content elsewhere, such
+// as text. Bands of the image are compressed in parallel and joined like pigz does, with empty
+// stored blocks between them.
+#include <cstring>
+#include "internal.h"
+
+#ifdef JXR_SYSTEM_ZLIB
+#include <zlib.h>
+#else
+#include "zlib/zlib.h"
+#endif
+
+#define MIN_MATCH 4  // shorter matches rarely beat literals at these distances
+#define MAX_MATCH 258
+#define WINDOW_SIZE 32768
+#define BLOCK_TOKENS 32768
+#define MIN_BAND_SIZE (256 * 1024)
+#define GOOD_MATCH 32  // long enough to skip the hash table lookup
+#define HASH_BITS 15
+
+#define LITLEN_CODES 286
+#define DIST_CODES 30
+#define CODELEN_CODES 19
+#define MAX_BITS 15
+#define MAX_CODELEN_BITS 7
+
+static const uint16_t length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+                                         67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5,
+                                         5, 5, 5, 0};
+static const uint16_t dist_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513,
+                                       769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t dist_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10,
+                                       11, 11, 12, 12, 13, 13};
+static const uint8_t codelen_order[CODELEN_CODES] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1,
+                                                     15};
+
+typedef struct LengthCodes {
+    uint8_t code[MAX_MATCH + 1];
+} LengthCodes;
+
+static LengthCodes make_length_codes() {
+    LengthCodes t = {};
+    for (int code = 0; code < 28; code++) {
+        for (int len = length_base[code]; len < length_base[code + 1]; len++) {
+            t.code[len] = (uint8_t) code;
+        }
+    }
+    t.code[MAX_MATCH] = 28;
+    return t;
+}
+
+static const LengthCodes length_codes = make_length_codes();
+
+static inline int dist_code(uint32_t dist) {
+    int code = 0;
+    while (code < 29 && dist_base[code + 1] <= dist) {
+        code++;
+    }
+    return code;
+}
+
+// A literal byte, or a match with the length in bits 16-24 and the distance in bits 0-15
+#define TOKEN_MATCH 0x80000000u
+
+typedef struct BitWriter {
+    uint8_t *out;
+    size_t pos;
+    uint64_t bits;
+    int count;
+} BitWriter;
+
+static inline void put_bits(BitWriter *w, uint32_t value, int n) {
+    w->bits |= (uint64_t) value << w->count;
+    w->count += n;
+    if (w->count >= 32) {
+        auto v = (uint32_t) w->bits;
+        memcpy(w->out + w->pos, &v, 4);  // deflate is little endian like the targets we build for
+        w->pos += 4;
+        w->bits >>= 32;
+        w->count -= 32;
+    }
+}
+
+static void align_bits(BitWriter *w) {
+    while (w->count > 0) {
+        w->out[w->pos++] = (uint8_t) w->bits;
+        w->bits >>= 8;
+        w->count -= 8;
+    }
+    w->bits = 0;
+    w->count = 0;
+}
+
+typedef struct HuffmanCode {
+    uint16_t codes[LITLEN_CODES];
+    uint8_t lengths[LITLEN_CODES];
+} HuffmanCode;
+
+// Code lengths limited to maxBits, by flattening the frequencies until the tree is shallow enough
+static void build_lengths(const uint32_t *freq, int n, int maxBits, uint8_t *lengths) {
+    uint32_t weights[LITLEN_CODES];
+    uint16_t symbols[LITLEN_CODES];
+    uint32_t nodeWeight[LITLEN_CODES];
+    uint16_t parent[2 * LITLEN_CODES];
+    uint8_t depth[2 * LITLEN_CODES];
+
+    memcpy(weights, freq, sizeof(uint32_t) * n);
+
+    while (true) {
+        int used = 0;
+        for (int i = 0; i < n; i++) {
+            lengths[i] = 0;
+            if (weights[i]) {
+                symbols[used++] = (uint16_t) i;
+            }
+        }
+
+        // Insertion sort by weight, the alphabets are small
+        for (int i = 1; i < used; i++) {
+            uint16_t s = symbols[i];
+            int j = i;
+            while (j > 0 && weights[symbols[j - 1]] > weights[s]) {
+                symbols[j] = symbols[j - 1];
+                j--;
+            }
+            symbols[j] = s;
+        }
+
+        // Two-queue construction: leaves are nodes [0, used), internal nodes follow in the order
+        // they are created, which is also increasing weight
+        int leaf = 0;
+        int internal = 0;
+        int created = 0;
+        for (int k = 0; k < used - 1; k++) {
+            int pick[2];
+            uint32_t sum = 0;
+            for (int &p : pick) {
+                if (leaf < used && (internal == created || weights[symbols[leaf]] <= nodeWeight[internal])) {
+                    p = leaf;
+                    sum += weights[symbols[leaf++]];
+                } else {
+                    p = used + internal;
+                    sum += nodeWeight[internal++];
+                }
+            }
+            nodeWeight[created] = sum;
+            parent[pick[0]] = parent[pick[1]] = (uint16_t) (used + created);
+            created++;
+        }
+
+        int maxDepth = 0;
+        if (used > 1) {
+            depth[used + created - 1] = 0;
+            for (int node = used + created - 2; node >= 0; node--) {
+                depth[node] = (uint8_t) (depth[parent[node]] + 1);
+            }
+            for (int i = 0; i < used; i++) {
+                lengths[symbols[i]] = depth[i];
+                if (depth[i] > maxDepth) {
+                    maxDepth = depth[i];
+                }
+            }
+        } else if (used == 1) {
+            lengths[symbols[0]] = 1;
+        }
+
+        if (maxDepth <= maxBits) {
+            return;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (weights[i]) {
+                weights[i] = (weights[i] >> 1) | 1;
+            }
+        }
+    }
+}
+
+// Canonical codes, bit-reversed because deflate sends Huffman codes starting at the top bit
+static void build_codes(HuffmanCode *h, int n) {
+    uint16_t count[MAX_BITS + 1] = {};
+    uint16_t next[MAX_BITS + 1];
+
+    for (int i = 0; i < n; i++) {
+        count[h->lengths[i]]++;
+    }
+    count[0] = 0;
+
+    uint16_t code = 0;
+    for (int bits = 1; bits <= MAX_BITS; bits++) {
+        code = (uint16_t) ((code + count[bits - 1]) << 1);
+        next[bits] = code;
+    }
+
+    for (int i = 0; i < n; i++) {
+        int len = h->lengths[i];
+        if (len) {
+            uint16_t c = next[len]++;
+            uint16_t reversed = 0;
+            for (int b = 0; b < len; b++) {
+                reversed = (uint16_t) ((reversed << 1) | ((c >> b) & 1));
+            }
+            h->codes[i] = reversed;
+        }
+    }
+}
+
+static void make_code(const uint32_t *freq, int n, int maxBits, HuffmanCode *h) {
+    build_lengths(freq, n, maxBits, h->lengths);
+    build_codes(h, n);
+}
+
+typedef struct Block {
+    const uint32_t *tokens;
+    uint32_t count;
+    const uint8_t *raw;  // the input bytes the tokens cover, for the stored fallback
+    size_t rawSize;
+} Block;
+
+// Emits the block as a dynamic Huffman block, or as stored blocks if that is smaller
+static void write_block(BitWriter *w, const Block *b, bool last) {
+    uint32_t litFreq[LITLEN_CODES] = {};
+    uint32_t distFreq[DIST_CODES] = {};
+
+    for (uint32_t i = 0; i < b->count; i++) {
+        uint32_t t = b->tokens[i];
+        if (t & TOKEN_MATCH) {
+            litFreq[257 + length_codes.code[(t >> 16) & 0x1ff]]++;
+            distFreq[dist_code(t & 0xffff)]++;
+        } else {
+            litFreq[t]++;
+        }
+    }
+    litFreq[256] = 1;
+
+    // Inflaters reject some degenerate codes, so keep at least two symbols in each alphabet
+    if (!litFreq[0]) {
+        litFreq[0] = 1;
+    }
+    distFreq[0] += !distFreq[0];
+    distFreq[1] += !distFreq[1];
+
+    HuffmanCode lit, dist;
+    make_code(litFreq, LITLEN_CODES, MAX_BITS, &lit);
+    make_code(distFreq, DIST_CODES, MAX_BITS, &dist);
+
+    int hlit = LITLEN_CODES;
+    while (hlit > 257 && lit.lengths[hlit - 1] == 0) {
+        hlit--;
+    }
+    int hdist = DIST_CODES;
+    while (hdist > 1 && dist.lengths[hdist - 1] == 0) {
+        hdist--;
+    }
+
+    // Run-length encode both code length sequences as one, with symbols 16 (repeat previous),
+    // 17 and 18 (runs of zeros)
+    uint8_t lengths[LITLEN_CODES + DIST_CODES];
+    memcpy(lengths, lit.lengths, hlit);
+    memcpy(lengths + hlit, dist.lengths, hdist);
+    int total = hlit + hdist;
+
+    uint8_t clSymbols[LITLEN_CODES + DIST_CODES];
+    uint8_t clExtra[LITLEN_CODES + DIST_CODES];
+    int clCount = 0;
+    uint32_t clFreq[CODELEN_CODES] = {};
+
+    for (int i = 0; i < total;) {
+        uint8_t len = lengths[i];
+        int run = 1;
+        while (i + run < total && lengths[i + run] == len) {
+            run++;
+        }
+
+        if (len == 0 && run >= 11) {
+            run = run > 138 ? 138 : run;
+            clSymbols[clCount] = 18;
+            clExtra[clCount++] = (uint8_t) (run - 11);
+        } else if (len == 0 && run >= 3) {
+            clSymbols[clCount] = 17;
+            clExtra[clCount++] = (uint8_t) (run - 3);
+        } else if (len != 0 && run >= 4) {
+            run = run > 7 ? 7 : run;
+            clSymbols[clCount] = len;
+            clExtra[clCount++] = 0;
+            clSymbols[clCount] = 16;
+            clExtra[clCount++] = (uint8_t) (run - 4);
+        } else {
+            run = 1;
+            clSymbols[clCount] = len;
+            clExtra[clCount++] = 0;
+        }
+        i += run;
+    }
+
+    for (int i = 0; i < clCount; i++) {
+        clFreq[clSymbols[i]]++;
+    }
+    for (int i = 0; clFreq[0] + clFreq[1] + clFreq[2] < 2 && i < 3; i++) {
+        clFreq[i] += !clFreq[i];
+    }
+
+    HuffmanCode cl;
+    make_code(clFreq, CODELEN_CODES, MAX_CODELEN_BITS, &cl);
+
+    int hclen = CODELEN_CODES;
+    while (hclen > 4 && cl.lengths[codelen_order[hclen - 1]] == 0) {
+        hclen--;
+    }
+
+    // Compare the sizes in bits before writing anything
+    uint64_t dynamicBits = 3 + 5 + 5 + 4 + 3 * (uint64_t) hclen;
+    for (int i = 0; i < clCount; i++) {
+        uint8_t s = clSymbols[i];
+        dynamicBits += cl.lengths[s] + (s == 16 ? 2 : s == 17 ? 3 : s == 18 ? 7 : 0);
+    }
+    for (int s = 0; s < LITLEN_CODES; s++) {
+        dynamicBits += (uint64_t) litFreq[s] * (lit.lengths[s] + (s > 256 ? length_extra[s - 257] : 0));
+    }
+    for (int s = 0; s < DIST_CODES; s++) {
+        dynamicBits += (uint64_t) distFreq[s] * (dist.lengths[s] + dist_extra[s]);
+    }
+
+    uint64_t storedBytes = b->rawSize + 5 * ((b->rawSize + 65534) / 65535 + 1);
+
+    if (dynamicBits / 8 + 1 >= storedBytes) {
+        size_t offset = 0;
+        do {
+            size_t n = b->rawSize - offset < 65535 ? b->rawSize - offset : 65535;
+            bool final = last && offset + n == b->rawSize;
+            put_bits(w, final, 3);
+            align_bits(w);
+            uint8_t header[4] = {(uint8_t) n, (uint8_t) (n >> 8), (uint8_t) ~n, (uint8_t) (~n >> 8)};
+            memcpy(w->out + w->pos, header, 4);
+            memcpy(w->out + w->pos + 4, b->raw + offset, n);
+            w->pos += 4 + n;
+            offset += n;
+        } while (offset < b->rawSize);
+        return;
+    }
+
+    put_bits(w, last, 1);
+    put_bits(w, 2, 2);
+    put_bits(w, (uint32_t) (hlit - 257), 5);
+    put_bits(w, (uint32_t) (hdist - 1), 5);
+    put_bits(w, (uint32_t) (hclen - 4), 4);
+    for (int i = 0; i < hclen; i++) {
+        put_bits(w, cl.lengths[codelen_order[i]], 3);
+    }
+    for (int i = 0; i < clCount; i++) {
+        uint8_t s = clSymbols[i];
+        put_bits(w, cl.codes[s], cl.lengths[s]);
+        if (s >= 16) {
+            put_bits(w, clExtra[i], s == 16 ? 2 : s == 17 ? 3 : 7);
+        }
+    }
+
+    for (uint32_t i = 0; i < b->count; i++) {
+        uint32_t t = b->tokens[i];
+        if (t & TOKEN_MATCH) {
+            uint32_t len = (t >> 16) & 0x1ff;
+            uint32_t d = t & 0xffff;
+            int lc = length_codes.code[len];
+            put_bits(w, lit.codes[257 + lc], lit.lengths[257 + lc]);
+            put_bits(w, len - length_base[lc], length_extra[lc]);
+            int dc = dist_code(d);
+            put_bits(w, dist.codes[dc], dist.lengths[dc]);
+            put_bits(w, d - dist_base[dc], dist_extra[dc]);
+        } else {
+            put_bits(w, lit.codes[t], lit.lengths[t]);
+        }
+    }
+    put_bits(w, lit.codes[256], lit.lengths[256]);
+}
+
+static inline size_t match_length(const uint8_t *a, const uint8_t *b, size_t limit) {
+    size_t n = 0;
+    while (n + 8 <= limit) {
+        uint64_t x, y;
+        memcpy(&x, a + n, 8);
+        memcpy(&y, b + n, 8);
+        if (x != y) {
+#ifdef _MSC_VER
+            unsigned long bit;
+            _BitScanForward64(&bit, x ^ y);
+            return n + bit / 8;
+#else
+            return n + (size_t) __builtin_ctzll(x ^ y) / 8;
+#endif
+        }
+        n += 8;
+    }
+    while (n < limit && a[n] == b[n]) {
+        n++;
+    }
+    return n;
+}
+
+typedef struct BandTask {
+    const uint8_t *data;
+    size_t size;
+    size_t rowSize;
+    uint32_t bands;
+    uint8_t *out;  // each band writes at band_offset
+    size_t *outSizes;
+    uint32_t *adlers;
+    uint32_t *tokens;  // BLOCK_TOKENS per band
+    uint32_t *hashes;  // 1 << HASH_BITS per band
+} BandTask;
+
+static size_t band_start(const BandTask *t, uint32_t index) {
+    return t->size * index / t->bands;
+}
+
+// No block is larger than its stored form, and all but the last one in a band cover at least
+// BLOCK_TOKENS bytes, so stored block headers and partial bytes stay below 1/1024 plus a constant
+static size_t band_offset(const BandTask *t, uint32_t index) {
+    size_t start = band_start(t, index);
+    return start + start / 1024 + 64 * (size_t) index;
+}
+
+static void BandFunc(void *arg, uint32_t index) {
+    auto t = (BandTask *) arg;
+    TraceSpan span("screen deflate band", index);
+    const uint8_t *data = t->data;
+    size_t start = band_start(t, index);
+    size_t end = band_start(t, index + 1);
+    bool last = index == t->bands - 1;
+
+    uint32_t distances[3] = {1, 6, (uint32_t) t->rowSize};
+    int numDistances = t->rowSize <= WINDOW_SIZE ? 3 : 2;
+
+    BitWriter w = {t->out + band_offset(t, index), 0, 0, 0};
+    uint32_t *tokens = t->tokens + (size_t) BLOCK_TOKENS * index;
+
+    // Band-relative positions plus one, 0 for empty
+    uint32_t *hashes = t->hashes + ((size_t) index << HASH_BITS);
+    memset(hashes, 0, sizeof(uint32_t) << HASH_BITS);
+
+    size_t p = start;
+    size_t blockStart = start;
+    uint32_t count = 0;
+
+    while (p < end) {
+        size_t best = 0;
+        uint32_t bestDist = 0;
+        size_t limit = end - p < MAX_MATCH ? end - p : MAX_MATCH;
+
+        // Earlier bands are part of the window too, the decoder has them by the time it gets here
+        for (int k = 0; k < numDistances; k++) {
+            uint32_t d = distances[k];
+            if (d <= p) {
+                size_t len = match_length(data + p, data + p - d, limit);
+                if (len > best) {
+                    best = len;
+                    bestDist = d;
+                }
+            }
+        }
+
+        if (best < GOOD_MATCH && limit >= MIN_MATCH) {
+            uint32_t v;
+            memcpy(&v, data + p, 4);
+            uint32_t h = (v * 2654435761u) >> (32 - HASH_BITS);
+            size_t candidate = hashes[h];
+            hashes[h] = (uint32_t) (p - start + 1);
+
+            if (candidate && p - (start + candidate - 1) <= WINDOW_SIZE) {
+                auto d = (uint32_t) (p - (start + candidate - 1));
+                size_t len = match_length(data + p, data + p - d, limit);
+                if (len > best) {
+                    best = len;
+                    bestDist = d;
+                }
+            }
+        }
+
+        if (best >= MIN_MATCH) {
+            tokens[count++] = TOKEN_MATCH | (uint32_t) (best << 16) | bestDist;
+            p += best;
+        } else {
+            tokens[count++] = data[p++];
+        }
+
+        if (count == BLOCK_TOKENS || p == end) {
+            Block b = {tokens, count, data + blockStart, p - blockStart};
+            write_block(&w, &b, last && p == end);
+            blockStart = p;
+            count = 0;
+        }
+    }
+
+    // An empty stored block brings the band to a byte boundary so the next one can follow it
+    if (!last) {
+        put_bits(&w, 0, 3);
+        align_bits(&w);
+        static const uint8_t empty[4] = {0, 0, 0xff, 0xff};
+        memcpy(w.out + w.pos, empty, 4);
+        w.pos += 4;
+    } else {
+        align_bits(&w);
+    }
+
+    t->outSizes[index] = w.pos;
+
+    uLong adler = adler32(0, nullptr, 0);
+    for (size_t i = start; i < end; i += 1u << 30) {
+        adler = adler32(adler, data + i, (uInt) (end - i < (1u << 30) ? end - i : (1u << 30)));
+    }
+    t->adlers[index] = (uint32_t) adler;
+}
+
+static uint32_t band_count(size_t size, uint32_t numThreads) {
+    uint64_t bands = size / MIN_BAND_SIZE;
+    bands = bands < numThreads ? bands : numThreads;
+    return bands ? (uint32_t) bands : 1;
+}
+
+// The pieces of the single allocation: part list, per band state and the output of all bands
+static void band_memory(const BandTask *t, size_t *partsSize, size_t *stateSize, size_t *outSize) {
+    *outSize = band_offset(t, t->bands) + 6;
+    *partsSize = sizeof(jxr_iovec) * (t->bands + 2);
+    *stateSize = (sizeof(size_t) + sizeof(uint32_t) * (1 + BLOCK_TOKENS + (1 << HASH_BITS))) * t->bands;
+}
+
+size_t screen_deflate_memory(size_t size, uint32_t numThreads) {
+    BandTask task = {};
+    task.size = size;
+    task.bands = band_count(size, numThreads);
+
+    size_t partsSize, stateSize, outSize;
+    band_memory(&task, &partsSize, &stateSize, &outSize);
+    return partsSize + stateSize + outSize;
+}
+
+int screen_deflate(const jxr_options *options, const uint8_t *data, size_t size, size_t rowSize,
+                   uint32_t numThreads, DeflateParts *result) {
+    BandTask task;
+    task.data = data;
+    task.size = size;
+    task.rowSize = rowSize;
+    task.bands = band_count(size, numThreads);
+
+    size_t partsSize, stateSize, outSize;
+    band_memory(&task, &partsSize, &stateSize, &outSize);
+
+    auto memory = (uint8_t *) frame_alloc(options, partsSize + stateSize + outSize, JXR_MEMORY_ENCODER);
+    if (memory == nullptr) {
+        return 1;
+    }
+
+    auto parts = (jxr_iovec *) memory;
+    task.outSizes = (size_t *) (memory + partsSize);
+    task.adlers = (uint32_t *) (task.outSizes + task.bands);
+    task.tokens = task.adlers + task.bands;
+    task.hashes = task.tokens + (size_t) BLOCK_TOKENS * task.bands;
+    task.out = (uint8_t *) (task.hashes + ((size_t) task.bands << HASH_BITS));
+
+    if (run_parallel(options, task.bands, BandFunc, &task)) {
+        jxr_free(options, memory);
+        return 1;
+    }
+
+    // zlib header for a 32 KB window and the fastest level, and the Adler-32 trailer
+    uint8_t *header = task.out + outSize - 6;
+    header[0] = 0x78;
+    header[1] = 0x01;
+
+    uint32_t adler = task.adlers[0];
+    for (uint32_t i = 1; i < task.bands; i++) {
+        size_t length = band_start(&task, i + 1) - band_start(&task, i);
+        adler = (uint32_t) adler32_combine(adler, task.adlers[i], (z_off_t) length);
+    }
+    uint8_t *trailer = header + 2;
+    trailer[0] = (uint8_t) (adler >> 24);
+    trailer[1] = (uint8_t) (adler >> 16);
+    trailer[2] = (uint8_t) (adler >> 8);
+    trailer[3] = (uint8_t) adler;
+
+    parts[0] = {header, 2};
+    for (uint32_t i = 0; i < task.bands; i++) {
+        parts[i + 1] = {task.out + band_offset(&task, i), task.outSizes[i]};
+    }
+    parts[task.bands + 1] = {trailer, 4};
+
+    result->memory = memory;
+    result->parts = parts;
+    result->count = task.bands + 2;
+    return 0;
+}
@@ -0,0 +1,160 @@
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+#include "internal.h"
+
+// One parallel_for call. Workers and the calling thread claim indices until none are left.
+typedef struct PoolBatch {
+    jxr_task_fn fn;
+    void *arg;
+    uint32_t count;
+    std::atomic<uint32_t> next;
+    uint32_t done;  // guarded by the pool mutex
+    PoolBatch *prev;
+    PoolBatch *nextBatch;
+} PoolBatch;
+
+struct jxr_thread_pool {
+    std::mutex mutex;
+    std::condition_variable workAvailable;
+    std::condition_variable batchDone;
+    PoolBatch *head = nullptr;
+    PoolBatch *tail = nullptr;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
+
+static void unlink_batch(jxr_thread_pool *pool, PoolBatch *b) {
+    if (b->prev) {
+        b->prev->nextBatch = b->nextBatch;
+    } else if (pool->head == b) {
+        pool->head = b->nextBatch;
+    }
+    if (b->nextBatch) {
+        b->nextBatch->prev = b->prev;
+    } else if (pool->tail == b) {
+        pool->tail = b->prev;
+    }
+    b->prev = b->nextBatch = nullptr;
+}
+
+// Runs indices of the batch until it is exhausted, returns with the mutex held
+static void run_batch(jxr_thread_pool *pool, PoolBatch *b, std::unique_lock<std::mutex> &lock) {
+    while (true) {
+        uint32_t index = b->next.fetch_add(1);
+        if (index >= b->count) {
+            // Nothing left to claim, stop handing this batch out
+            unlink_batch(pool, b);
+            return;
+        }
+
+        lock.unlock();
+        b->fn(b->arg, index);
+        lock.lock();
+
+        if (++b->done == b->count) {
+            pool->batchDone.notify_all();
+        }
+    }
+}
+
+static void worker_main(jxr_thread_pool *pool) {
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    while (true) {
+        {
+            TraceSpan span("wait for work");
+            pool->workAvailable.wait(lock, [pool] { return pool->stopping || pool->head != nullptr; });
+        }
+        if (pool->head == nullptr) {
+            return;
+        }
+        run_batch(pool, pool->head, lock);
+    }
+}
+
+jxr_thread_pool *jxr_thread_pool_create(uint32_t num_threads) {
+    if (num_threads == 0) {
+        num_threads = jxr_default_threads();
+    }
+
+    auto pool = new(std::nothrow) jxr_thread_pool;
+    if (pool == nullptr) {
+        return nullptr;
+    }
+
+    // The thread calling parallel_for works as well, so one fewer worker keeps num_threads busy
+    try {
+        for (uint32_t i = 1; i < num_threads; i++) {
+            pool->workers.emplace_back(worker_main, pool);
+        }
+    } catch (...) {
+        jxr_thread_pool_destroy(pool);
+        return nullptr;
+    }
+
+    return pool;
+}
+
+void jxr_thread_pool_destroy(jxr_thread_pool *pool) {
+    if (pool == nullptr) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(pool->mutex);
+        pool->stopping = true;
+    }
+    pool->workAvailable.notify_all();
+
+    for (auto &worker: pool->workers) {
+        worker.join();
+    }
+
+    delete pool;
+}
+
+uint32_t jxr_thread_pool_size(const jxr_thread_pool *pool) {
+    return (uint32_t) pool->workers.size() + 1;
+}
+
+int jxr_thread_pool_parallel_for(void *user, uint32_t count, jxr_task_fn fn, void *arg) {
+    auto pool = (jxr_thread_pool *) user;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    PoolBatch b;
+    b.fn = fn;
+    b.arg = arg;
+    b.count = count;
+    b.next = 0;
+    b.done = 0;
+    b.prev = nullptr;
+    b.nextBatch = nullptr;
+
+    std::unique_lock<std::mutex> lock(pool->mutex);
+
+    // Concurrent callers share the workers in submission order
+    b.prev = pool->tail;
+    if (pool->tail) {
+        pool->tail->nextBatch = &b;
+    } else {
+        pool->head = &b;
+    }
+    pool->tail = &b;
+
+    if (count > 1) {
+        pool->workAvailable.notify_all();
+    }
+
+    run_batch(pool, &b, lock);
+
+    TraceSpan span("wait for batch");
+    pool->batchDone.wait(lock, [&b] { return b.done == b.count; });
+
+    return 0;
+}
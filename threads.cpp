@@ -0,0 +1,196 @@
+#include <chrono>
+#include <cstdlib>
+#include "internal.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+typedef struct TaskData {
+    jxr_task_fn fn;
+    void *arg;
+    uint32_t index;
+} TaskData;
+
+#ifdef _WIN32
+static DWORD WINAPI TaskThread(LPVOID lpParam) {
+    auto t = (TaskData *) lpParam;
+    t->fn(t->arg, t->index);
+    return 0;
+}
+#else
+static void *TaskThread(void *param) {
+    auto t = (TaskData *) param;
+    t->fn(t->arg, t->index);
+    return nullptr;
+}
+#endif
+
+uint32_t jxr_default_threads(void) {
+#ifdef _WIN32
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+    uint32_t processors = systemInfo.dwNumberOfProcessors;
+#else
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t processors = online > 0 ? (uint32_t) online : 1;
+#endif
+    uint32_t numThreads = processors / 2 < 8 ? processors / 2 : 8;
+    return numThreads ? numThreads : 1;
+}
+
+double monotonic_seconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double process_cpu_seconds() {
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user)) {
+        return 0;
+    }
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return (double) (k.QuadPart + u.QuadPart) * 1e-7;
+#else
+    struct timespec ts;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts)) {
+        return 0;
+    }
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+#endif
+}
+
+static const char *const stage_names[JXR_STAGE_COUNT] = {"decode", "convert", "statistics", "select", "filter",
+                                                         "encode", "quality"};
+
+StageClock stage_start(const jxr_options *options) {
+    StageClock clock;
+    clock.counting = options->counters != 0;
+    if (clock.counting) {
+        counters_start(&clock.counters, true);
+    }
+    clock.traceBegin = jxr_trace_begin();
+    clock.wall = monotonic_seconds();
+    clock.cpu = process_cpu_seconds();
+    return clock;
+}
+
+void stage_stop(StageClock *clock, jxr_timings *timings, jxr_stage stage) {
+    double wall = monotonic_seconds() - clock->wall;
+    double cpu = process_cpu_seconds() - clock->cpu;
+    jxr_trace_end(stage_names[stage], -1, clock->traceBegin);
+
+    jxr_counters counters = {};
+    if (clock->counting) {
+        counters_stop(&clock->counters, &counters);
+    }
+
+    if (timings) {
+        jxr_stage_time *time = &timings->stages[stage];
+        time->wall += wall;
+        time->cpu += cpu;
+        for (int i = 0; i < JXR_COUNTER_COUNT; i++) {
+            time->counters.values[i] += counters.values[i];
+        }
+        time->counters.available |= counters.available;
+    }
+}
+
+uint32_t resolve_threads(const jxr_options *options) {
+    if (options->threading.num_threads) {
+        return options->threading.num_threads;
+    }
+    return jxr_default_threads();
+}
+
+// Runs fn for each index on its own thread, unless the caller supplied its own scheduler
+int run_parallel(const jxr_options *options, uint32_t count, jxr_task_fn fn, void *arg) {
+    if (options->threading.parallel_for) {
+        return options->threading.parallel_for(options->threading.user, count, fn, arg);
+    }
+
+    if (count == 1) {
+        fn(arg, 0);
+        return 0;
+    }
+
+    auto tasks = (TaskData *) jxr_malloc(options, sizeof(TaskData) * count, JXR_MEMORY_OTHER);
+    if (tasks == nullptr) {
+        return 1;
+    }
+
+    int ret = 0;
+
+#ifdef _WIN32
+    auto hThreadArray = (HANDLE *) jxr_malloc(options, sizeof(HANDLE) * count, JXR_MEMORY_OTHER);
+    if (hThreadArray == nullptr) {
+        jxr_free(options, tasks);
+        return 1;
+    }
+
+    uint32_t started = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        tasks[i] = {fn, arg, i};
+        HANDLE hThread = CreateThread(nullptr, 0, TaskThread, &tasks[i], 0, nullptr);
+        if (!hThread) {
+            ret = 1;
+            break;
+        }
+        hThreadArray[started++] = hThread;
+    }
+
+    TraceSpan span("join threads");
+
+    // WaitForMultipleObjects is limited to MAXIMUM_WAIT_OBJECTS handles per call
+    for (uint32_t i = 0; i < started; i += MAXIMUM_WAIT_OBJECTS) {
+        DWORD n = started - i < MAXIMUM_WAIT_OBJECTS ? started - i : MAXIMUM_WAIT_OBJECTS;
+        WaitForMultipleObjects(n, hThreadArray + i, TRUE, INFINITE);
+    }
+
+    for (uint32_t i = 0; i < started; i++) {
+        DWORD exitCode;
+        if (!GetExitCodeThread(hThreadArray[i], &exitCode) || exitCode) {
+            ret = 1;
+        }
+        CloseHandle(hThreadArray[i]);
+    }
+
+    jxr_free(options, hThreadArray);
+#else
+    auto threads = (pthread_t *) jxr_malloc(options, sizeof(pthread_t) * count, JXR_MEMORY_OTHER);
+    if (threads == nullptr) {
+        jxr_free(options, tasks);
+        return 1;
+    }
+
+    uint32_t started = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        tasks[i] = {fn, arg, i};
+        if (pthread_create(&threads[i], nullptr, TaskThread, &tasks[i])) {
+            ret = 1;
+            break;
+        }
+        started++;
+    }
+
+    TraceSpan span("join threads");
+    for (uint32_t i = 0; i < started; i++) {
+        if (pthread_join(threads[i], nullptr)) {
+            ret = 1;
+        }
+    }
+
+    jxr_free(options, threads);
+#endif
+
+    jxr_free(options, tasks);
+    return ret;
+}
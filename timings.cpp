@@ -0,0 +1,165 @@
+#include "timings.h"
+
+static const char *const stage_names[JXR_STAGE_COUNT] = {"decode", "convert", "statistics", "select", "filter",
+                                                         "encode", "quality"};
+static const char *const counter_names[JXR_COUNTER_COUNT] = {"cycles", "instructions", "llc_misses",
+                                                             "dtlb_misses"};
+
+typedef struct ThreadSpread {
+    uint32_t count;  // threads with a timing
+    double min;
+    double max;
+    double mean;
+} ThreadSpread;
+
+static ThreadSpread thread_spread(const jxr_timings *t) {
+    ThreadSpread s = {t->convert_threads < JXR_TIMED_THREADS ? t->convert_threads : JXR_TIMED_THREADS, 0, 0, 0};
+    for (uint32_t i = 0; i < s.count; i++) {
+        double seconds = t->convert_thread_wall[i];
+        s.min = i == 0 || seconds < s.min ? seconds : s.min;
+        s.max = seconds > s.max ? seconds : s.max;
+        s.mean += seconds;
+    }
+    if (s.count) {
+        s.mean /= s.count;
+    }
+    return s;
+}
+
+static void print_json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        auto c = (unsigned char) *s;
+        if (c == '"' || c == '\\') {
+            fprintf(f, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static void json_counters(FILE *f, const jxr_counters *c) {
+    fputc('{', f);
+    for (int i = 0; i < JXR_COUNTER_COUNT; i++) {
+        if (c->available & 1u << i) {
+            fprintf(f, "\"%s\":%llu", counter_names[i], (unsigned long long) c->values[i]);
+        } else {
+            fprintf(f, "\"%s\":null", counter_names[i]);
+        }
+        fputc(i + 1 < JXR_COUNTER_COUNT ? ',' : '}', f);
+    }
+}
+
+// Columns for the text table, - where the host lacks the counter
+static void text_counters(FILE *f, const jxr_counters *c) {
+    char cells[JXR_COUNTER_COUNT][24];
+    for (int i = 0; i < JXR_COUNTER_COUNT; i++) {
+        if (c->available & 1u << i) {
+            snprintf(cells[i], sizeof(cells[i]), "%.1fM", (double) c->values[i] / 1e6);
+        } else {
+            snprintf(cells[i], sizeof(cells[i]), "-");
+        }
+    }
+
+    const uint32_t ipc = 1u << JXR_COUNTER_CYCLES | 1u << JXR_COUNTER_INSTRUCTIONS;
+    char ratio[16] = "-";
+    if ((c->available & ipc) == ipc && c->values[JXR_COUNTER_CYCLES]) {
+        snprintf(ratio, sizeof(ratio), "%.2f",
+                 (double) c->values[JXR_COUNTER_INSTRUCTIONS] / (double) c->values[JXR_COUNTER_CYCLES]);
+    }
+    fprintf(f, " %10s %10s %6s %10s %10s", cells[0], cells[1], ratio, cells[2], cells[3]);
+}
+
+void print_timings(FILE *f, TimingsFormat format, bool counters, const char *name, const jxr_result *result) {
+    const jxr_timings *t = &result->timings;
+
+    jxr_stage_time total = {};
+    for (int i = 0; i < JXR_STAGE_COUNT; i++) {
+        total.wall += t->stages[i].wall;
+        total.cpu += t->stages[i].cpu;
+    }
+
+    jxr_counters totalCounters = {};
+    for (int i = 0; i < JXR_STAGE_COUNT; i++) {
+        for (int c = 0; c < JXR_COUNTER_COUNT; c++) {
+            totalCounters.values[c] += t->stages[i].counters.values[c];
+        }
+        totalCounters.available |= t->stages[i].counters.available;
+    }
+    bool requested = counters;
+    counters = counters && totalCounters.available;
+
+    double megapixels = (double) result->width * result->height / 1e6;
+    double rate = total.wall > 0 ? megapixels / total.wall : 0;
+    ThreadSpread spread = thread_spread(t);
+
+    if (format == TIMINGS_JSON) {
+        fputs("{\"input\":", f);
+        print_json_string(f, name);
+        fprintf(f, ",\"width\":%u,\"height\":%u,\"threads\":%u,\"bytes_in\":%llu,\"bytes_out\":%llu,"
+                   "\"mp_per_s\":%.3f,\"stages\":{", result->width, result->height, result->threads,
+                (unsigned long long) t->bytes_in, (unsigned long long) t->bytes_out, rate);
+        for (int i = 0; i < JXR_STAGE_COUNT; i++) {
+            fprintf(f, "%s\"%s\":{\"wall_ms\":%.3f,\"cpu_ms\":%.3f", i ? "," : "", stage_names[i],
+                    t->stages[i].wall * 1000, t->stages[i].cpu * 1000);
+            if (counters) {
+                fputs(",\"counters\":", f);
+                json_counters(f, &t->stages[i].counters);
+            }
+            fputc('}', f);
+        }
+        fprintf(f, "},\"total_ms\":{\"wall\":%.3f,\"cpu\":%.3f},\"convert_threads_ms\":[", total.wall * 1000,
+                total.cpu * 1000);
+        for (uint32_t i = 0; i < spread.count; i++) {
+            fprintf(f, "%s%.3f", i ? "," : "", t->convert_thread_wall[i] * 1000);
+        }
+        fputc(']', f);
+        if (counters) {
+            fputs(",\"convert_threads_counters\":[", f);
+            for (uint32_t i = 0; i < spread.count; i++) {
+                fputs(i ? "," : "", f);
+                json_counters(f, &t->convert_thread_counters[i]);
+            }
+            fputc(']', f);
+        }
+        fputs("}\n", f);
+        return;
+    }
+
+    fprintf(f, "%s: timings\n  %-10s %10s %10s", name, "stage", "wall ms", "cpu ms");
+    if (counters) {
+        fprintf(f, " %10s %10s %6s %10s %10s", "cycles", "instr", "IPC", "LLC miss", "dTLB miss");
+    }
+    fputc('\n', f);
+    for (int i = 0; i < JXR_STAGE_COUNT; i++) {
+        fprintf(f, "  %-10s %10.1f %10.1f", stage_names[i], t->stages[i].wall * 1000, t->stages[i].cpu * 1000);
+        if (counters) {
+            text_counters(f, &t->stages[i].counters);
+        }
+        fputc('\n', f);
+    }
+    fprintf(f, "  %-10s %10.1f %10.1f", "total", total.wall * 1000, total.cpu * 1000);
+    if (counters) {
+        text_counters(f, &totalCounters);
+    }
+    fputc('\n', f);
+    fprintf(f, "  %ux%u, %.2f MP/s, %llu bytes in, %llu bytes out\n", result->width, result->height, rate,
+            (unsigned long long) t->bytes_in, (unsigned long long) t->bytes_out);
+    if (spread.count) {
+        fprintf(f, "  conversion threads: %u, %.1f to %.1f ms (mean %.1f ms, spread %.1f%%)\n",
+                t->convert_threads, spread.min * 1000, spread.max * 1000, spread.mean * 1000,
+                spread.mean > 0 ? (spread.max - spread.min) / spread.mean * 100 : 0);
+    }
+    if (counters) {
+        for (uint32_t i = 0; i < spread.count; i++) {
+            fprintf(f, "  thread %-3u %10.1f %10s", i, t->convert_thread_wall[i] * 1000, "");
+            text_counters(f, &t->convert_thread_counters[i]);
+            fputc('\n', f);
+        }
+    } else if (requested) {
+        fputs("  hardware counters unavailable on this host\n", f);
+    }
+}
@@ -0,0 +1,18 @@
+// Per-stage timing reports for --timings
+#ifndef JXR_TIMINGS_H
+#define JXR_TIMINGS_H
+
+#include <cstdio>
+#include "jxr_to_png.h"
+
+typedef enum TimingsFormat {
+    TIMINGS_OFF = 0,
+    TIMINGS_TEXT,
+    TIMINGS_JSON,
+} TimingsFormat;
+
+// Text is a table per image, JSON is one object per line. counters adds the hardware counters, or
+// a note that the host has none.
+void print_timings(FILE *f, TimingsFormat format, bool counters, const char *name, const jxr_result *result);
+
+#endif
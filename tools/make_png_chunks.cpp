@@ -0,0 +1,86 @@
+// Generates png_chunks.h at build time: the header chunks that are the same for every output file,
+// complete with length, type and CRC, so the ICC profile is not compressed again for each file
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include "icc_profile.h"
+
+#ifdef JXR_SYSTEM_ZLIB
+#include <zlib.h>
+#else
+#include "zlib/zlib.h"
+#endif
+
+#define MAX_CHUNKS_SIZE 8192
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t) (v >> 24);
+    p[1] = (uint8_t) (v >> 16);
+    p[2] = (uint8_t) (v >> 8);
+    p[3] = (uint8_t) v;
+}
+
+// Fills in the length, type and CRC around size bytes of data already at chunk + 8
+static size_t make_chunk(uint8_t *chunk, const char *type, uint32_t size) {
+    put_be32(chunk, size);
+    memcpy(chunk + 4, type, 4);
+    put_be32(chunk + 8 + size, (uint32_t) crc32(0, chunk + 4, size + 4));
+    return size + 12;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "make_png_chunks output.h\n");
+        return 1;
+    }
+
+    static uint8_t chunks[MAX_CHUNKS_SIZE];
+    size_t size = 0;
+
+    // iCCP: profile name, null separator, compression method 0, then the zlib stream
+    uint8_t *data = chunks + size + 8;
+    size_t nameSize = strlen(icc_name) + 1;
+    memcpy(data, icc_name, nameSize);
+    data[nameSize] = 0;
+    uLongf compressedSize = (uLongf) (MAX_CHUNKS_SIZE - size - 8 - nameSize - 1 - 4);
+    if (compress2(data + nameSize + 1, &compressedSize, icc_data, sizeof(icc_data), 9) != Z_OK) {
+        fprintf(stderr, "Failed to compress ICC profile\n");
+        return 1;
+    }
+    size += make_chunk(chunks + size, "iCCP", (uint32_t) (nameSize + 1 + compressedSize));
+
+    // sBIT: 10 significant bits per channel
+    const uint8_t sbit[] = {10, 10, 10};
+    memcpy(chunks + size + 8, sbit, sizeof(sbit));
+    size += make_chunk(chunks + size, "sBIT", sizeof(sbit));
+
+    // cHRM: BT.2020 primaries and D65 white point, times 100000
+    const uint32_t chrm[] = {31270, 32900, 70800, 29200, 17000, 79700, 13100, 4600};
+    for (size_t i = 0; i < sizeof(chrm) / sizeof(chrm[0]); i++) {
+        put_be32(chunks + size + 8 + 4 * i, chrm[i]);
+    }
+    size += make_chunk(chunks + size, "cHRM", sizeof(chrm));
+
+    // cICP: BT.2020 primaries, PQ transfer, RGB, full range
+    const uint8_t cicp[] = {9, 16, 0, 1};
+    memcpy(chunks + size + 8, cicp, sizeof(cicp));
+    size += make_chunk(chunks + size, "cICP", sizeof(cicp));
+
+    FILE *f = fopen(argv[1], "w");
+    if (f == nullptr) {
+        perror("Failed to create output");
+        return 1;
+    }
+
+    fprintf(f, "// Generated by make_png_chunks from icc_profile.h\n");
+    fprintf(f, "const unsigned char png_static_chunks[] =\n        {");
+    for (size_t i = 0; i < size; i++) {
+        fprintf(f, "0x%02x%s", chunks[i], i + 1 == size ? "};\n" : (i % 18 == 17 ? ",\n         " : ", "));
+    }
+
+    if (fclose(f)) {
+        perror("Failed to write output");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,236 @@
+// Per-thread ring buffers of spans, written as Chrome trace event JSON. Each thread only writes
+// its own buffer, so recording takes no lock once the buffer exists. Buffers of threads that have
+// exited are handed to new ones, so the short lived threads of run_parallel share a few lanes.
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include "internal.h"
+
+#define TRACE_DEFAULT_EVENTS 65536
+#define TRACE_MAX_THREADS 1024
+#define TRACE_WRITE_BUFFER (64 * 1024)
+
+typedef struct TraceEvent {
+    const char *name;
+    int64_t arg;
+    double begin;
+    double end;
+} TraceEvent;
+
+typedef struct TraceBuffer {
+    uint32_t tid;
+    bool active;  // a live thread owns it
+    uint32_t capacity;
+    uint64_t count;  // events recorded, the last capacity of them are kept
+    TraceEvent *events;
+} TraceBuffer;
+
+static std::atomic<bool> trace_on(false);
+static std::atomic<uint32_t> trace_recording(0);  // jxr_trace_end calls that may be writing an event
+static std::mutex trace_mutex;
+static TraceBuffer *trace_buffers[TRACE_MAX_THREADS];  // guarded by trace_mutex
+static uint32_t trace_threads;
+static uint32_t trace_capacity = TRACE_DEFAULT_EVENTS;
+static double trace_origin;
+
+typedef struct ThreadSlot {
+    TraceBuffer *buffer = nullptr;
+
+    ~ThreadSlot() {
+        if (buffer) {
+            std::lock_guard<std::mutex> guard(trace_mutex);
+            buffer->active = false;
+        }
+    }
+} ThreadSlot;
+
+static thread_local ThreadSlot thread_slot;
+
+static TraceBuffer *register_thread() {
+    std::lock_guard<std::mutex> guard(trace_mutex);
+    for (uint32_t i = 0; i < trace_threads; i++) {
+        if (!trace_buffers[i]->active) {
+            trace_buffers[i]->active = true;
+            return trace_buffers[i];
+        }
+    }
+    if (trace_threads == TRACE_MAX_THREADS) {
+        return nullptr;
+    }
+
+    auto b = (TraceBuffer *) calloc(1, sizeof(TraceBuffer));
+    if (b == nullptr) {
+        return nullptr;
+    }
+    b->events = (TraceEvent *) malloc(sizeof(TraceEvent) * trace_capacity);
+    if (b->events == nullptr) {
+        free(b);
+        return nullptr;
+    }
+    b->capacity = trace_capacity;
+    b->tid = trace_threads + 1;
+    b->active = true;
+    trace_buffers[trace_threads++] = b;
+    return b;
+}
+
+// Threads that saw tracing on just before it was stopped may still be writing their last event
+static void wait_for_recording() {
+    while (trace_recording.load()) {
+        std::this_thread::yield();
+    }
+}
+
+jxr_status jxr_trace_start(uint32_t events_per_thread) {
+    // Waiting happens before taking the lock, which a recording thread may need to register
+    if (trace_on.load()) {
+        return JXR_ERROR_INVALID_ARGUMENT;
+    }
+    wait_for_recording();
+
+    std::lock_guard<std::mutex> guard(trace_mutex);
+    if (trace_on.load()) {
+        return JXR_ERROR_INVALID_ARGUMENT;
+    }
+
+    trace_capacity = events_per_thread ? events_per_thread : TRACE_DEFAULT_EVENTS;
+
+    // Buffers stay with their threads, a new capacity only replaces the events
+    for (uint32_t i = 0; i < trace_threads; i++) {
+        TraceBuffer *b = trace_buffers[i];
+        if (b->capacity != trace_capacity) {
+            auto events = (TraceEvent *) malloc(sizeof(TraceEvent) * trace_capacity);
+            if (events) {
+                free(b->events);
+                b->events = events;
+                b->capacity = trace_capacity;
+            }
+        }
+        b->count = 0;
+    }
+
+    trace_origin = monotonic_seconds();
+    trace_on.store(true);
+    return JXR_OK;
+}
+
+void jxr_trace_stop(void) {
+    trace_on.store(false);
+}
+
+double jxr_trace_begin(void) {
+    return trace_on.load(std::memory_order_relaxed) ? monotonic_seconds() : 0;
+}
+
+void jxr_trace_end(const char *name, int64_t arg, double begin) {
+    if (!begin) {
+        return;
+    }
+
+    trace_recording.fetch_add(1);
+    if (trace_on.load() &&
+        (thread_slot.buffer != nullptr || (thread_slot.buffer = register_thread()) != nullptr)) {
+        TraceBuffer *b = thread_slot.buffer;
+        TraceEvent *e = &b->events[b->count % b->capacity];
+        e->name = name;
+        e->arg = arg;
+        e->begin = begin;
+        e->end = monotonic_seconds();
+        b->count++;
+    }
+    trace_recording.fetch_sub(1);
+}
+
+typedef struct TraceWriter {
+    const jxr_stream *out;
+    char buffer[TRACE_WRITE_BUFFER];
+    size_t used;
+    int failed;
+} TraceWriter;
+
+static void writer_flush(TraceWriter *w) {
+    if (w->used && !w->failed) {
+        w->failed = w->out->write(w->out->user, w->buffer, w->used);
+    }
+    w->used = 0;
+}
+
+// Events are far shorter than the buffer, so one that does not fit goes into an empty one
+static void writer_printf(TraceWriter *w, const char *format, ...) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(w->buffer + w->used, sizeof(w->buffer) - w->used, format, args);
+        va_end(args);
+
+        if (n >= 0 && (size_t) n < sizeof(w->buffer) - w->used) {
+            w->used += n;
+            return;
+        }
+        writer_flush(w);
+    }
+}
+
+// Span names are fixed strings, which rarely need quotes or backslashes escaped
+static void writer_name(TraceWriter *w, const char *name) {
+    if (strpbrk(name, "\"\\") == nullptr) {
+        writer_printf(w, "%s", name);
+        return;
+    }
+    for (; *name; name++) {
+        writer_printf(w, *name == '"' || *name == '\\' ? "\\%c" : "%c", *name);
+    }
+}
+
+jxr_status jxr_trace_write(const jxr_stream *out) {
+    if (out == nullptr || out->write == nullptr || trace_on.load()) {
+        return JXR_ERROR_INVALID_ARGUMENT;
+    }
+    wait_for_recording();
+
+    auto w = (TraceWriter *) malloc(sizeof(TraceWriter));
+    if (w == nullptr) {
+        return JXR_ERROR_OUT_OF_MEMORY;
+    }
+    w->out = out;
+    w->used = 0;
+    w->failed = 0;
+
+    std::lock_guard<std::mutex> guard(trace_mutex);
+
+    writer_printf(w, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+                     "{\"ph\":\"M\",\"pid\":1,\"tid\":0,\"name\":\"process_name\",\"args\":{\"name\":\"jxr_to_png\"}}");
+
+    for (uint32_t i = 0; i < trace_threads; i++) {
+        const TraceBuffer *b = trace_buffers[i];
+        writer_printf(w, ",\n{\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"name\":\"thread_name\",\"args\":{\"name\":\"thread %u\"}}",
+                      b->tid, b->tid);
+
+        uint64_t first = b->count > b->capacity ? b->count - b->capacity : 0;
+        for (uint64_t n = first; n < b->count; n++) {
+            const TraceEvent *e = &b->events[n % b->capacity];
+            writer_printf(w, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"name\":\"", b->tid);
+            writer_name(w, e->name);
+            writer_printf(w, "\",\"ts\":%.3f,\"dur\":%.3f", (e->begin - trace_origin) * 1e6,
+                          (e->end - e->begin) * 1e6);
+            if (e->arg >= 0) {
+                writer_printf(w, ",\"args\":{\"n\":%lld}", (long long) e->arg);
+            }
+            writer_printf(w, "}");
+        }
+    }
+
+    writer_printf(w, "\n]}\n");
+    writer_flush(w);
+    if (!w->failed && out->flush) {
+        w->failed = out->flush(out->user);
+    }
+
+    int failed = w->failed;
+    free(w);
+    return failed ? JXR_ERROR_ENCODE : JXR_OK;
+}